@@ -17,39 +17,124 @@
 //
 
 #include "hidapi.h"
-#include "imxusb.h"
-#include <stdio.h>
-
-#ifndef _WIN32
-
-// posix includes
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-// function macros
-#define SLEEP(x) usleep(x * 1000)
-#define TRACE(msg...) \
-    (fprintf(stderr, msg))
-
-#else // windows
-
-// fixed width integers
-// unfortunally, VC++ lacks unsigned types
-typedef __int8 uint8_t;
-typedef __int16 uint16_t;
-typedef __int32 uint32_t;
-typedef __int64 uint64_t;
-// WinRT includes
-#include <windows.h>
-#include <memory.h>
-// function macros
-#define SLEEP(x) Sleep(x)
-#define TRACE printf
+#include "imxusb_private.h"
 
+int g_imx50_log_mask = ERROR_LOG;
+
+// hidapi only gives a path when enumerating, keep it
+typedef struct {
+    hid_device *handle;
+    char path[REENUM_PORT_SIZE];
+} imx50_hidapi_t;
+
+/**
+    @brief Opens the first iMX50 found with hidapi
+ 
+    @return The transport context, NULL if none found
+ */
+void *imx50_hidapi_open(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth) {
+    imx50_hidapi_t *hid;
+    struct hid_device_info *dev;
+    
+    (void)queue_depth; // hidapi queues reads itself
+    dev = hid_enumerate(vendor_id, product_id);
+    if(dev == NULL) {
+        return NULL;
+    }
+    hid = malloc(sizeof(imx50_hidapi_t));
+    if(!hid) {
+        hid_free_enumeration(dev);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Opening device VID:%04hX PID:%04hx path: %s [%s:%d]\n", 
+        __FUNCTION__, dev->vendor_id, dev->product_id, dev->path, __FILE__, __LINE__);
+    snprintf(hid->path, sizeof(hid->path), "%s", dev->path);
+    hid->handle = hid_open_path(dev->path);
+    hid_free_enumeration(dev);
+    if(hid->handle == NULL) {
+        free(hid);
+        return NULL;
+    }
+    
+    return hid;
+}
+
+int imx50_hidapi_write(void *context, const unsigned char *data, unsigned int size) {
+    return hid_write(((imx50_hidapi_t*)context)->handle, data, size);
+}
+
+int imx50_hidapi_read(void *context, unsigned char *data, unsigned int size, int timeout) {
+    if(timeout < 0) {
+        return hid_read(((imx50_hidapi_t*)context)->handle, data, size);
+    }
+    return hid_read_timeout(((imx50_hidapi_t*)context)->handle, data, size, timeout);
+}
+
+void imx50_hidapi_close(void *context) {
+    hid_close(((imx50_hidapi_t*)context)->handle);
+    free(context);
+}
+
+/**
+    @brief Gets the port of the open device
+ 
+    On Linux, hidraw paths are turned into the USB port. 
+    Other paths (hidapi's libusb backend, OS X, Windows) 
+    are used as they are.
+ */
+int imx50_hidapi_port(void *context, char *port, unsigned int size) {
+    imx50_hidapi_t *hid = (imx50_hidapi_t*)context;
+    
+#ifdef __linux__
+    if(strncmp(hid->path, "/dev/hidraw", 11) == 0) {
+        return imx50_sysfs_port(hid->path + 5, port, size);
+    }
+#endif
+    snprintf(port, size, "%s", hid->path);
+    return 0;
+}
+
+/**
+    @brief Looks for a device on a port
+ 
+    Without sysfs, only HID devices can be seen and the 
+    port is the hidapi path.
+ */
+int imx50_hidapi_probe(void *context, const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum) {
+    struct hid_device_info *devs, *dev;
+    int found = 0;
+    
+#ifdef __linux__
+    if(strncmp(((imx50_hidapi_t*)context)->path, "/dev/hidraw", 11) == 0) {
+        return imx50_sysfs_probe(port, vendor_id, product_id, devnum);
+    }
 #endif
+    devs = hid_enumerate(0, 0);
+    for(dev = devs; dev != NULL; dev = dev->next) {
+        if(strcmp(dev->path, port) == 0) {
+            *vendor_id = dev->vendor_id;
+            *product_id = dev->product_id;
+            *devnum = 0;
+            found = 1;
+            break;
+        }
+    }
+    hid_free_enumeration(devs);
+    
+    return found;
+}
 
-int g_imx50_log_mask = ERROR_LOG;
+const imx50_transport_t g_imx50_hidapi_transport = {
+    "hidapi",
+    imx50_hidapi_open,
+    imx50_hidapi_write,
+    imx50_hidapi_read,
+    imx50_hidapi_close,
+    NULL,
+    imx50_hidapi_port,
+    imx50_hidapi_probe
+};
 
 /**
     @brief Get a iMX50 usb download device
@@ -60,23 +145,94 @@ int g_imx50_log_mask = ERROR_LOG;
     @return A device will be returned on success, NULL on error
 */
 IMX50USB_EXPORT imx50_device_t *imx50_init_device() {
-    hid_device *handle = NULL;
-    struct hid_device_info *dev;
+    return imx50_open_device(TRANSPORT_HIDAPI, 0);
+}
+
+/**
+    @brief Makes a handle with default settings
     
-    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Enumerating devices [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-    while(handle == NULL) {
-        dev = hid_enumerate(IMX50_VID, IMX50_PID);
-        if(dev == NULL) {
-            SLEEP(100);
-            continue; // loop
-        }
-        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Opening device VID:%04hX PID:%04hx path: %s [%s:%d]\n", 
-            __FUNCTION__, dev->vendor_id, dev->product_id, dev->path, __FILE__, __LINE__);
-        handle = hid_open(dev->vendor_id, dev->product_id, dev->serial_number);
-        hid_free_enumeration(dev);
+    @param transport How reports are sent, not opened yet
+    
+    @return The handle, NULL if out of memory
+ */
+imx50_device_t *imx50_new_device(const imx50_transport_t *transport) {
+    imx50_device_t *device;
+    unsigned int i;
+    
+    device = malloc(sizeof(imx50_device_t));
+    if(!device) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(device, 0, sizeof(imx50_device_t));
+    for(i = 0; i < TIMEOUT_COUNT; i++) {
+        device->timeouts[i] = DEFAULT_TIMEOUT;
+    }
+    device->transport = transport;
+    device->profile = &g_imx50_profiles[0];
+    imx50_plan_reset(device);
+    
+    return device;
+}
+
+/**
+    @brief Get a iMX50 usb download device using a transport
+    
+    Same as imx50_init_device(), but the way reports are 
+    sent can be chosen. Any SoC with a profile is found, 
+    see imx50_get_profile(). TRANSPORT_HIDAPI sends one report 
+    at a time. TRANSPORT_LIBUSB (if built with IMX50_LIBUSB) 
+    keeps up to queue_depth data reports in flight. 
+    TRANSPORT_HIDRAW (Linux, built with IMX50_HIDRAW) 
+    submits up to queue_depth reports per system call 
+    through io_uring.
+ 
+    @param transport TRANSPORT_* to use
+    @param queue_depth Data reports in flight, zero for default
+ 
+    @return A device will be returned on success, NULL on error
+*/
+IMX50USB_EXPORT imx50_device_t *imx50_open_device(int transport, unsigned int queue_depth) {
+    imx50_device_t *device;
+    const imx50_transport_t *selected;
+    
+    SPAN_BEGIN();
+    switch(transport) {
+        case TRANSPORT_HIDAPI:
+            selected = &g_imx50_hidapi_transport;
+            break;
+#ifdef IMX50_LIBUSB
+        case TRANSPORT_LIBUSB:
+            selected = &g_imx50_libusb_transport;
+            break;
+#endif
+#if defined(IMX50_HIDRAW) && defined(__linux__)
+        case TRANSPORT_HIDRAW:
+            selected = &g_imx50_hidraw_transport;
+            break;
+#endif
+        default:
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Transport %d not supported [%s:%d]\n", __FUNCTION__, transport, __FILE__, __LINE__);
+            SPAN_END();
+            return NULL;
+    }
+    if((device = imx50_new_device(selected)) == NULL) {
+        SPAN_END();
+        return NULL;
+    }
+    if(queue_depth == 0) {
+        queue_depth = DEFAULT_QUEUE_DEPTH;
     }
     
-    return (imx50_device_t*)handle;
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Enumerating devices with %s [%s:%d]\n", __FUNCTION__, device->transport->name, __FILE__, __LINE__);
+    device->queue_depth = queue_depth;
+    while((device->context = imx50_open_any(device->transport, queue_depth, &device->profile)) == NULL) {
+        SLEEP(100);
+    }
+    imx50_plan_reset(device); // defaults depend on the SoC
+    
+    SPAN_END();
+    return device;
 }
 
 /**
@@ -85,8 +241,15 @@ IMX50USB_EXPORT imx50_device_t *imx50_init_device() {
     @param device The device to free.
  */
 IMX50USB_EXPORT void imx50_close_device(imx50_device_t *device) {
+    SPAN_BEGIN();
     if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Closing device %p [%s:%d]\n", __FUNCTION__, device, __FILE__, __LINE__);
-    hid_close((hid_device*)device);
+    imx50_flush_queue(device);
+    imx50_stop_reader(device);
+    imx50_set_realtime(device, NULL);
+    imx50_set_cache(device, NULL);
+    device->transport->close(device->context);
+    free(device);
+    SPAN_END();
 }
 
 /**
@@ -99,47 +262,218 @@ IMX50USB_EXPORT void imx50_log_level(int log_mask) {
 }
 
 /**
-    @brief Prepares a command to be sent
+    @brief Gets the current time
  
-    The first report is the command. The structure we have 
-    is not packed, and is in little-endian. This converts 
-    the byte order and packs the command. The returned byte 
-    array will always be of length REPORT_SDP_CMD_SIZE.
+    Only useful for measuring how long something takes.
  
-    @param command The command to pack.
+    @return Time in microseconds since some fixed point
+ */
+uint64_t imx50_time_us() {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/**
+    @brief Sets how long to wait for the device to answer
+ 
+    The timeout is for each report the device sends back 
+    (HAB state, response and each block of read data), not 
+    the whole command, so it does not depend on the size of 
+    the transfer. Running out of time returns ERROR_NO_HAB, 
+    ERROR_NO_ACK or ERROR_PARTIAL_DATA depending on where 
+    the device stopped. Default is DEFAULT_TIMEOUT for all 
+    commands.
+ 
+    @param device the HID device
+    @param command_type CMD_* to set it for, zero for all commands
+    @param timeout Time in ms, -1 to wait forever
+ */
+IMX50USB_EXPORT void imx50_set_timeout(imx50_device_t *device, unsigned short command_type, int timeout) {
+    unsigned int i;
     
-    @return A dynamically allocated byte array of length 
-        REPORT_SDP_CMD_SIZE. NULL if error.
+    for(i = 0; i < TIMEOUT_COUNT; i++) {
+        if(command_type == 0 || TIMEOUT_INDEX(command_type) == i) {
+            device->timeouts[i] = timeout;
+        }
+    }
+}
+
+/**
+    @brief Sets up progress reporting for long transfers
+ 
+    The callback is called every options->interval ms 
+    while imx50_read_memory(), imx50_write_memory(), 
+    imx50_load_file() or imx50_boot_image() run, and once 
+    more at the end. If it returns non-zero, loading 
+    files stops after the current CMD_WRITE_FILE with 
+    ERROR_CANCELLED (a single command can't be stopped 
+    half way).
+ 
+    @param device the HID device
+    @param options Callback to use, NULL to turn it off
  */
-unsigned char *imx50_pack_command(sdp_t *command) {
-    unsigned char *data = malloc(REPORT_SDP_CMD_SIZE);
-    uint32_t *payload = (uint32_t*)(data+1); // first byte is number
-    if(!data) {
-        return NULL;
+IMX50USB_EXPORT void imx50_set_transfer_options(imx50_device_t *device, const transfer_options_t *options) {
+    if(options) {
+        device->progress.options = *options;
+    } else {
+        memset(&device->progress.options, 0, sizeof(transfer_options_t));
+    }
+    device->progress.cancel = 0; // a new callback hasn't asked for anything
+    if(device->progress.options.interval == 0) {
+        device->progress.options.interval = PROGRESS_INTERVAL;
+    }
+}
+
+/**
+    @brief Updates the rates and calls the progress callback
+ */
+void imx50_progress_call(imx50_device_t *device, uint64_t now) {
+    imx50_progress_state_t *state = &device->progress;
+    
+    if(now > state->last) {
+        state->status.rate = (unsigned int)((uint64_t)(state->status.done - state->last_done) * 1000000 / (now - state->last));
+    }
+    if(now > state->start) {
+        state->status.average = (unsigned int)((uint64_t)state->status.done * 1000000 / (now - state->start));
     }
+    if(state->status.average > 0 && state->status.total > state->status.done) {
+        state->status.eta = (unsigned int)((uint64_t)(state->status.total - state->status.done) * 1000 / state->status.average);
+    } else {
+        state->status.eta = 0;
+    }
+    state->last = now;
+    state->last_done = state->status.done;
     
-    memset(data, 0, REPORT_SDP_CMD_SIZE);
-    *(uint8_t*)data = REPORT_ID_SDP_CMD; // first report
-    payload[0] = (  ((command->address  & 0x00FF0000) << 8) 
-                     | ((command->address  & 0xFF000000) >> 8) 
-                     |  (command->command_type   & 0x0000FFFF) );
+    if(state->options.progress(state->options.context, &state->status) != 0) {
+        if(!state->cancel && IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Cancel requested at %u bytes [%s:%d]\n", __FUNCTION__, state->status.done, __FILE__, __LINE__);
+        state->cancel = 1;
+    }
+}
+
+/**
+    @brief Starts counting a transfer
+ 
+    Nested transfers (like imx50_write_memory() inside 
+    imx50_load_file()) count towards the outermost one.
+ 
+    @param device the HID device
+    @param total Bytes the transfer will take
+ 
+    @return Non-zero if this is the outermost transfer, pass it to imx50_progress_end()
+ */
+int imx50_progress_begin(imx50_device_t *device, unsigned int total) {
+    imx50_progress_state_t *state = &device->progress;
     
-	payload[1] = (   (command->data_count & 0xFF000000)
-                     | ((command->format   & 0x000000FF) << 16)
-                     | ((command->address  & 0x000000FF) <<  8)
-                     | ((command->address  & 0x0000FF00) >>  8 ));
+    if(state->active) {
+        return 0;
+    }
+    state->cancel = 0; // even with no callback, a cancel is for one transfer
+    if(state->options.progress == NULL) {
+        return 0;
+    }
+    memset(&state->status, 0, sizeof(progress_t));
+    state->status.total = total;
+    state->active = 1;
+    state->start = state->last = imx50_time_us();
+    state->last_done = 0;
+    state->next_check = PROGRESS_CHECK_SIZE;
+    
+    return 1;
+}
+
+/**
+    @brief Counts bytes of a transfer
+ 
+    Only looks at the clock every PROGRESS_CHECK_SIZE bytes 
+    so it is cheap to call for every report.
+ 
+    @param device the HID device
+    @param bytes Bytes just sent or received
+ */
+void imx50_progress_update(imx50_device_t *device, unsigned int bytes) {
+    imx50_progress_state_t *state = &device->progress;
+    uint64_t now;
     
-	payload[2] = (   (command->data     & 0xFF000000)
-                     | ((command->data_count & 0x000000FF) << 16)
-                     |  (command->data_count & 0x0000FF00)
-                     | ((command->data_count & 0x00FF0000) >> 16));
+    if(!state->active) {
+        return;
+    }
+    state->status.done += bytes;
+    if(state->status.done < state->next_check) {
+        return;
+    }
+    state->next_check = state->status.done + PROGRESS_CHECK_SIZE;
     
-	payload[3] = (  ((0x00  & 0x000000FF) << 24)
-                     | ((command->data     & 0x00FF0000) >> 16) 
-                     |  (command->data     & 0x0000FF00)
-                     | ((command->data     & 0x000000FF) << 16));   
+    now = imx50_time_us();
+    if(now - state->last >= (uint64_t)state->options.interval * 1000) {
+        imx50_progress_call(device, now);
+    }
+}
+
+/**
+    @brief Finishes counting a transfer
+ 
+    @param device the HID device
+    @param started Return value of imx50_progress_begin()
+ */
+void imx50_progress_end(imx50_device_t *device, int started) {
+    if(!started) {
+        return;
+    }
+    imx50_progress_call(device, imx50_time_us());
+    device->progress.active = 0;
+}
+
+/**
+    @brief Prepares a command to be sent
+ 
+    The first report is the command. The structure we have 
+    is not packed, and is in the host's byte order. This 
+    writes each field big-endian, a byte at a time, into 
+    report, which must hold REPORT_SDP_CMD_SIZE bytes.
+ 
+    @param command The command to pack.
+    @param report Gets the packed report.
+ */
+void imx50_pack_command(const sdp_t *command, unsigned char *report) {
+    report[0] = REPORT_ID_SDP_CMD; // first report
+    PUT_BE16(report + 1, command->command_type);
+    PUT_BE32(report + 3, command->address);
+    report[7] = command->format;
+    PUT_BE32(report + 8, command->data_count);
+    PUT_BE32(report + 12, command->data);
+    report[16] = 0;
+}
+
+/**
+    @brief Remembers a value written to or read from a register
+ 
+    Only whole, aligned 32-bit registers are remembered. 
+    Anything narrower just forgets what we knew about the 
+    register it touches.
+ 
+    @param device The handle that owns the shadow
+    @param address Address of the register
+    @param value Value the register now holds
+    @param format How many bits of value are valid
+ */
+void imx50_shadow_store(imx50_device_t *device, device_addr_t address, unsigned int value, unsigned char format) {
+    imx50_shadow_t *entry = &device->shadow[SHADOW_INDEX(address)];
     
-    return data;
+    if(format != BITSOF(int) || (address & 0x3) != 0) {
+        imx50_invalidate_shadow(device, address, format / 8);
+        return;
+    }
+    entry->address = address;
+    entry->value = value;
+    entry->valid = 1;
 }
 
 /**
@@ -186,7 +520,8 @@ void imx50_hex_dump(unsigned char *data, unsigned int size, unsigned int num) {
     @brief Sends the command to the device. (Report 1)
  
     This is the first report, it will pack and then send the 
-    requested command.
+    requested command. Queued register writes are sent 
+    first, so every command sees them.
  
     @param device The HID device to send to.
     @param command The command to send
@@ -194,27 +529,98 @@ void imx50_hex_dump(unsigned char *data, unsigned int size, unsigned int num) {
     @return Zero on success, error code otherwise.
 **/
 IMX50USB_EXPORT int imx50_send_command(imx50_device_t *device, sdp_t *command) {
-    // pack the command
-    unsigned char *data = imx50_pack_command(command);
-    if(!data) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_OUT_OF_MEMORY; // error packing
+    unsigned char data[REPORT_SDP_CMD_SIZE];
+    
+    imx50_pack_command(command, data);
+    return imx50_send_packed(device, data);
+}
+
+/**
+    @brief Sends a command that is already packed. (Report 1)
+ 
+    Same as imx50_send_command(), for reports packed ahead 
+    of time, like the ones made by imxusb.hpp.
+ 
+    @param device The HID device to send to.
+    @param data REPORT_SDP_CMD_SIZE bytes, starting with 
+        REPORT_ID_SDP_CMD
+ 
+    @return Zero on success, error code otherwise.
+**/
+IMX50USB_EXPORT int imx50_send_packed(imx50_device_t *device, const unsigned char *data) {
+    unsigned char report[REPORT_STATUS_SIZE];
+    int ret;
+    
+    SPAN_BEGIN_ARG("command", GET_BE16(data + 1));
+    if(device->queued > 0 && (ret = imx50_flush_queue(device)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send queued writes [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    
+    // anything still unread can't be for this command
+    if(device->reader) {
+        imx50_reader_drop(device->reader);
+    } else if(device->stale) {
+        while(device->transport->read(device->context, report, sizeof(report), 0) > 0) {
+            if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Dropping stale report [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        }
     }
+    device->stale = 0;
+    device->command = GET_BE16(data + 1);
     
     // send the report
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Sending command (report 1) %#04Xh [%s:%d]\n", __FUNCTION__, command->command_type, __FILE__, __LINE__);
-    if(IS_LOGGING(DEBUG_LOG)) imx50_hex_dump(data, REPORT_SDP_CMD_SIZE, 0x10);
-    if(hid_write((hid_device*)device, data, REPORT_SDP_CMD_SIZE) < 0) {
-        free(data);
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Sending command (report 1) %#04Xh [%s:%d]\n", __FUNCTION__, device->command, __FILE__, __LINE__);
+    if(IS_LOGGING_HOT(device, DEBUG_LOG)) imx50_hex_dump((unsigned char*)data, REPORT_SDP_CMD_SIZE, 0x10);
+    if(device->transport->write(device->context, data, REPORT_SDP_CMD_SIZE) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error sending data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE; // error sending
     }
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Command sent successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    device->sent = imx50_time_us();
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Command sent successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
     
-    free(data);
+    SPAN_END();
     return 0;
 }
 
+/**
+    @brief Reads the next report from the device
+ 
+    Takes it from the background reader if there is one. 
+    Otherwise reads it from the transport.
+ 
+    @param device the HID device to read from
+    @param data Where to put the report
+    @param size Most bytes to put in data
+    @param skip Bytes at the start of the report to leave out
+    @param timeout In ms, -1 waits forever
+ 
+    @return Bytes read, zero on timeout, negative on error
+**/
+int imx50_read_report(imx50_device_t *device, unsigned char *data, unsigned int size, unsigned int skip, int timeout) {
+    unsigned char report[REPORT_STATUS_SIZE];
+    int ret;
+    
+    if(device->reader) {
+        return imx50_reader_read(device->reader, data, size, skip, timeout);
+    }
+    if(skip == 0) {
+        return device->transport->read(device->context, data, size, timeout);
+    }
+    
+    if((ret = device->transport->read(device->context, report, sizeof(report), timeout)) <= 0) {
+        return ret;
+    }
+    ret = ret > (int)skip ? ret - skip : 0;
+    if((unsigned int)ret > size) {
+        ret = size;
+    }
+    memcpy(data, report + skip, ret);
+    
+    return ret;
+}
+
 /**
     @brief Sends data to the device. (Report 2)
  
@@ -230,33 +636,27 @@ IMX50USB_EXPORT int imx50_send_command(imx50_device_t *device, sdp_t *command) {
     @return Zero on success, error code otherwise.
 **/
 IMX50USB_EXPORT int imx50_send_data(imx50_device_t *device, unsigned char *payload, unsigned int size) {
-    unsigned char *data;
+    unsigned char data[REPORT_DATA_SIZE]; // no allocation per report
 
+    SPAN_BEGIN_ARG("size", size);
     if(size+1 > REPORT_DATA_SIZE) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Size of data (%u) is too large. (max:%u) [%s:%d]\n", __FUNCTION__, size, REPORT_DATA_SIZE, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_PARAMETER;
     }
-    data = malloc(size + 1);
-    if(!data) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_OUT_OF_MEMORY; // cannot alloc memory
-    }
     data[0] = REPORT_ID_DATA;
-    if(!memcpy(data+1, payload, size)) {
-        free(data);
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot copy data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_IO; // cannot copy data
-    }
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Sending data (report 2) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-    if(IS_LOGGING(DEBUG_LOG)) imx50_hex_dump(data, size+1, 0x10);
-    if(hid_write((hid_device*)device, data, size+1) < 0) {
-        free(data);
+    memcpy(data+1, payload, size);
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Sending data (report 2) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    if(IS_LOGGING_HOT(device, DEBUG_LOG)) imx50_hex_dump(data, size+1, 0x10);
+    if(device->transport->write(device->context, data, size+1) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error sending data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE; // error sending
     }
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Data sent successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    device->sent = imx50_time_us();
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Data sent successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
 
-    free(data);
+    SPAN_END();
     return 0;
 }
 
@@ -272,34 +672,72 @@ IMX50USB_EXPORT int imx50_send_data(imx50_device_t *device, unsigned char *paylo
     @return HAB status on success, error code otherwise.
 **/
 IMX50USB_EXPORT int imx50_get_hab_type(imx50_device_t *device) {
-    unsigned char *data = malloc(REPORT_HAB_MODE_SIZE);
+    unsigned char data[REPORT_HAB_MODE_SIZE];
     int hab_type;
-    
-    if(!data) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_OUT_OF_MEMORY; // cannot alloc memory
-    }
-    
-    if(!memset(data, 0, REPORT_HAB_MODE_SIZE)) {
-        free(data);
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Access to memory denied [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_IO; // cannot write to memory
-    }
-    
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Reading HAB state (report 3) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-    if(hid_read((hid_device*)device, data, REPORT_HAB_MODE_SIZE) < 0) {
-        free(data);
+    int ret;
+    
+    SPAN_BEGIN();
+    memset(data, 0, REPORT_HAB_MODE_SIZE);
+    
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Reading HAB state (report 3) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    if((ret = imx50_read_report(device, data, REPORT_HAB_MODE_SIZE, 0, device->timeouts[TIMEOUT_INDEX(device->command)])) <= 0) {
+        if(ret == 0) {
+            device->stale = 1;
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:No HAB state for command %#04X [%s:%d]\n", __FUNCTION__, device->command, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_NO_HAB;
+        }
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error reading response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_READ;
     }
-    if(IS_LOGGING(DEBUG_LOG)) imx50_hex_dump(data, REPORT_HAB_MODE_SIZE, 0x10);
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:HAB state read successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-    hab_type = *(int*)(data+1);
-    free(data);
+    imx50_latency_record(device, imx50_time_us() - device->sent);
+    if(IS_LOGGING_HOT(device, DEBUG_LOG)) imx50_hex_dump(data, REPORT_HAB_MODE_SIZE, 0x10);
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:HAB state read successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    memcpy(&hab_type, data+1, sizeof(int));
     
+    SPAN_END();
     return hab_type;
 }
 
+/**
+    @brief Gets the device's response into a buffer. (Report 4)
+    
+    Same as imx50_get_dev_ack() without allocating, for 
+    commands that only look at the status.
+    
+    @param device the HID device to read from.
+    @param payload Gets the response, REPORT_STATUS_SIZE - 1 bytes
+    
+    @see imx50_get_dev_ack
+    @return Zero on success, error code otherwise.
+ */
+int imx50_read_dev_ack(imx50_device_t *device, unsigned char *payload) {
+    unsigned char data[REPORT_STATUS_SIZE];
+    int ret;
+    SPAN_BEGIN();
+    memset(data, 0, REPORT_STATUS_SIZE);
+
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Recieving response (report 4) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    if((ret = imx50_read_report(device, data, REPORT_STATUS_SIZE, 0, device->timeouts[TIMEOUT_INDEX(device->command)])) <= 0) {
+        if(ret == 0) {
+            device->stale = 1;
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:No response to command %#04X [%s:%d]\n", __FUNCTION__, device->command, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_NO_ACK;
+        }
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_READ;
+    }
+    if(IS_LOGGING_HOT(device, DEBUG_LOG)) imx50_hex_dump(data, REPORT_STATUS_SIZE, 0x10);
+    memcpy(payload, data+1, REPORT_STATUS_SIZE-1);
+
+    if(IS_LOGGING_HOT(device, INFO_LOG)) TRACE("[%s] I:Response recieved successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    SPAN_END();
+    return 0;
+}
+
 /**
     @brief Gets the device's response. (Report 4)
  
@@ -314,60 +752,49 @@ IMX50USB_EXPORT int imx50_get_hab_type(imx50_device_t *device) {
     @return Zero on success, error code otherwise.
 **/
 IMX50USB_EXPORT int imx50_get_dev_ack(imx50_device_t *device, unsigned char **payload_p, unsigned int *size_p) {
-    unsigned char *data = malloc(REPORT_STATUS_SIZE);
     unsigned char *payload;
-    if(!data) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_OUT_OF_MEMORY; // cannot alloc memory
-    }
-    if(!memset(data, 0, REPORT_STATUS_SIZE)) {
-        free(data);
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Access to memory denied [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_IO; // cannot write to memory
-    }
-
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Recieving response (report 4) [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-    if(hid_read((hid_device*)device, data, REPORT_STATUS_SIZE) < 0) {
-        free(data);
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_READ;
-    }
-    if(IS_LOGGING(DEBUG_LOG)) imx50_hex_dump(data, REPORT_STATUS_SIZE, 0x10);
-
+    int ret;
+    
     payload = malloc(REPORT_STATUS_SIZE - 1);
     if(!payload) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
         return ERROR_OUT_OF_MEMORY; // cannot alloc memory
     }
-    if(!memcpy(payload, data+1, REPORT_STATUS_SIZE-1)) {
+    if((ret = imx50_read_dev_ack(device, payload)) != 0) {
         free(payload);
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Access to memory denied [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_IO; // cannot write to memory
+        return ret;
     }
     // set return values
     *payload_p = payload;
     *size_p = REPORT_STATUS_SIZE-1;
-
-    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Response recieved successfully [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    
     return 0;
 }
 
 /**
-    @brief Reads from the device's memory
+    @brief Reads from the device's memory, calling back 
+    as each report arrives
     
     @param device the HID device to read from.
     @param address Where to start reading
     @param buffer Buffer to read to
     @param count How much to read (in bytes)
+    @param arrived Called with the offset and size of each 
+        report once it is in buffer, can be NULL
+    @param context Passed to arrived
     
+    @see imx50_read_memory
     @return Zero on success, error code otherwise
-**/
-IMX50USB_EXPORT int imx50_read_memory(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count) {
+ */
+int imx50_read_memory_each(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count, void (*arrived)(void *context, unsigned int offset, unsigned int size), void *context) {
     sdp_t sdpCmd;
-    unsigned int max_trans_size = REPORT_STATUS_SIZE - 1;
+    int ret;
+    unsigned int max_trans_size = device->profile->status_report_size - 1;
     unsigned int trans_size;
-    unsigned char *data = NULL;
+    unsigned char *start = buffer;
+    int started;
     
+    SPAN_BEGIN_ARG("address", address);
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_READ_REGISTER;
@@ -377,31 +804,67 @@ IMX50USB_EXPORT int imx50_read_memory(imx50_device_t *device, device_addr_t addr
     
     if(imx50_send_command(device, &sdpCmd) != 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_COMMAND;
     }
     
-    if(imx50_get_hab_type(device) < 0) {
+    // HAB report, then the data
+    if(device->transport->expect) {
+        device->transport->expect(device->context, 1 + (count + max_trans_size - 1) / max_trans_size);
+    }
+    
+    if((ret = imx50_get_hab_type(device)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_RETURN;
+        SPAN_END();
+        return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
     }
     
+    started = imx50_progress_begin(device, count);
     while(count > 0) {
         trans_size = (count > max_trans_size) ? max_trans_size : count;
         
-        if(imx50_get_dev_ack(device, &data, &max_trans_size) < 0) { // report 4 contains return value
+        // report 4 contains return value, copy it without the report number
+        if((ret = imx50_read_report(device, buffer, trans_size, 1, device->timeouts[TIMEOUT_INDEX(CMD_READ_REGISTER)])) < (int)trans_size) {
+            imx50_progress_end(device, started);
+            if(ret == 0) {
+                device->stale = 1;
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Device stopped after %u of %u bytes [%s:%d]\n", __FUNCTION__, sdpCmd.data_count - count, sdpCmd.data_count, __FILE__, __LINE__);
+                SPAN_END();
+                return (count == sdpCmd.data_count) ? ERROR_NO_ACK : ERROR_PARTIAL_DATA;
+            }
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            SPAN_END();
             return ERROR_READ;
         }
+        if(IS_LOGGING_HOT(device, DEBUG_LOG)) imx50_hex_dump(buffer, trans_size, 0x10);
+        if(arrived) {
+            arrived(context, (unsigned int)(buffer - start), trans_size);
+        }
         
-        memcpy(buffer, data, trans_size);
-        free(data); // malloc'd in imx50_get_dev_ack()
         buffer += trans_size;
         count -= trans_size;
+        imx50_progress_update(device, trans_size);
     }
+    imx50_progress_end(device, started);
     
+    SPAN_END();
     return 0;
 }
 
+/**
+    @brief Reads from the device's memory
+    
+    @param device the HID device to read from.
+    @param address Where to start reading
+    @param buffer Buffer to read to
+    @param count How much to read (in bytes)
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_read_memory(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count) {
+    return imx50_read_memory_each(device, address, buffer, count, NULL, NULL);
+}
+
 /**
     @brief Writes to a single register in memory
     
@@ -414,10 +877,11 @@ IMX50USB_EXPORT int imx50_read_memory(imx50_device_t *device, device_addr_t addr
 **/
 IMX50USB_EXPORT int imx50_write_register(imx50_device_t *device, device_addr_t address, unsigned int data, unsigned char format) {
     sdp_t sdpCmd;
-    unsigned int *status_p;
+    int ret;
+    unsigned char ack[REPORT_STATUS_SIZE - 1];
     unsigned int status;
-    unsigned int size;
     
+    SPAN_BEGIN_ARG("address", address);
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_WRITE_REGISTER;
@@ -426,97 +890,159 @@ IMX50USB_EXPORT int imx50_write_register(imx50_device_t *device, device_addr_t a
     sdpCmd.data_count = 1;
     sdpCmd.data = data;
     
+    // whatever happens next, we no longer know the value
+    imx50_invalidate_shadow(device, address, format / 8);
+    
     if(imx50_send_command(device, &sdpCmd) != 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_COMMAND;
     }
     
-    if(imx50_get_hab_type(device) < 0) {
+    if((ret = imx50_get_hab_type(device)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_RETURN;
+        SPAN_END();
+        return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
     }
 
-    if(imx50_get_dev_ack(device, (unsigned char**)&status_p, &size) < 0) {
+    if((ret = imx50_read_dev_ack(device, ack)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_READ;
+        SPAN_END();
+        return (ret == ERROR_NO_ACK) ? ret : ERROR_READ;
     }
-    status = BSWAP32(status_p[0]);
+    status = GET_BE32(ack);
     // we assume status is big-endian, but that's not required
     // return values are same in both endian
     // for ex: 0x128A8A12 is same backwards and forwards
-    free(status_p);
     
     if(status != ACK_WRITE_COMPLETE) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Reponse expected: %#08X, got: %#08X [%s:%d]\n", __FUNCTION__, ACK_WRITE_COMPLETE, status, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE;
     }
+    imx50_shadow_store(device, address, data, format);
     
+    SPAN_END();
     return 0;
 }
 
 /**
-    @brief Writes to the device's memory
+    @brief Writes to the device's memory, from reports 
+    that may be built already
     
     @param device the HID device to write to.
     @param address Where to start writing
-    @param buffer Buffer to write from
+    @param buffer Buffer to write from, not used if frames is given
     @param count How much to write (in bytes)
+    @param frames Data reports with their report number, one 
+        every data_report_size bytes, sent as they are. NULL 
+        to build them from buffer.
     
+    @see imx50_write_memory
     @return Zero on success, error code otherwise
-**/
-IMX50USB_EXPORT int imx50_write_memory(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count) {
+ */
+int imx50_write_memory_framed(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count, const unsigned char *frames) {
     sdp_t sdpCmd;
-    unsigned int max_trans_size = REPORT_DATA_SIZE - 1;
+    int ret;
+    unsigned int max_trans_size = device->profile->data_report_size - 1;
     unsigned int trans_size;
-    unsigned int *status_p;
+    unsigned char ack[REPORT_STATUS_SIZE - 1];
     unsigned int status;
-    unsigned int size;
+    unsigned int total = count;
+    uint64_t start;
+    int started;
     
+    SPAN_BEGIN_ARG("address", address);
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_WRITE_FILE;
     sdpCmd.address = address;
     sdpCmd.data_count = count;
     
+    imx50_invalidate_shadow(device, address, count);
+    
+    start = imx50_time_us();
     if(imx50_send_command(device, &sdpCmd) != 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        imx50_plan_result(device, total, 0, 0);
+        SPAN_END();
         return ERROR_COMMAND;
     }
     
-    // TODO: Find out if this is required
-    SLEEP(10); // this was in the reference implementation
+    // the reference implementation waits 10ms, the plan may tune it down
+    if(device->plan.current.data_delay > 0) {
+        SLEEP(device->plan.current.data_delay);
+    }
     
+    started = imx50_progress_begin(device, count);
     while(count > 0) {
         trans_size = (count > max_trans_size) ? max_trans_size : count;
         
-        if(imx50_send_data(device, buffer, trans_size) < 0) { // report 2 contains data
+        if(frames) { // no copy, the report is ready
+            if(device->transport->write(device->context, frames, trans_size + 1) < 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error sending data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+                imx50_progress_end(device, started);
+                imx50_plan_result(device, total, 0, 0);
+                SPAN_END();
+                return ERROR_WRITE;
+            }
+            device->sent = imx50_time_us();
+            frames += max_trans_size + 1;
+        } else if(imx50_send_data(device, buffer, trans_size) < 0) { // report 2 contains data
+            imx50_progress_end(device, started);
+            imx50_plan_result(device, total, 0, 0);
+            SPAN_END();
             return ERROR_WRITE;
+        } else {
+            buffer += trans_size;
         }
         
-        buffer += trans_size;
         count -= trans_size;
+        imx50_progress_update(device, trans_size);
     }
+    imx50_progress_end(device, started);
     
-    if(imx50_get_hab_type(device) < 0) {
+    if((ret = imx50_get_hab_type(device)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_RETURN;
+        imx50_plan_result(device, total, 0, 0);
+        SPAN_END();
+        return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
     }
     
-    if(imx50_get_dev_ack(device, (unsigned char**)&status_p, &size) < 0) {
+    if((ret = imx50_read_dev_ack(device, ack)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_READ;
+        imx50_plan_result(device, total, 0, 0);
+        SPAN_END();
+        return (ret == ERROR_NO_ACK) ? ret : ERROR_READ;
     }
-    status = BSWAP32(status_p[0]);
-    free(status_p);
+    status = GET_BE32(ack);
     
     if(status != ACK_FILE_COMPLETE) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Reponse expected: %#08X, got: %#08X [%s:%d]\n", __FUNCTION__, ACK_FILE_COMPLETE, status, __FILE__, __LINE__);
+        imx50_plan_result(device, total, 0, 0);
+        SPAN_END();
         return ERROR_WRITE;
     }
     
+    imx50_plan_result(device, total, imx50_time_us() - start, 1);
+    SPAN_END();
     return 0;
 }
 
+/**
+    @brief Writes to the device's memory
+    
+    @param device the HID device to write to.
+    @param address Where to start writing
+    @param buffer Buffer to write from
+    @param count How much to write (in bytes)
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_write_memory(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count) {
+    return imx50_write_memory_framed(device, address, buffer, count, NULL);
+}
+
 /**
     @brief Get's error code from device
     
@@ -526,31 +1052,35 @@ IMX50USB_EXPORT int imx50_write_memory(imx50_device_t *device, device_addr_t add
 **/
 IMX50USB_EXPORT int imx50_error_status(imx50_device_t *device) {
     sdp_t sdpCmd;
-    unsigned int *status_p;
+    int ret;
+    unsigned char ack[REPORT_STATUS_SIZE - 1];
     unsigned int status;
-    unsigned int size;
     
+    SPAN_BEGIN();
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_ERROR_STATUS;
     
     if(imx50_send_command(device, &sdpCmd) != 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_COMMAND;
     }
     
-    if(imx50_get_hab_type(device) < 0) {
+    if((ret = imx50_get_hab_type(device)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_RETURN;
+        SPAN_END();
+        return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
     }
     
-    if(imx50_get_dev_ack(device, (unsigned char**)&status_p, &size) < 0) {
+    if((ret = imx50_read_dev_ack(device, ack)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_READ;
+        SPAN_END();
+        return (ret == ERROR_NO_ACK) ? ret : ERROR_READ;
     }
-    status = BSWAP32(status_p[0]); // assmue status is in big-endian
-    free(status_p);
+    status = GET_BE32(ack); // assmue status is in big-endian
     
+    SPAN_END();
     return status;
 }
 
@@ -565,67 +1095,272 @@ IMX50USB_EXPORT int imx50_error_status(imx50_device_t *device) {
     @return Zero on success, error code otherwise
 **/
 IMX50USB_EXPORT int imx50_dcd_write(imx50_device_t *device, dcd_t *buffer, unsigned int count) {
+    unsigned char payload[MAX_DCD_BATCH_CNT * DCD_PACKED_SIZE];
+    unsigned int i;
+    unsigned int n;
+    int ret;
+    
+    while(count > 0) {
+        n = (count > device->profile->dcd_max) ? device->profile->dcd_max : count;
+        // pack and convert dcd to big endian
+        for(i = 0; i < n; i++) {
+            PUT_BE32(&payload[i * DCD_PACKED_SIZE + 0], buffer[i].data_format);
+            PUT_BE32(&payload[i * DCD_PACKED_SIZE + 4], buffer[i].address);
+            PUT_BE32(&payload[i * DCD_PACKED_SIZE + 8], buffer[i].value);
+        }
+        if((ret = imx50_dcd_write_packed(device, payload, n)) != 0) {
+            return ret;
+        }
+        buffer += n;
+        count -= n;
+    }
+    
+    return 0;
+}
+
+/**
+    @brief Turns packed DCD entries into a DCD table
+    
+    Entries of the same width in a row share one write 
+    command.
+    
+    @param payload Packed DCD entries
+    @param count Number of entries, up to MAX_DCD_BATCH_CNT
+    @param table Gets the table, MAX_DCD_TABLE_SIZE bytes
+    
+    @return Size of the table
+ */
+unsigned int imx50_dcd_table(const unsigned char *payload, unsigned int count, unsigned char *table) {
+    unsigned int size = 4;
+    unsigned int command = 0; // write command being filled
+    unsigned int width = 0;
+    unsigned int i;
+    
+    for(i = 0; i < count; i++, payload += DCD_PACKED_SIZE) {
+        if(GET_BE32(payload) / 8 != width) {
+            width = GET_BE32(payload) / 8;
+            command = size;
+            table[size] = DCD_WRITE_TAG;
+            table[size + 3] = width; // no flags, plain writes
+            size += 4;
+        }
+        memcpy(table + size, payload + 4, 8); // address and value, already big-endian
+        size += 8;
+        PUT_BE16(table + command + 1, size - command);
+    }
+    table[0] = DCD_HEADER_TAG;
+    PUT_BE16(table + 1, size);
+    table[3] = DCD_VERSION;
+    
+    return size;
+}
+
+/**
+    @brief Writes registers from a packed DCD table
+    
+    Each entry is DCD_PACKED_SIZE bytes: format, address 
+    and value, all big-endian, the way the i.MX50 ROM wants 
+    them. Tables packed ahead of time (see imxusb.hpp) are 
+    sent as they are. SoCs whose ROM takes a DCD table 
+    (DCD_TABLE) get one built from the entries.
+    
+    @param device the HID device to write to
+    @param payload Packed DCD entries
+    @param count Number of entries
+    
+    @see imx50_dcd_write
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_dcd_write_packed(imx50_device_t *device, const unsigned char *payload, unsigned int count) {
     sdp_t sdpCmd;
+    int ret;
     unsigned int i;
     unsigned int size;
-    unsigned char *payload;
-    unsigned int *status_p;
-    unsigned int status_size;
+    unsigned int sent;
+    unsigned int trans_size;
+    unsigned int max_trans_size = device->profile->data_report_size - 1;
+    unsigned char ack[REPORT_STATUS_SIZE - 1];
     unsigned int status;
+    unsigned int n;
+    unsigned char table[MAX_DCD_TABLE_SIZE];
+    const unsigned char *data;
     
+    SPAN_BEGIN_ARG("count", count);
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_DCD_WRITE;
     
     while(count > 0) {
-        sdpCmd.data_count = (count > MAX_DCD_WRITE_REG_CNT) ? MAX_DCD_WRITE_REG_CNT : count;
-        size = sdpCmd.data_count * sizeof(dcd_t);
+        n = (count > device->profile->dcd_max) ? device->profile->dcd_max : count;
+        if(device->profile->dcd_format == DCD_TABLE) { // byte count, staged in IRAM
+            size = imx50_dcd_table(payload, n, table);
+            sdpCmd.address = device->profile->dcd_address;
+            sdpCmd.data_count = size;
+            data = table;
+        } else {
+            size = n * DCD_PACKED_SIZE;
+            sdpCmd.data_count = n;
+            data = payload;
+        }
+        
+        for(i = 0; i < n; i++) {
+            imx50_invalidate_shadow(device, GET_BE32(&payload[i * DCD_PACKED_SIZE + 4]), GET_BE32(&payload[i * DCD_PACKED_SIZE]) / 8);
+        }
         
         if(imx50_send_command(device, &sdpCmd) != 0) {
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            SPAN_END();
             return ERROR_COMMAND;
         }
         
-        // pack and convert dcd to big endian
-        payload = malloc(size);
-        for(i = 0; i < sdpCmd.data_count; i++) {
-            // this looks complicated but all it does is loop through a 2D array of type [dcd_t][int]
-            // and sets the value of each element to the byte-swapped version of the DCD member
-            // the weird casting is to make sure that everything's packed with one-byte alignment
-            // which should never be a problem, but you'd never know...
-            *(uint32_t*)&payload[i*sizeof(dcd_t) + 0*sizeof(int)] = BSWAP32(buffer[i].data_format);
-            *(uint32_t*)&payload[i*sizeof(dcd_t) + 1*sizeof(int)] = BSWAP32(buffer[i].address);
-            *(uint32_t*)&payload[i*sizeof(dcd_t) + 2*sizeof(int)] = BSWAP32(buffer[i].value);
-        }
-        
-        if(imx50_send_data(device, payload, size) < 0) {
-            free(payload);
-            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-            return ERROR_WRITE;
+        // more than one report on SoCs with a larger DCD buffer
+        for(sent = 0; sent < size; sent += trans_size) {
+            trans_size = (size - sent > max_trans_size) ? max_trans_size : size - sent;
+            if(imx50_send_data(device, (unsigned char*)data + sent, trans_size) < 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send data [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+                SPAN_END();
+                return ERROR_WRITE;
+            }
         }
-        free(payload);
     
-        if(imx50_get_hab_type(device) < 0) {
+        if((ret = imx50_get_hab_type(device)) < 0) {
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-            return ERROR_RETURN;
+            SPAN_END();
+            return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
         }
         
-        if(imx50_get_dev_ack(device, (unsigned char**)&status_p, &status_size) < 0) {
+        if((ret = imx50_read_dev_ack(device, ack)) < 0) {
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-            return ERROR_READ;
+            SPAN_END();
+            return (ret == ERROR_NO_ACK) ? ret : ERROR_READ;
         }
-        status = BSWAP32(status_p[0]);
-        free(status_p);
+        status = GET_BE32(ack);
         
         if(status != ACK_WRITE_COMPLETE) {
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Reponse expected: %#08X, got: %#08X [%s:%d]\n", __FUNCTION__, ACK_WRITE_COMPLETE, status, __FILE__, __LINE__);
+            SPAN_END();
             return ERROR_WRITE;
         }
         
-        buffer = (dcd_t*)((unsigned char*)buffer + size); // add in bytes
-        count -= sdpCmd.data_count;
+        // registers are written in order, so the last write wins
+        for(i = 0; i < n; i++) {
+            imx50_shadow_store(device, GET_BE32(&payload[i * DCD_PACKED_SIZE + 4]), GET_BE32(&payload[i * DCD_PACKED_SIZE + 8]), GET_BE32(&payload[i * DCD_PACKED_SIZE]));
+        }
+        
+        payload += n * DCD_PACKED_SIZE;
+        count -= n;
+    }
+    
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Queues a register write
+    
+    Queued writes are sent in the order they were queued 
+    with CMD_DCD_WRITE, as many at a time as the SoC takes. 
+    They are sent when the queue is full, on 
+    imx50_flush_queue() or imx50_delay(), and before any 
+    other command, so reads always see them.
+    
+    @param device the HID device
+    @param address Address of the register
+    @param data Value to write
+    @param format Size of the register in bits
+    
+    @see imx50_flush_queue
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_queue_register(imx50_device_t *device, device_addr_t address, unsigned int data, unsigned char format) {
+    dcd_t *entry = &device->queue[device->queued];
+    
+    entry->data_format = format;
+    entry->address = address;
+    entry->value = data;
+    // until it is sent the shadow is wrong
+    imx50_invalidate_shadow(device, address, format / 8);
+    
+    if(++device->queued == device->profile->dcd_max) {
+        return imx50_flush_queue(device);
+    }
+    return 0;
+}
+
+/**
+    @brief Queues a list of register writes
+    
+    @param device the HID device
+    @param buffer An array of DCD members
+    @param count Number of DCD members
+    
+    @see imx50_queue_register
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_queue_dcd(imx50_device_t *device, const dcd_t *buffer, unsigned int count) {
+    unsigned int i;
+    int ret;
+    
+    for(i = 0; i < count; i++) {
+        if((ret = imx50_queue_register(device, buffer[i].address, buffer[i].value, (unsigned char)buffer[i].data_format)) != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+    @brief Sends all queued register writes
+    
+    The queue is emptied even if sending fails.
+    
+    @param device the HID device
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_flush_queue(imx50_device_t *device) {
+    dcd_t batch[MAX_DCD_BATCH_CNT];
+    unsigned int count = device->queued;
+    int ret;
+    
+    if(count == 0) {
+        return 0;
+    }
+    SPAN_BEGIN_ARG("count", count);
+    memcpy(batch, device->queue, count * sizeof(dcd_t));
+    device->queued = 0; // so the command does not flush again
+    
+    if((ret = imx50_dcd_write(device, batch, count)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write %u queued registers [%s:%d]\n", __FUNCTION__, count, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Sends queued writes, then waits
+    
+    For waits the hardware needs between writes (PLL lock, 
+    dividers taking effect).
+    
+    @param device the HID device
+    @param ms Milliseconds to wait
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_delay(imx50_device_t *device, unsigned int ms) {
+    int ret;
+    
+    SPAN_BEGIN_ARG("ms", ms);
+    if((ret = imx50_flush_queue(device)) != 0) {
+        SPAN_END();
+        return ret;
     }
+    SLEEP(ms);
     
+    SPAN_END();
     return 0;
 }
 
@@ -648,10 +1383,12 @@ IMX50USB_EXPORT int imx50_dcd_write(imx50_device_t *device, dcd_t *buffer, unsig
 **/
 IMX50USB_EXPORT int imx50_jump(imx50_device_t *device, device_addr_t address) {
     sdp_t sdpCmd;
-    //unsigned int *status_p;
+    int ret;
+    //unsigned char ack[REPORT_STATUS_SIZE - 1];
     //unsigned int status;
     //unsigned int size;
     
+    SPAN_BEGIN_ARG("address", address);
     memset(&sdpCmd, 0, sizeof(sdp_t)); // resets the struct 
     sdpCmd.report_number = REPORT_ID_SDP_CMD;
     sdpCmd.command_type = CMD_JUMP_ADDRESS;
@@ -659,111 +1396,686 @@ IMX50USB_EXPORT int imx50_jump(imx50_device_t *device, device_addr_t address) {
     
     if(imx50_send_command(device, &sdpCmd) != 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_COMMAND;
     }
     
-    if(imx50_get_hab_type(device) < 0) {
+    if((ret = imx50_get_hab_type(device)) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving status [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_RETURN;
+        SPAN_END();
+        return (ret == ERROR_NO_HAB) ? ret : ERROR_RETURN;
     }
     
     /*
-    if(imx50_get_dev_ack(device, (unsigned char**)&status_p, &size) < 0) {
+    if(imx50_read_dev_ack(device, ack) < 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error recieving response [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_READ;
     }
-    status = BSWAP32(status_p[0]); // assmue status is in big-endian
-    free(status_p);
+    status = GET_BE32(ack); // assmue status is in big-endian
     if(status > 0) {
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Return status not zero, got: %#08X [%s:%d]\n", __FUNCTION__, status, __FILE__, __LINE__);
+        SPAN_END();
         return status; // error occured
     }
      */
     
+    SPAN_END();
     return 0;
 }
 
 /**
-    @brief Loads an arbitrary file unto the device. 
+    @brief Asks the device to re-enumerate
     
-    This function splits the input file into chunks of 
-    MAX_DOWNLOAD_SIZE and sends it using imx50_write_memory().
+    The ROM drops off the bus and comes back, so no reply 
+    is waited for. Use imx50_jump_and_wait() to follow it.
     
     @param device the HID device to write to
-    @param address The address to write to on the device
+    
+    @return Zero on success, error code otherwise
+    @see imx50_jump_and_wait
+**/
+IMX50USB_EXPORT int imx50_re_enum(imx50_device_t *device) {
+    sdp_t sdpCmd;
+    
+    SPAN_BEGIN();
+    memset(&sdpCmd, 0, sizeof(sdp_t));
+    sdpCmd.report_number = REPORT_ID_SDP_CMD;
+    sdpCmd.command_type = CMD_RE_ENUM;
+    
+    if(imx50_send_command(device, &sdpCmd) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot send command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_COMMAND;
+    }
+    device->stale = 1; // a HAB report may still come before it goes
+    
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Forgets remembered register values
+ 
+    The library remembers every register it writes and every 
+    small read it makes. Call this when a register might have 
+    changed behind our back (status bits, self-clearing bits, 
+    code running on the device).
+ 
+    @param device the HID device
+    @param address Start of the range to forget
+    @param count Length of the range in bytes. Zero forgets everything.
+**/
+IMX50USB_EXPORT void imx50_invalidate_shadow(imx50_device_t *device, device_addr_t address, unsigned int count) {
+    unsigned int i;
+    imx50_shadow_t *entry;
+    
+    for(i = 0; i < SHADOW_SIZE; i++) {
+        entry = &device->shadow[i];
+        // overlaps if either range starts inside the other one
+        if(count == 0 || entry->address - address < count || address - entry->address < sizeof(int)) {
+            entry->valid = 0;
+        }
+    }
+}
+
+/**
+    @brief Reads a single 32-bit register
+ 
+    If the library already knows the value of the register, 
+    no request is sent to the device. Only this and register 
+    writes fill in what is known, imx50_read_memory() doesn't, 
+    so read status or self-clearing registers with that.
+    
+    @param device the HID device
+    @param address Address of the register
+    @param value_p Where to store the value
+    
+    @see imx50_invalidate_shadow
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_read_register(imx50_device_t *device, device_addr_t address, unsigned int *value_p) {
+    imx50_shadow_t *entry = &device->shadow[SHADOW_INDEX(address)];
+    int ret;
+    
+    if(entry->valid && entry->address == address) {
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Using shadow of %#08X [%s:%d]\n", __FUNCTION__, address, __FILE__, __LINE__);
+        *value_p = entry->value;
+        return 0;
+    }
+    
+    if((ret = imx50_read_memory(device, address, (unsigned char*)value_p, sizeof(int))) != 0) {
+        return ret;
+    }
+    imx50_shadow_store(device, address, *value_p, BITSOF(int));
+    
+    return 0;
+}
+
+/**
+    @brief Changes some bits in a 32-bit register
+ 
+    Only the bits set in mask are changed, they are set to 
+    the matching bits in value. The register is only read 
+    from the device if its value is not already known.
+    
+    @param device the HID device
+    @param address Address of the register
+    @param mask Bits to change
+    @param value New value of the bits (already shifted into place)
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_modify_field(imx50_device_t *device, device_addr_t address, unsigned int mask, unsigned int value) {
+    unsigned int reg;
+    
+    if(imx50_read_register(device, address, &reg) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read register %#08X [%s:%d]\n", __FUNCTION__, address, __FILE__, __LINE__);
+        return ERROR_READ;
+    }
+    reg = (reg & ~mask) | (value & mask);
+    
+    return imx50_write_register(device, address, reg, BITSOF(int));
+}
+
+/**
+    @brief Sets bits in a 32-bit register
+    
+    @param device the HID device
+    @param address Address of the register
+    @param mask Bits to set
+    
+    @see imx50_modify_field
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_set_bits(imx50_device_t *device, device_addr_t address, unsigned int mask) {
+    return imx50_modify_field(device, address, mask, mask);
+}
+
+/**
+    @brief Clears bits in a 32-bit register
+    
+    @param device the HID device
+    @param address Address of the register
+    @param mask Bits to clear
+    
+    @see imx50_modify_field
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_clear_bits(imx50_device_t *device, device_addr_t address, unsigned int mask) {
+    return imx50_modify_field(device, address, mask, 0);
+}
+
+/**
+    @brief Loads a file with a header in front of it
+    
+    The header is sent in the same transfer as the start of 
+    the file, so it costs no extra round trips. With a cache 
+    set, the reports are sent from its entry for the file.
+    
+    @param device the HID device to write to
+    @param address The address to write the file to on the device
     @param filename The name of the file to load
+    @param header Data to put right before address, can be NULL
+    @param header_size Size of header, must be less than MAX_DOWNLOAD_SIZE
     
-    @see imx50_write_memory
+    @see imx50_load_file
     @return Zero on success, error code otherwise
 **/
-IMX50USB_EXPORT int imx50_load_file(imx50_device_t *device, device_addr_t address, const char *filename) {
+int imx50_load_file_header(imx50_device_t *device, device_addr_t address, const char *filename, unsigned char *header, unsigned int header_size) {
     unsigned int size;
     unsigned int offset;
     unsigned int trans_size;
+    unsigned int file_size;
     unsigned char buffer[MAX_DOWNLOAD_SIZE];
+    unsigned char *image = NULL; // whole file, in real-time mode
+    unsigned int image_offset = 0;
+    int started;
+    int ret = 0;
 #ifdef _WIN32 //win32 code
-    HANDLE hFile = CreateFile(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE hFile;
     DWORD dwBytesRead = 0;
     LARGE_INTEGER lsize;
-    if(hFile == INVALID_HANDLE_VALUE) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
-        return ERROR_IO;
+#else
+    FILE *fp = NULL;
+#endif
+    
+    SPAN_BEGIN_ARG("address", address);
+    if(header_size >= MAX_DOWNLOAD_SIZE) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Header too large: %u [%s:%d]\n", __FUNCTION__, header_size, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
     }
-    if(GetFileSizeEx(hFile, &lsize) != 0) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot get file size %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
-        return ERROR_IO;
+    
+    if(device->cache && (ret = imx50_load_cached(device, address, filename, header, header_size)) != ERROR_IO) {
+        SPAN_END();
+        return ret;
     }
-    size = (unsigned int)lsize.QuadPart;
+    ret = 0; // read the file instead
+    
+    if(device->realtime) {
+        // no file system calls between commands, the image is locked in memory
+        if((image = imx50_read_file(filename, &size)) == NULL) {
+            SPAN_END();
+            return ERROR_IO;
+        }
+    } else {
+#ifdef _WIN32
+        hFile = CreateFile(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(hFile == INVALID_HANDLE_VALUE) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_IO;
+        }
+        if(GetFileSizeEx(hFile, &lsize) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot get file size %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_IO;
+        }
+        size = (unsigned int)lsize.QuadPart;
 #else // posix
-    FILE *fp = fopen(filename, "r");
-    if(!fp) {
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
-        return ERROR_IO;
+        fp = fopen(filename, "r");
+        if(!fp) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_IO;
+        }
+        
+        fseek(fp, 0L, SEEK_END);
+        size = ftell(fp); // get file size
+        fseek(fp, 0L, SEEK_SET); // reset fp
+#endif
     }
     
-    fseek(fp, 0L, SEEK_END);
-    size = ftell(fp); // get file size
-    fseek(fp, 0L, SEEK_SET); // reset fp
-#endif
+    // from here on, size and offset count the header too
+    size += header_size;
+    address -= header_size;
     
+    started = imx50_progress_begin(device, size);
     for(offset = 0, trans_size = 0; offset < size; offset += trans_size) {
         trans_size = size - offset;
-        if(trans_size > MAX_DOWNLOAD_SIZE){
-            trans_size = MAX_DOWNLOAD_SIZE;
+        if(trans_size > PLAN_CHUNK(device)){
+            trans_size = PLAN_CHUNK(device);
+        }
+        file_size = trans_size;
+        if(offset < header_size) { // first chunk
+            memcpy(buffer, header, header_size);
+            file_size -= header_size;
         }
         
+        if(image) {
+            memcpy(buffer + trans_size - file_size, image + image_offset, file_size);
+            image_offset += file_size;
+        } else {
 #ifdef _WIN32
-        if(ReadFile(hFile, buffer, trans_size, &dwBytesRead, NULL) == FALSE) {
-            CloseHandle(hFile);
-            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
-            return ERROR_IO;
-        }
-        if(dwBytesRead < trans_size) {
-            CloseHandle(hFile);
-            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:File read incomplete. Read: %u, expected: %u [%s:%d]\n", __FUNCTION__, dwBytesRead, trans_size, __FILE__, __LINE__);
-            return ERROR_IO;
-        }
+            if(ReadFile(hFile, buffer + trans_size - file_size, file_size, &dwBytesRead, NULL) == FALSE) {
+                CloseHandle(hFile);
+                imx50_progress_end(device, started);
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+                SPAN_END();
+                return ERROR_IO;
+            }
+            if(dwBytesRead < file_size) {
+                CloseHandle(hFile);
+                imx50_progress_end(device, started);
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:File read incomplete. Read: %u, expected: %u [%s:%d]\n", __FUNCTION__, dwBytesRead, file_size, __FILE__, __LINE__);
+                SPAN_END();
+                return ERROR_IO;
+            }
 #else
-        if(fread(buffer, sizeof(char), trans_size, fp) < trans_size) {
-            fclose(fp);
-            return ERROR_IO;
-        }
+            if(fread(buffer + trans_size - file_size, sizeof(char), file_size, fp) < file_size) {
+                fclose(fp);
+                imx50_progress_end(device, started);
+                SPAN_END();
+                return ERROR_IO;
+            }
 #endif
+        }
         
         if(imx50_write_memory(device, address + offset, buffer, trans_size) != 0) {
             if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, address, __FILE__, __LINE__);
+            ret = ERROR_WRITE;
+            break;
+        }
+        if(device->progress.cancel && offset + trans_size < size) { // stop between commands
+            ret = ERROR_CANCELLED;
             break;
         }
     }
+    imx50_progress_end(device, started);
     
     // close file
+    if(image) {
+        free(image);
+    } else {
 #ifdef _WIN32
-    CloseHandle(hFile);
+        CloseHandle(hFile);
 #else
+        fclose(fp);
+#endif
+    }
+    
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Loads an arbitrary file unto the device. 
+    
+    This function splits the input file into chunks of the 
+    transfer plan's size (MAX_DOWNLOAD_SIZE unless tuned) 
+    and sends it using imx50_write_memory().
+    
+    @param device the HID device to write to
+    @param address The address to write to on the device
+    @param filename The name of the file to load
+    
+    @see imx50_write_memory
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_load_file(imx50_device_t *device, device_addr_t address, const char *filename) {
+    return imx50_load_file_header(device, address, filename, NULL, 0);
+}
+
+/**
+    @brief Loads code and runs it
+    
+    Same as imx50_load_file() followed by imx50_add_header() 
+    and imx50_jump(), but the IVT header is built here and 
+    sent with the first chunk of the file instead of being 
+    read, patched and checked on the device. The 32 bytes 
+    before address (plus the size of boot_data if given) 
+    are overwritten.
+    
+    @param device the HID device
+    @param address Where to load the code, also its entry point
+    @param filename The name of the file to load
+    @param boot_data Optional boot data to put before the IVT, can be NULL
+    
+    @see imx50_add_header
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_load_and_jump(imx50_device_t *device, device_addr_t address, const char *filename, boot_data_t *boot_data) {
+    unsigned char header[sizeof(boot_data_t) + sizeof(ivt_t)];
+    unsigned int header_size = sizeof(ivt_t);
+    ivt_t *ivt_header = (ivt_t*)(header + sizeof(boot_data_t));
+    device_addr_t ivt_address = address - sizeof(ivt_t);
+    int ret;
+    
+    memset(header, 0, sizeof(header));
+    ivt_header->header = IVT_BARKER_HEADER;
+    ivt_header->entry_address = address;
+    ivt_header->self_address = ivt_address;
+    if(boot_data) {
+        memcpy(header, boot_data, sizeof(boot_data_t));
+        ivt_header->boot_data_address = ivt_address - sizeof(boot_data_t);
+        header_size += sizeof(boot_data_t);
+    }
+    
+    if((ret = imx50_load_file_header(device, address, filename, header + sizeof(header) - header_size, header_size)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot load %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ret;
+    }
+    
+    return imx50_jump(device, ivt_address);
+}
+
+/**
+    @brief Reads a whole file into memory
+    
+    @param filename The name of the file to read
+    @param size_p Returns the size of the file
+    
+    @return Buffer to free() when done, NULL on error
+**/
+unsigned char *imx50_read_file(const char *filename, unsigned int *size_p) {
+    unsigned char *data;
+    unsigned int size;
+#ifdef _WIN32 //win32 code
+    HANDLE hFile;
+    DWORD dwBytesRead = 0;
+    LARGE_INTEGER lsize;
+    
+    hFile = CreateFile(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(GetFileSizeEx(hFile, &lsize) == 0) {
+        CloseHandle(hFile);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot get file size %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
+    size = (unsigned int)lsize.QuadPart;
+    if((data = malloc(size)) == NULL) {
+        CloseHandle(hFile);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(ReadFile(hFile, data, size, &dwBytesRead, NULL) == FALSE || dwBytesRead < size) {
+        CloseHandle(hFile);
+        free(data);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
+    CloseHandle(hFile);
+#else // posix
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
+    
+    fseek(fp, 0L, SEEK_END);
+    size = ftell(fp); // get file size
+    fseek(fp, 0L, SEEK_SET); // reset fp
+    if((data = malloc(size)) == NULL) {
+        fclose(fp);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(fread(data, sizeof(char), size, fp) < size) {
+        fclose(fp);
+        free(data);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
     fclose(fp);
 #endif
     
-    return offset >= size ? 0 : ERROR_WRITE; // did the loop complete?
+    *size_p = size;
+    return data;
+}
+
+/**
+    @brief Reads a big endian word out of a boot image
+**/
+unsigned int imx50_get_be32(const unsigned char *data) {
+    return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+}
+
+/**
+    @brief Runs a DCD table from a boot image
+    
+    Write entries are queued with imx50_queue_register() so 
+    each transfer holds as many registers as the SoC 
+    takes. The queue is sent before anything that reads 
+    from the device. Set and 
+    clear bit entries go through the register shadow and 
+    check entries are polled up to their count (or 
+    DCD_POLL_LIMIT times if they have none).
+    
+    @param device the HID device
+    @param dcd The DCD table, starting with its header
+    @param size Size of the table from its header
+    
+    @return Zero on success, error code otherwise
+**/
+int imx50_run_dcd(imx50_device_t *device, const unsigned char *dcd, unsigned int size) {
+    unsigned int offset;
+    unsigned int length;
+    unsigned int width;
+    unsigned int flags;
+    unsigned int i;
+    unsigned int polls;
+    unsigned int reg;
+    unsigned int mask;
+    unsigned int done;
+    device_addr_t address;
+    int ret = 0;
+    
+    SPAN_BEGIN_ARG("size", size);
+    for(offset = 4; offset + 4 <= size && ret == 0; offset += length) {
+        length = (dcd[offset + 1] << 8) | dcd[offset + 2];
+        width = dcd[offset + 3] & 0x7;
+        flags = dcd[offset + 3] & (DCD_FLAG_MASK | DCD_FLAG_SET);
+        if(length < 4 || offset + length > size) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Bad DCD command at %#X [%s:%d]\n", __FUNCTION__, offset, __FILE__, __LINE__);
+            ret = ERROR_PARAMETER;
+            break;
+        }
+        
+        if(dcd[offset] == DCD_WRITE_TAG && flags == 0) { // plain writes are queued
+            for(i = offset + 4; i + 8 <= offset + length && ret == 0; i += 8) {
+                if(imx50_queue_register(device, imx50_get_be32(dcd + i), imx50_get_be32(dcd + i + 4), width * 8) != 0) {
+                    if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+                    ret = ERROR_WRITE;
+                }
+            }
+            continue;
+        }
+        
+        // everything else sends a command, which sends the queue first
+        switch(dcd[offset]) {
+            case DCD_WRITE_TAG: // set or clear bits
+                for(i = offset + 4; i + 8 <= offset + length && ret == 0; i += 8) {
+                    address = imx50_get_be32(dcd + i);
+                    mask = imx50_get_be32(dcd + i + 4);
+                    if(width == sizeof(int)) {
+                        ret = (flags & DCD_FLAG_SET) ? imx50_set_bits(device, address, mask) : imx50_clear_bits(device, address, mask);
+                    } else {
+                        reg = 0;
+                        if((ret = imx50_read_memory(device, address, (unsigned char*)&reg, width)) == 0) {
+                            reg = (flags & DCD_FLAG_SET) ? (reg | mask) : (reg & ~mask);
+                            ret = imx50_write_register(device, address, reg, width * 8);
+                        }
+                    }
+                }
+                break;
+            case DCD_CHECK_TAG:
+                address = imx50_get_be32(dcd + offset + 4);
+                mask = imx50_get_be32(dcd + offset + 8);
+                polls = (length >= 16) ? imx50_get_be32(dcd + offset + 12) : DCD_POLL_LIMIT;
+                for(i = 0, done = 0; !done && ret == 0; i++) {
+                    if(i >= polls) {
+                        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Timed out polling %#08X [%s:%d]\n", __FUNCTION__, address, __FILE__, __LINE__);
+                        ret = ERROR_VERIFY;
+                        break;
+                    }
+                    reg = 0;
+                    imx50_invalidate_shadow(device, address, width);
+                    if((ret = imx50_read_memory(device, address, (unsigned char*)&reg, width)) != 0) {
+                        break;
+                    }
+                    switch(flags) {
+                        case 0:                                 done = (reg & mask) == 0; break;
+                        case DCD_FLAG_SET:                      done = (reg & mask) == mask; break;
+                        case DCD_FLAG_MASK:                     done = (reg & mask) != mask; break;
+                        case DCD_FLAG_MASK | DCD_FLAG_SET:      done = (reg & mask) != 0; break;
+                    }
+                }
+                break;
+            case DCD_NOP_TAG:
+                break;
+            case DCD_UNLOCK_TAG:
+                if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Ignoring unlock command [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+                break;
+            default:
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Unknown DCD command %#02X [%s:%d]\n", __FUNCTION__, dcd[offset], __FILE__, __LINE__);
+                ret = ERROR_PARAMETER;
+                break;
+        }
+    }
+    
+    if(ret == 0 && imx50_flush_queue(device) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        ret = ERROR_WRITE;
+    }
+    
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Boots a standard i.MX boot image
+    
+    Takes an image with an IVT, like u-boot.imx, runs its 
+    DCD over USB, loads the image where its boot data 
+    says and jumps to its IVT. The IVT may be at the start 
+    of the file or at any ROM_TRANSFER_SIZE boundary in 
+    the first 4K (as in a full flash image). The DCD 
+    pointer is cleared in the uploaded copy so the ROM 
+    does not run it a second time.
+    
+    @param device the HID device
+    @param filename The name of the image
+    
+    @see imx50_run_dcd
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_boot_image(imx50_device_t *device, const char *filename) {
+    unsigned char *image;
+    unsigned int size;
+    unsigned int ivt_offset;
+    unsigned int dcd_size;
+    unsigned int offset;
+    unsigned int trans_size;
+    ivt_t *ivt_header = NULL;
+    boot_data_t *boot_data;
+    device_addr_t load_address;
+    int started;
+    int ret = 0;
+    
+    SPAN_BEGIN();
+    if((image = imx50_read_file(filename, &size)) == NULL) {
+        SPAN_END();
+        return ERROR_IO;
+    }
+    
+    for(ivt_offset = 0; ivt_offset <= 0x1000 && ivt_offset + sizeof(ivt_t) <= size; ivt_offset += ROM_TRANSFER_SIZE) {
+        if((*(unsigned int*)(image + ivt_offset) & IVT_BARKER_MASK) == (IVT_BARKER_HEADER & IVT_BARKER_MASK)) {
+            ivt_header = (ivt_t*)(image + ivt_offset);
+            break;
+        }
+    }
+    if(ivt_header == NULL) {
+        free(image);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:No IVT found in %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    // the file starts this far before the IVT on the device
+    load_address = ivt_header->self_address - ivt_offset;
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:IVT at file offset %#X, entry %#08X, load at %#08X [%s:%d]\n", __FUNCTION__, ivt_offset, ivt_header->entry_address, load_address, __FILE__, __LINE__);
+    
+    // boot data tells how much of the file is the image
+    if(ivt_header->boot_data_address != 0) {
+        offset = ivt_header->boot_data_address - load_address;
+        if(offset + sizeof(boot_data_t) > size) {
+            free(image);
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Boot data %#08X not in image [%s:%d]\n", __FUNCTION__, ivt_header->boot_data_address, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_PARAMETER;
+        }
+        boot_data = (boot_data_t*)(image + offset);
+        if(boot_data->plugin_flag) {
+            free(image);
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Plugin images are not supported [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_PARAMETER;
+        }
+        if(boot_data->start_address + boot_data->size > load_address && boot_data->start_address + boot_data->size - load_address < size) {
+            size = boot_data->start_address + boot_data->size - load_address;
+        }
+    }
+    
+    // run the dcd and stop the rom from running it again
+    if(ivt_header->dcd_address != 0) {
+        offset = ivt_header->dcd_address - load_address;
+        if(offset + 4 > size || image[offset] != DCD_HEADER_TAG || offset + (dcd_size = (image[offset + 1] << 8) | image[offset + 2]) > size) {
+            free(image);
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Bad DCD at %#08X [%s:%d]\n", __FUNCTION__, ivt_header->dcd_address, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_PARAMETER;
+        }
+        if((ret = imx50_run_dcd(device, image + offset, dcd_size)) != 0) {
+            free(image);
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error running DCD [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            SPAN_END();
+            return ret;
+        }
+        ivt_header->dcd_address = 0;
+    }
+    
+    // one CMD_WRITE_FILE per chunk of the transfer plan
+    started = imx50_progress_begin(device, size);
+    for(offset = 0; offset < size && ret == 0; offset += trans_size) {
+        trans_size = (size - offset > PLAN_CHUNK(device)) ? PLAN_CHUNK(device) : size - offset;
+        if((ret = imx50_write_memory(device, load_address + offset, image + offset, trans_size)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, load_address + offset, __FILE__, __LINE__);
+        } else if(device->progress.cancel) { // don't jump into half an image
+            ret = ERROR_CANCELLED;
+        }
+    }
+    imx50_progress_end(device, started);
+    
+    if(ret == 0) {
+        ret = imx50_jump(device, ivt_header->self_address);
+    }
+    free(image);
+    
+    SPAN_END();
+    return ret;
 }
 
 /**
@@ -775,6 +2087,8 @@ IMX50USB_EXPORT int imx50_load_file(imx50_device_t *device, device_addr_t addres
     the address of the header.
     Be aware that the 32 bytes before "address" will 
     be overwritten.
+    For code loaded from a file, imx50_load_and_jump() 
+    is faster as it sends the header with the code.
  
     @param device the HID device
     @param address location of executable code
@@ -787,12 +2101,14 @@ IMX50USB_EXPORT device_addr_t imx50_add_header(imx50_device_t *device, device_ad
     unsigned char temp_buffer[ROM_TRANSFER_SIZE] = { 0 };
     ivt_t *ivt_header = (ivt_t*)flash_header;
     
+    SPAN_BEGIN_ARG("address", address);
     // add the header before the code
     flash_header_address = address - sizeof(ivt_t);
     
     // read the data to add header to
     if(imx50_read_memory(device, flash_header_address, flash_header, ROM_TRANSFER_SIZE) != 0){
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read memory at %#X [%s:%d]\n", __FUNCTION__, flash_header_address, __FILE__, __LINE__);
+        SPAN_END();
         return 0;
     }
     
@@ -807,25 +2123,104 @@ IMX50USB_EXPORT device_addr_t imx50_add_header(imx50_device_t *device, device_ad
     // send the data + new header
     if(imx50_write_memory(device, flash_header_address, flash_header, ROM_TRANSFER_SIZE) != 0){
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write header back at %#X [%s:%d]\n", __FUNCTION__, flash_header_address, __FILE__, __LINE__);
+        SPAN_END();
         return 0;
     }
     
     // check to see if everything is written correctly
     if(imx50_read_memory(device, flash_header_address, temp_buffer, ROM_TRANSFER_SIZE) != 0){
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot reader header back at %#X [%s:%d]\n", __FUNCTION__, flash_header_address, __FILE__, __LINE__);
+        SPAN_END();
         return 0;
     }
     
     // compare what we wrote to what is written
     if(memcmp(flash_header, temp_buffer, ROM_TRANSFER_SIZE) != 0){
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Data written is corrupted [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return 0;
     }
     
     // if all works, return the address of the header
+    SPAN_END();
     return flash_header_address;
 }
 
+// Kindle Touch and Kindle 4 set up, see imx50_kindle_init()
+static const dcd_t kindle_setup_pll1_1[] = 
+    {
+        { 32, 0x53FD400C, 0x4 }, // Switch ARM domain to be clocked from LP-APM
+        { 32, 0x63F80004, 0x0 }, // disable auto-restart AREN bit
+        { 32, 0x63F80008, 0x80 }, { 32, 0x63F8001C, 0x80 }, // clock PLL1
+        { 32, 0x63F80010, 0xB4 }, { 32, 0x63F80024, 0xB4 }, // MFN = 180
+        { 32, 0x63F8000C, 0xB3 }, { 32, 0x63F80020, 0xB3 }, // MFD = 179
+        { 32, 0x63F80000, 0x00001236 } // Set PLM =1, manual restart and enable PLL
+    };
+
+static const dcd_t kindle_setup_pll1_2[] = 
+    {
+        { 32, 0x63F80010, 0x3C }, { 32, 0x63F80024, 0x3C }, // set PLL1 to 800Mhz
+        { 32, 0x63F80004, 0x1 } // Set the LDREQ bit
+    };
+
+static const dcd_t kindle_enable_clocks[] = 
+    {
+        { 32, 0x53FD4068, 0xffffffff }, { 32, 0x53FD406c, 0xffffffff }, { 32, 0x53FD4070, 0xffffffff }, { 32, 0x53FD4074, 0xffffffff }, 
+        { 32, 0x53FD4078, 0xffffffff }, { 32, 0x53FD407c, 0xffffffff }, { 32, 0x53FD4080, 0xffffffff }, { 32, 0x53FD4084, 0xffffffff }
+    };
+
+static const dcd_t kindle_lpddr1_init[] = 
+    {
+        // IOMUX
+        { 32, 0x53fa86AC, 0x0 }, { 32, 0x53fa866C, 0x0 }, { 32, 0x53fa868C, 0x0 }, { 32, 0x53fa8670, 0x0 }, 
+        { 32, 0x53fa86A4, 0x00180000 }, { 32, 0x53fa8668, 0x00180000 }, { 32, 0x53fa8698, 0x00180000 }, { 32, 0x53fa86A0, 0x00180000 }, 
+        { 32, 0x53fa86A8, 0x00180000 }, { 32, 0x53fa86B4, 0x00180000 }, { 32, 0x53fa8490, 0x00180000 }, { 32, 0x53fa8494, 0x00180000 }, 
+        { 32, 0x53fa8498, 0x00180000 }, { 32, 0x53fa849c, 0x00180000 }, { 32, 0x53fa84f0, 0x00180000 }, { 32, 0x53fa8500, 0x00180000 }, 
+        { 32, 0x53fa84c8, 0x00180000 }, { 32, 0x53fa8528, 0x00180080 }, { 32, 0x53fa84f4, 0x00180080 }, { 32, 0x53fa84fc, 0x00180080 }, 
+        { 32, 0x53fa84cc, 0x00180080 }, { 32, 0x53fa8524, 0x00180080 }, 
+        // Static ZQ calibration
+        { 32, 0x1400012C, 0x00000408 }, { 32, 0x14000128, 0x05090000 }, { 32, 0x14000124, 0x00310000 }, { 32, 0x14000124, 0x00200000 }, 
+        { 32, 0x14000128, 0x05090010 }, { 32, 0x14000124, 0x00310000 }, { 32, 0x14000124, 0x00200000 }, 
+        // DDR Controller registers
+        { 32, 0x14000000, 0x00000100 }, { 32, 0x14000008, 0x00009c40 }, { 32, 0x1400000C, 0x00000000 }, { 32, 0x14000010, 0x00000000 }, 
+        { 32, 0x14000014, 0x20000000 }, { 32, 0x14000018, 0x01010006 }, { 32, 0x1400001c, 0x080b0201 }, { 32, 0x14000020, 0x02000303 }, 
+        { 32, 0x14000024, 0x0036b002 }, { 32, 0x14000028, 0x00000606 }, { 32, 0x1400002c, 0x06030400 }, { 32, 0x14000030, 0x01000000 }, 
+        { 32, 0x14000034, 0x00000a02 }, { 32, 0x14000038, 0x00000003 }, { 32, 0x1400003c, 0x00001801 }, { 32, 0x14000040, 0x00050612 }, 
+        { 32, 0x14000044, 0x00000200 }, { 32, 0x14000048, 0x001c001c }, { 32, 0x1400004c, 0x00010000 }, { 32, 0x1400005c, 0x01000000 }, 
+        { 32, 0x14000060, 0x00000001 }, { 32, 0x14000064, 0x00000000 }, { 32, 0x14000068, 0x00320000 }, { 32, 0x1400006c, 0x00000000 }, 
+        { 32, 0x14000070, 0x00000000 }, { 32, 0x14000074, 0x00320000 }, { 32, 0x14000080, 0x02000000 }, { 32, 0x14000084, 0x00000100 }, 
+        { 32, 0x14000088, 0x02400040 }, { 32, 0x1400008c, 0x01000000 }, { 32, 0x14000090, 0x0a000100 }, { 32, 0x14000094, 0x01011f1f }, 
+        { 32, 0x14000098, 0x01010101 }, { 32, 0x1400009c, 0x00030101 }, { 32, 0x140000a4, 0x00010000 }, { 32, 0x140000ac, 0x0000ffff }, 
+        { 32, 0x140000c8, 0x02020101 }, { 32, 0x140000cc, 0x00000000 }, { 32, 0x140000d0, 0x01000202 }, { 32, 0x140000d4, 0x00000200 }, 
+        { 32, 0x140000d8, 0x00000001 }, { 32, 0x140000dc, 0x0000ffff }, { 32, 0x140000e4, 0x02020000 }, { 32, 0x140000e8, 0x02020202 }, 
+        { 32, 0x140000ec, 0x00000202 }, { 32, 0x140000f0, 0x01010064 }, { 32, 0x140000f4, 0x01010101 }, { 32, 0x140000f8, 0x00010101 }, 
+        { 32, 0x140000fc, 0x00000064 }, { 32, 0x14000104, 0x02000602 }, { 32, 0x14000108, 0x06120000 }, { 32, 0x1400010c, 0x06120612 }, 
+        { 32, 0x14000110, 0x06120612 }, { 32, 0x14000114, 0x01030612 }, { 32, 0x14000118, 0x00010002 }, { 32, 0x1400011C, 0x00001000 }, 
+        // DDR PHY setting
+        { 32, 0x14000200, 0x00000000 }, { 32, 0x14000204, 0x00000000 }, { 32, 0x14000208, 0x35002725 }, { 32, 0x14000210, 0x35002725 }, 
+        { 32, 0x14000218, 0x35002725 }, { 32, 0x14000220, 0x35002725 }, { 32, 0x14000228, 0x35002725 }, { 32, 0x1400020c, 0x380002d0 }, 
+        { 32, 0x14000214, 0x380002d0 }, { 32, 0x1400021c, 0x380002d0 }, { 32, 0x14000224, 0x380002d0 }, { 32, 0x1400022c, 0x380002d0 }, 
+        { 32, 0x14000230, 0x00000000 }, { 32, 0x14000234, 0x00800006 }, { 32, 0x14000238, 0x60101414 }, { 32, 0x14000240, 0x60101414 }, 
+        { 32, 0x14000248, 0x60101414 }, { 32, 0x14000250, 0x60101414 }, { 32, 0x14000258, 0x60101414 }, { 32, 0x1400023c, 0x00101001 }, 
+        { 32, 0x14000244, 0x00101001 }, { 32, 0x1400024c, 0x00101001 }, { 32, 0x14000254, 0x00101001 }, { 32, 0x1400025c, 0x00102201 }
+    };
+
+// written one at a time by imx50_kindle_init(), between the tables
+static const dcd_t kindle_single_writes[] = 
+    {
+        { 32, 0x53FD400C, 0x0 }, // Switch ARM back to PLL1
+        { 32, 0x53FD4098, 0x80000004 }, // Set DDR to be div 4 to get 200MHz
+        { 32, 0x14000000, 0x00000101 } // Start ddr
+    };
+
+// bits imx50_kindle_verify() cannot expect to read back
+static const dcd_mask_t kindle_masks[] = 
+    {
+        { 0x63F80000, ~0x11u }, // PLL1 lock flag, manual restart clears itself
+        { 0x63F80004, ~0x1u }, // LDREQ clears itself when the PLL takes the new MFN
+        { 0x14000124, 0x0 } // ZQ calibration commands
+    };
+
 /**
     @brief Sets up an Amazon Kindle's DRAM
     
@@ -837,120 +2232,366 @@ IMX50USB_EXPORT device_addr_t imx50_add_header(imx50_device_t *device, device_ad
     
     @param device the Kindle to set up
     
-    @see imx50_dcd_write
-    @return Zero on success, error code otherwise
+    @see imx50_queue_register
+    @see imx50_kindle_verify
+    @return Zero on success, ERROR_PARAMETER if the device 
+        is not an i.MX50, error code otherwise
 **/
 IMX50USB_EXPORT int imx50_kindle_init(imx50_device_t *device) {
-    static dcd_t setup_pll1_1[] = 
-        {
-            { 32, 0x53FD400C, 0x4 }, // Switch ARM domain to be clocked from LP-APM
-            { 32, 0x63F80004, 0x0 }, // disable auto-restart AREN bit
-            { 32, 0x63F80008, 0x80 }, { 32, 0x63F8001C, 0x80 }, // clock PLL1
-            { 32, 0x63F80010, 0xB4 }, { 32, 0x63F80024, 0xB4 }, // MFN = 180
-            { 32, 0x63F8000C, 0xB3 }, { 32, 0x63F80020, 0xB3 }, // MFD = 179
-            { 32, 0x63F80000, 0x00001236 } // Set PLM =1, manual restart and enable PLL
-        };
-
-    static dcd_t setup_pll1_2[] = 
-        {
-            { 32, 0x63F80010, 0x3C }, { 32, 0x63F80024, 0x3C }, // set PLL1 to 800Mhz
-            { 32, 0x63F80004, 0x1 } // Set the LDREQ bit
-        };
-
-    static dcd_t enable_clocks[] = 
-        {
-            { 32, 0x53FD4068, 0xffffffff }, { 32, 0x53FD406c, 0xffffffff }, { 32, 0x53FD4070, 0xffffffff }, { 32, 0x53FD4074, 0xffffffff }, 
-            { 32, 0x53FD4078, 0xffffffff }, { 32, 0x53FD407c, 0xffffffff }, { 32, 0x53FD4080, 0xffffffff }, { 32, 0x53FD4084, 0xffffffff }
-        };
-    static dcd_t lpddr1_init[] = 
-        {
-            // IOMUX
-            { 32, 0x53fa86AC, 0x0 }, { 32, 0x53fa866C, 0x0 }, { 32, 0x53fa868C, 0x0 }, { 32, 0x53fa8670, 0x0 }, 
-            { 32, 0x53fa86A4, 0x00180000 }, { 32, 0x53fa8668, 0x00180000 }, { 32, 0x53fa8698, 0x00180000 }, { 32, 0x53fa86A0, 0x00180000 }, 
-            { 32, 0x53fa86A8, 0x00180000 }, { 32, 0x53fa86B4, 0x00180000 }, { 32, 0x53fa8490, 0x00180000 }, { 32, 0x53fa8494, 0x00180000 }, 
-            { 32, 0x53fa8498, 0x00180000 }, { 32, 0x53fa849c, 0x00180000 }, { 32, 0x53fa84f0, 0x00180000 }, { 32, 0x53fa8500, 0x00180000 }, 
-            { 32, 0x53fa84c8, 0x00180000 }, { 32, 0x53fa8528, 0x00180080 }, { 32, 0x53fa84f4, 0x00180080 }, { 32, 0x53fa84fc, 0x00180080 }, 
-            { 32, 0x53fa84cc, 0x00180080 }, { 32, 0x53fa8524, 0x00180080 }, 
-            // Static ZQ calibration
-            { 32, 0x1400012C, 0x00000408 }, { 32, 0x14000128, 0x05090000 }, { 32, 0x14000124, 0x00310000 }, { 32, 0x14000124, 0x00200000 }, 
-            { 32, 0x14000128, 0x05090010 }, { 32, 0x14000124, 0x00310000 }, { 32, 0x14000124, 0x00200000 }, 
-            // DDR Controller registers
-            { 32, 0x14000000, 0x00000100 }, { 32, 0x14000008, 0x00009c40 }, { 32, 0x1400000C, 0x00000000 }, { 32, 0x14000010, 0x00000000 }, 
-            { 32, 0x14000014, 0x20000000 }, { 32, 0x14000018, 0x01010006 }, { 32, 0x1400001c, 0x080b0201 }, { 32, 0x14000020, 0x02000303 }, 
-            { 32, 0x14000024, 0x0036b002 }, { 32, 0x14000028, 0x00000606 }, { 32, 0x1400002c, 0x06030400 }, { 32, 0x14000030, 0x01000000 }, 
-            { 32, 0x14000034, 0x00000a02 }, { 32, 0x14000038, 0x00000003 }, { 32, 0x1400003c, 0x00001801 }, { 32, 0x14000040, 0x00050612 }, 
-            { 32, 0x14000044, 0x00000200 }, { 32, 0x14000048, 0x001c001c }, { 32, 0x1400004c, 0x00010000 }, { 32, 0x1400005c, 0x01000000 }, 
-            { 32, 0x14000060, 0x00000001 }, { 32, 0x14000064, 0x00000000 }, { 32, 0x14000068, 0x00320000 }, { 32, 0x1400006c, 0x00000000 }, 
-            { 32, 0x14000070, 0x00000000 }, { 32, 0x14000074, 0x00320000 }, { 32, 0x14000080, 0x02000000 }, { 32, 0x14000084, 0x00000100 }, 
-            { 32, 0x14000088, 0x02400040 }, { 32, 0x1400008c, 0x01000000 }, { 32, 0x14000090, 0x0a000100 }, { 32, 0x14000094, 0x01011f1f }, 
-            { 32, 0x14000098, 0x01010101 }, { 32, 0x1400009c, 0x00030101 }, { 32, 0x140000a4, 0x00010000 }, { 32, 0x140000ac, 0x0000ffff }, 
-            { 32, 0x140000c8, 0x02020101 }, { 32, 0x140000cc, 0x00000000 }, { 32, 0x140000d0, 0x01000202 }, { 32, 0x140000d4, 0x00000200 }, 
-            { 32, 0x140000d8, 0x00000001 }, { 32, 0x140000dc, 0x0000ffff }, { 32, 0x140000e4, 0x02020000 }, { 32, 0x140000e8, 0x02020202 }, 
-            { 32, 0x140000ec, 0x00000202 }, { 32, 0x140000f0, 0x01010064 }, { 32, 0x140000f4, 0x01010101 }, { 32, 0x140000f8, 0x00010101 }, 
-            { 32, 0x140000fc, 0x00000064 }, { 32, 0x14000104, 0x02000602 }, { 32, 0x14000108, 0x06120000 }, { 32, 0x1400010c, 0x06120612 }, 
-            { 32, 0x14000110, 0x06120612 }, { 32, 0x14000114, 0x01030612 }, { 32, 0x14000118, 0x00010002 }, { 32, 0x1400011C, 0x00001000 }, 
-            // DDR PHY setting
-            { 32, 0x14000200, 0x00000000 }, { 32, 0x14000204, 0x00000000 }, { 32, 0x14000208, 0x35002725 }, { 32, 0x14000210, 0x35002725 }, 
-            { 32, 0x14000218, 0x35002725 }, { 32, 0x14000220, 0x35002725 }, { 32, 0x14000228, 0x35002725 }, { 32, 0x1400020c, 0x380002d0 }, 
-            { 32, 0x14000214, 0x380002d0 }, { 32, 0x1400021c, 0x380002d0 }, { 32, 0x14000224, 0x380002d0 }, { 32, 0x1400022c, 0x380002d0 }, 
-            { 32, 0x14000230, 0x00000000 }, { 32, 0x14000234, 0x00800006 }, { 32, 0x14000238, 0x60101414 }, { 32, 0x14000240, 0x60101414 }, 
-            { 32, 0x14000248, 0x60101414 }, { 32, 0x14000250, 0x60101414 }, { 32, 0x14000258, 0x60101414 }, { 32, 0x1400023c, 0x00101001 }, 
-            { 32, 0x14000244, 0x00101001 }, { 32, 0x1400024c, 0x00101001 }, { 32, 0x14000254, 0x00101001 }, { 32, 0x1400025c, 0x00102201 }
-        };
-
+    // writes are queued and only sent when we have to wait
+    
+    SPAN_BEGIN();
+    if(device->profile != &g_imx50_profiles[0]) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Kindle set up is for the i.MX50, not the %s [%s:%d]\n", __FUNCTION__, device->profile->name, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
     /* Setup PLL1 to be 800 MHz */
-    if(imx50_dcd_write(device, setup_pll1_1, sizeof(setup_pll1_1) / sizeof(dcd_t)) != 0){
+    if(imx50_queue_dcd(device, kindle_setup_pll1_1, sizeof(kindle_setup_pll1_1) / sizeof(dcd_t)) != 0 ||
+       imx50_delay(device, 10) != 0){ // Wait PLL1 lock
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE;
     }
-    // Wait PLL1 lock
-    SLEEP(10);
 
-    if(imx50_dcd_write(device, setup_pll1_2, sizeof(setup_pll1_2) / sizeof(dcd_t)) != 0){
+    if(imx50_queue_dcd(device, kindle_setup_pll1_2, sizeof(kindle_setup_pll1_2) / sizeof(dcd_t)) != 0 ||
+       imx50_delay(device, 10) != 0){ // Wait for MFN update to be completed
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE;
     }
 
-    // Wait for MFN update to be completed
-    SLEEP(10);
-
-    // Switch ARM back to PLL1
-    if(imx50_write_register(device, 0x53FD400C, 0x0, BITSOF(int)) != 0){
+    if(imx50_queue_dcd(device, &kindle_single_writes[0], 1) != 0 || // Switch ARM back to PLL1
+       imx50_queue_dcd(device, kindle_enable_clocks, sizeof(kindle_enable_clocks) / sizeof(dcd_t)) != 0 || // Enable all clocks (they are disabled by ROM code)
+       imx50_queue_dcd(device, &kindle_single_writes[1], 1) != 0 || // Set DDR to be div 4 to get 200MHz
+       imx50_delay(device, 10) != 0){ // wait for DDR dividers take effect
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE;
     }
 
-    // Enable all clocks (they are disabled by ROM code)
-    if(imx50_dcd_write(device, enable_clocks, sizeof(enable_clocks) / sizeof(dcd_t)) != 0){
+    /* Set up LPDDR1-MDDR RAM */
+    if(imx50_queue_dcd(device, kindle_lpddr1_init, sizeof(kindle_lpddr1_init) / sizeof(dcd_t)) != 0 ||
+       imx50_queue_dcd(device, &kindle_single_writes[2], 1) != 0 || // Start ddr
+       imx50_delay(device, 10) != 0){ // Make sure it's started
         if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
         return ERROR_WRITE;
     }
 
-    /* Set up LPDDR1-MDDR RAM */
+    SPAN_END();
+    return 0;
+}
 
-    // Set DDR to be div 4 to get 200MHz
-    if(imx50_write_register(device, 0x53FD4098, 0x80000004, BITSOF(int)) != 0){
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_WRITE;
+/**
+    @brief Checks that imx50_kindle_init() set up the Kindle
+    
+    Reads back the registers imx50_kindle_init() wrote, so 
+    bad DDR set up is caught before a slow upload. PLL bits 
+    that change by themselves and the ZQ calibration 
+    commands are not compared.
+    
+    @param device the Kindle, after imx50_kindle_init()
+    @param verify Gets the results. Its masks are used 
+        along with the Kindle's own.
+    
+    @see imx50_dcd_verify
+    @return Zero if every register matches, ERROR_VERIFY if 
+        some do not, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_kindle_verify(imx50_device_t *device, dcd_verify_t *verify) {
+    // same order as imx50_kindle_init(), so the last write wins
+    static const struct {
+        const dcd_t *table;
+        unsigned int count;
+    } tables[] = 
+        {
+            { kindle_setup_pll1_1, sizeof(kindle_setup_pll1_1) / sizeof(dcd_t) },
+            { kindle_setup_pll1_2, sizeof(kindle_setup_pll1_2) / sizeof(dcd_t) },
+            { &kindle_single_writes[0], 1 },
+            { kindle_enable_clocks, sizeof(kindle_enable_clocks) / sizeof(dcd_t) },
+            { &kindle_single_writes[1], 1 },
+            { kindle_lpddr1_init, sizeof(kindle_lpddr1_init) / sizeof(dcd_t) },
+            { &kindle_single_writes[2], 1 }
+        };
+    dcd_t *all;
+    dcd_mask_t *masks;
+    dcd_verify_t kindle;
+    unsigned int mask_count = sizeof(kindle_masks) / sizeof(dcd_mask_t);
+    unsigned int count = 0;
+    unsigned int i;
+    int ret;
+    
+    all = malloc(sizeof(kindle_setup_pll1_1) + sizeof(kindle_setup_pll1_2) + sizeof(kindle_enable_clocks) + sizeof(kindle_lpddr1_init) + sizeof(kindle_single_writes));
+    masks = malloc((mask_count + verify->mask_count) * sizeof(dcd_mask_t));
+    if(!all || !masks) {
+        free(all);
+        free(masks);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
     }
+    for(i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        memcpy(&all[count], tables[i].table, tables[i].count * sizeof(dcd_t));
+        count += tables[i].count;
+    }
+    memcpy(masks, kindle_masks, sizeof(kindle_masks));
+    if(verify->mask_count > 0) {
+        memcpy(&masks[mask_count], verify->masks, verify->mask_count * sizeof(dcd_mask_t));
+    }
+    
+    // the caller's masks are left as they were
+    kindle = *verify;
+    kindle.masks = masks;
+    kindle.mask_count = mask_count + verify->mask_count;
+    ret = imx50_dcd_verify(device, all, count, &kindle);
+    kindle.masks = verify->masks;
+    kindle.mask_count = verify->mask_count;
+    *verify = kindle;
+    
+    free(masks);
+    free(all);
+    return ret;
+}
 
-    // wait for DDR dividers take effect
-    SLEEP(10);
-
-    // set up RAM
-    if(imx50_dcd_write(device, lpddr1_init, sizeof(lpddr1_init) / sizeof(dcd_t)) != 0){
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_WRITE;
+/**
+    @brief Generates a memory test pattern
+ 
+    Patterns only depend on the address, so the same chunk 
+    can be generated again to check it.
+ 
+    @param test MEMTEST_ADDRESS or MEMTEST_RANDOM
+    @param seed Seed for random patterns
+    @param address Device address of the first word
+    @param words Buffer to fill
+    @param count Number of words to fill
+ */
+void imx50_memtest_pattern(unsigned int test, unsigned int seed, device_addr_t address, uint32_t *words, unsigned int count) {
+    unsigned int i;
+    uint32_t x = (seed ^ address) * 2654435761u | 1; // xorshift state can't be zero
+    
+    for(i = 0; i < count; i++, address += sizeof(uint32_t)) {
+        if(test == MEMTEST_ADDRESS) {
+            words[i] = address;
+        } else {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            words[i] = x;
+        }
     }
+}
 
-    // Start ddr
-    if(imx50_write_register(device, 0x14000000, 0x00000101, BITSOF(int)) != 0){
-        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing registers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
-        return ERROR_WRITE;
+/**
+    @brief Records the first mismatch of a memory test
+ 
+    @return ERROR_VERIFY if the buffers differ, zero otherwise
+ */
+int imx50_memtest_compare(memtest_t *test, unsigned int which, device_addr_t address, uint32_t *expected, uint32_t *actual, unsigned int count) {
+    unsigned int i;
+    
+    for(i = 0; i < count; i++) {
+        if(expected[i] != actual[i]) {
+            test->failed_test = which;
+            test->fail_address = address + i * sizeof(uint32_t);
+            test->expected = expected[i];
+            test->actual = actual[i];
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Memory test %#X failed at %#08X, expected: %#08X, got: %#08X [%s:%d]\n", __FUNCTION__, which, test->fail_address, test->expected, test->actual, __FILE__, __LINE__);
+            return ERROR_VERIFY;
+        }
     }
+    return 0;
+}
 
-    // Make sure it's started
-    SLEEP(10);
+/**
+    @brief Fills the region with a pattern and checks it
+ 
+    The region is split into MAX_DOWNLOAD_SIZE chunks. Only 
+    test->coverage percent of them, evenly spread out, are 
+    tested. A chunk is read back only after the next chunk 
+    is written, which also catches writes that land in the 
+    previous chunk.
+ 
+    @return Zero on success, error code otherwise
+ */
+int imx50_memtest_fill(imx50_device_t *device, device_addr_t address, unsigned int size, memtest_t *test, unsigned int which, uint64_t deadline) {
+    uint32_t *pattern;
+    uint32_t *readback;
+    unsigned int chunks = (size + MAX_DOWNLOAD_SIZE - 1) / MAX_DOWNLOAD_SIZE;
+    unsigned int tested = (chunks * test->coverage + 99) / 100;
+    unsigned int i, chunk, offset, length;
+    unsigned int prev_offset = 0, prev_length = 0;
+    int ret = 0;
+    
+    pattern = malloc(MAX_DOWNLOAD_SIZE);
+    readback = malloc(MAX_DOWNLOAD_SIZE);
+    if(!pattern || !readback) {
+        free(pattern);
+        free(readback);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    
+    // one extra pass to check the last chunk written
+    for(i = 0; i <= tested; i++) {
+        if(i < tested && deadline != 0 && imx50_time_us() > deadline) {
+            if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Time limit reached, stopping early [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            test->complete = 0;
+            tested = i;
+        }
+        
+        if(i < tested) {
+            chunk = (unsigned int)((uint64_t)i * chunks / tested);
+            offset = chunk * MAX_DOWNLOAD_SIZE;
+            length = (size - offset > MAX_DOWNLOAD_SIZE) ? MAX_DOWNLOAD_SIZE : size - offset;
+            imx50_memtest_pattern(which, test->seed, address + offset, pattern, length / sizeof(uint32_t));
+            if((ret = imx50_write_memory(device, address + offset, (unsigned char*)pattern, length)) != 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write pattern at %#08X [%s:%d]\n", __FUNCTION__, address + offset, __FILE__, __LINE__);
+                break;
+            }
+        }
+        
+        if(prev_length > 0) {
+            if((ret = imx50_read_memory(device, address + prev_offset, (unsigned char*)readback, prev_length)) != 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read pattern at %#08X [%s:%d]\n", __FUNCTION__, address + prev_offset, __FILE__, __LINE__);
+                break;
+            }
+            // the pattern buffer is free again, so generate the expected data into it
+            imx50_memtest_pattern(which, test->seed, address + prev_offset, pattern, prev_length / sizeof(uint32_t));
+            if((ret = imx50_memtest_compare(test, which, address + prev_offset, pattern, readback, prev_length / sizeof(uint32_t))) != 0) {
+                break;
+            }
+            test->bytes_tested += prev_length;
+            prev_length = 0;
+        }
+        
+        if(i < tested) {
+            prev_offset = offset;
+            prev_length = length;
+        }
+    }
+    
+    free(pattern);
+    free(readback);
+    return ret;
+}
 
+/**
+    @brief Tests the device's external RAM
+ 
+    Call this after imx50_kindle_init() (or any other RAM 
+    set up) and before loading anything. The tests run are 
+    chosen with test->tests:
+ 
+    MEMTEST_DATA_BUS walks a one and a zero across all 32 
+    data lines.
+    MEMTEST_ADDRESS_BUS writes a unique value at every 
+    power-of-two offset so that stuck or shorted address 
+    lines alias and get caught.
+    MEMTEST_ADDRESS fills the region with each word's own 
+    address.
+    MEMTEST_RANDOM fills the region with a seeded random 
+    pattern.
+ 
+    The last two only cover test->coverage percent of the 
+    region and stop early (test->complete is cleared) once 
+    test->time_limit ms have passed.
+ 
+    @param device the HID device
+    @param address Start of the RAM to test
+    @param size Size of the RAM to test in bytes
+    @param test Test settings, also where results are put
+ 
+    @return Zero if all tests passed, ERROR_VERIFY on mismatch, 
+        error code otherwise
+ **/
+IMX50USB_EXPORT int imx50_memory_test(imx50_device_t *device, device_addr_t address, unsigned int size, memtest_t *test) {
+    uint32_t walk[2 * BITSOF(uint32_t)];
+    uint32_t readback[2 * BITSOF(uint32_t)];
+    dcd_t lines[BITSOF(uint32_t) + 1];
+    uint32_t value, expected;
+    unsigned int i, count;
+    uint64_t deadline = 0;
+    int ret;
+    
+    SPAN_BEGIN_ARG("address", address);
+    size &= ~(sizeof(uint32_t) - 1); // whole words only
+    if(size < sizeof(walk) || test->coverage == 0 || test->coverage > 100) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Invalid test size (%u) or coverage (%u) [%s:%d]\n", __FUNCTION__, size, test->coverage, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    if(test->time_limit > 0) {
+        deadline = imx50_time_us() + (uint64_t)test->time_limit * 1000;
+    }
+    test->complete = 1;
+    test->bytes_tested = 0;
+    test->failed_test = 0;
+    
+    if(test->tests & MEMTEST_DATA_BUS) {
+        if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Testing data bus [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        // walking ones then walking zeros, all in one transfer
+        for(i = 0; i < BITSOF(uint32_t); i++) {
+            walk[i] = 1u << i;
+            walk[i + BITSOF(uint32_t)] = ~(1u << i);
+        }
+        if((ret = imx50_write_memory(device, address, (unsigned char*)walk, sizeof(walk))) != 0) {
+            SPAN_END();
+            return ret;
+        }
+        if((ret = imx50_read_memory(device, address, (unsigned char*)readback, sizeof(readback))) != 0) {
+            SPAN_END();
+            return ret;
+        }
+        if((ret = imx50_memtest_compare(test, MEMTEST_DATA_BUS, address, walk, readback, 2 * BITSOF(uint32_t))) != 0) {
+            SPAN_END();
+            return ret;
+        }
+    }
+    
+    if(test->tests & MEMTEST_ADDRESS_BUS) {
+        if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Testing address bus [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        // offset zero, then every power of two inside the region
+        lines[0].data_format = BITSOF(uint32_t);
+        lines[0].address = address;
+        lines[0].value = ~address;
+        for(count = 1; count <= BITSOF(uint32_t) && (sizeof(uint32_t) << (count - 1)) < size; count++) {
+            lines[count].data_format = BITSOF(uint32_t);
+            lines[count].address = address + (sizeof(uint32_t) << (count - 1));
+            lines[count].value = ~lines[count].address;
+        }
+        if((ret = imx50_dcd_write(device, lines, count)) != 0) {
+            SPAN_END();
+            return ret;
+        }
+        for(i = 0; i < count; i++) {
+            if((ret = imx50_read_memory(device, lines[i].address, (unsigned char*)&value, sizeof(uint32_t))) != 0) {
+                SPAN_END();
+                return ret;
+            }
+            expected = lines[i].value;
+            if((ret = imx50_memtest_compare(test, MEMTEST_ADDRESS_BUS, lines[i].address, &expected, &value, 1)) != 0) {
+                SPAN_END();
+                return ret;
+            }
+        }
+    }
+    
+    if(test->tests & MEMTEST_ADDRESS) {
+        if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Testing address in address [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        if((ret = imx50_memtest_fill(device, address, size, test, MEMTEST_ADDRESS, deadline)) != 0) {
+            SPAN_END();
+            return ret;
+        }
+    }
+    
+    if(test->tests & MEMTEST_RANDOM) {
+        if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Testing random pattern, seed %#X [%s:%d]\n", __FUNCTION__, test->seed, __FILE__, __LINE__);
+        if((ret = imx50_memtest_fill(device, address, size, test, MEMTEST_RANDOM, deadline)) != 0) {
+            SPAN_END();
+            return ret;
+        }
+    }
+    
+    SPAN_END();
     return 0;
 }
@@ -27,7 +27,7 @@
 #define CMD_WRITE_FILE          0x0404
 #define CMD_ERROR_STATUS        0x0505
 #define CMD_HEADER              0x0606 // unused
-#define CMD_RE_ENUM             0x0909 // unused
+#define CMD_RE_ENUM             0x0909
 #define CMD_DCD_WRITE           0x0A0A
 #define CMD_JUMP_ADDRESS        0x0B0B
 
@@ -37,15 +37,25 @@
 #define ACK_WRITE_COMPLETE      0x128A8A12
 #define ACK_FILE_COMPLETE       0x88888888
 
-#define MAX_DCD_WRITE_REG_CNT   85
+#define MAX_DCD_WRITE_REG_CNT   85 // i.MX50, one data report
+#define MAX_DCD_BATCH_CNT       147 // most of any SoC profile, 12 bytes each in a DCD table at worst
+#define MAX_DCD_TABLE_SIZE      1768 // i.MX53 and i.MX6 ROMs
 #define MAX_DOWNLOAD_SIZE       0x200000
 
+#define TRANSPORT_HIDAPI        0
+#define TRANSPORT_LIBUSB        1
+#define TRANSPORT_HIDRAW        2
+#define DEFAULT_QUEUE_DEPTH     8
+#define READER_DEFAULT_SIZE     256
+#define DEFAULT_TIMEOUT         5000
+
 #define REPORT_ID_SDP_CMD       1
 #define REPORT_ID_DATA          2
 #define REPORT_ID_HAB_MODE      3
 #define REPORT_ID_STATUS        4
 
 #define REPORT_SDP_CMD_SIZE     17
+#define DCD_PACKED_SIZE         12 // one dcd_t as sent, big-endian
 #define REPORT_DATA_SIZE        1025
 #define REPORT_HAB_MODE_SIZE    5
 #define REPORT_STATUS_SIZE      65
@@ -60,10 +70,66 @@
 #define ERROR_PARAMETER         -5
 #define ERROR_COMMAND           -6
 #define ERROR_RETURN            -7
+#define ERROR_VERIFY            -8
+#define ERROR_CANCELLED         -9
+#define ERROR_NO_HAB            -10 // timed out waiting for report 3
+#define ERROR_NO_ACK            -11 // timed out waiting for report 4
+#define ERROR_PARTIAL_DATA      -12 // timed out part way through a read
+#define ERROR_NO_DEVICE         -13 // device did not come back after a jump
 
 #define IVT_BARKER_HEADER       0x402000D1
+#define IVT_BARKER_MASK         0xF0FFFFFF
+#define DCD_HEADER_TAG          0xD2
+#define DCD_WRITE_TAG           0xCC
+#define DCD_CHECK_TAG           0xCF
+#define DCD_NOP_TAG             0xC0
+#define DCD_UNLOCK_TAG          0xB2
+#define DCD_FLAG_MASK           0x08
+#define DCD_FLAG_SET            0x10
+#define DCD_POLL_LIMIT          1000
+#define DCD_VERSION             0x40
+#define DCD_TRIPLES             0 // CMD_DCD_WRITE counts registers, data is packed dcd_t (i.MX50)
+#define DCD_TABLE               1 // CMD_DCD_WRITE counts bytes, data is a DCD table staged at dcd_address
 #define ROM_TRANSFER_SIZE       0x400
 
+#define DEFAULT_ROUTINE_ADDRESS 0xF8010000 // free IRAM on the i.MX50
+#define VERIFY_MAX_BLOCKS       252
+#define DCD_VERIFY_GAP          0x40 // unwritten bytes read to join two spans, one status report
+#define DCD_VERIFY_MAX_BAD      32
+#define VERIFY_MAX_RANGES       64
+#define VERIFY_MERGE_GAP        0x400 // matching bytes rewritten to join two ranges, one data report
+#define VIEW_PAGE_SIZE          0x400
+#define VIEW_READ_AHEAD         16
+#define VIEW_MERGE_GAP          0x1000 // cached bytes sent to join two writes
+#define SPARSE_MIN_RUN          0x4000 // shorter runs cost more in round trips than they save
+#define REENUM_PORT_SIZE        256 // Windows hidapi paths are long
+#define REENUM_TIMEOUT          5000
+#define REENUM_POLL_TIME        5
+#define SOC_MAX_IDS             4
+#define PLAN_DATA_DELAY         10 // ms before the data of a write, from the reference implementation
+#define PLAN_MIN_CHUNK          0x4000
+#define PLAN_PROBE_SIZE         0x8000 // fits in the free IRAM of every SoC profile
+#define PLAN_RECOVER_WRITES     16 // good writes at the defaults before the tuned plan is tried again
+#define PLAN_MAX_RECOVER        1024 // the wait doubles each time the tuned plan turns out slower
+#define MANIFEST_MAX_PAYLOADS   32
+#define MANIFEST_MAX_WRITES     256
+#define MANIFEST_READ_BLOCK     0x40000 // read by each file's thread before the stream can use it
+#define REALTIME_PRIORITY       50 // SCHED_FIFO, below the kernel's IRQ threads
+#define REALTIME_STACK          (MAX_DOWNLOAD_SIZE + 0x10000) // loads keep a whole chunk on the stack
+
+#define MEMTEST_DATA_BUS        0x1
+#define MEMTEST_ADDRESS_BUS     0x2
+#define MEMTEST_ADDRESS         0x4
+#define MEMTEST_RANDOM          0x8
+#define MEMTEST_ALL             0xF
+
+#define REALTIME_FIFO           0x1
+#define REALTIME_AFFINITY       0x2
+#define REALTIME_LOCKED         0x4
+
+#define PROGRESS_INTERVAL       250
+#define PROGRESS_CHECK_SIZE     0x4000
+
 #define DEBUG_LOG               0x10
 #define INFO_LOG                0x100
 #define WARNING_LOG             0x1000
@@ -123,27 +189,246 @@ extern "C" {
         unsigned int plugin_flag;
     };
 
+    // settings and results of imx50_memory_test()
+    struct memtest {
+        unsigned int tests;         // MEMTEST_* flags
+        unsigned int coverage;      // percent of the region to pattern test
+        unsigned int time_limit;    // in ms, zero for no limit
+        unsigned int seed;          // for MEMTEST_RANDOM
+        // filled in by the test
+        int complete;               // zero if time limit was hit
+        unsigned int bytes_tested;
+        unsigned int failed_test;   // MEMTEST_* flag of the failure
+        device_addr_t fail_address;
+        unsigned int expected;
+        unsigned int actual;
+    };
+
+    // settings and results of imx50_load_file_crc()
+    struct crc_verify {
+        device_addr_t routine;      // IRAM for the checksum routine, zero for the SoC profile's
+        unsigned int block_size;    // bytes per CRC, zero to fit the file in VERIFY_MAX_BLOCKS
+        // results
+        unsigned int blocks;        // number of blocks checked
+        unsigned int bad_count;     // number of blocks that differ
+        unsigned int bad[VERIFY_MAX_BLOCKS]; // index of each block that differs
+    };
+
+    // bits of a register imx50_dcd_verify() compares
+    struct dcd_mask {
+        device_addr_t address;
+        unsigned int mask;          // zero to skip the register
+    };
+
+    // a register that did not read back as written
+    struct dcd_mismatch {
+        device_addr_t address;
+        unsigned int expected;
+        unsigned int actual;
+        unsigned int mask;          // bits that were compared
+    };
+
+    // settings and results of imx50_dcd_verify()
+    struct dcd_verify {
+        const struct dcd_mask *masks; // for self-clearing or status bits, NULL to compare every bit
+        unsigned int mask_count;
+        unsigned int max_gap;       // unwritten bytes read to join two spans, zero for DCD_VERIFY_GAP
+        // results
+        unsigned int checked;       // registers compared
+        unsigned int reads;         // read commands sent
+        unsigned int bad_count;     // registers that differ, only the first DCD_VERIFY_MAX_BAD are kept
+        struct dcd_mismatch bad[DCD_VERIFY_MAX_BAD];
+    };
+
+    // device memory that did not read back as written
+    struct verify_range {
+        device_addr_t address;
+        unsigned int size;
+    };
+
+    // settings and results of imx50_verify_memory() and imx50_load_file_verify()
+    struct read_verify {
+        int rewrite;                // non-zero to write the ranges that differ again and check them
+        unsigned int merge_gap;     // matching bytes between two ranges that join them, zero for VERIFY_MERGE_GAP
+        // results
+        unsigned int bad_bytes;     // bytes that differ
+        unsigned int range_count;   // ranges that differ, the last one grows when the list is full
+        unsigned int rewritten;     // bytes written again
+        struct verify_range ranges[VERIFY_MAX_RANGES];
+    };
+
+    // settings and results of imx50_load_file_sparse()
+    struct sparse_load {
+        device_addr_t routine;      // IRAM for the fill routine, zero for the SoC profile's
+        unsigned int min_run;       // shortest run of one byte value to skip, zero for SPARSE_MIN_RUN
+        // results
+        unsigned int runs;          // runs filled on the device
+        unsigned int sent;          // bytes sent over USB
+        unsigned int skipped;       // bytes filled on the device instead
+    };
+
+    // results of imx50_run_manifest()
+    struct manifest_result {
+        unsigned int payloads;      // files loaded
+        unsigned int regions;       // runs of files with no gap between them
+        unsigned int commands;      // CMD_WRITE_FILE sent
+        unsigned int bytes;
+    };
+
+    // results of imx50_jump_and_wait()
+    struct reenum {
+        char port[REENUM_PORT_SIZE]; // USB port path, like 1-1.2
+        unsigned short vendor_id;   // what came back on the port
+        unsigned short product_id;
+        unsigned int gone_ms;       // from the jump to the device leaving
+        unsigned int back_ms;       // from the jump to the port being used again
+        unsigned int ready_ms;      // from the jump to the new handle opening, zero if none
+    };
+
+    // how writes are sent, see imx50_tune_transfers()
+    struct transfer_plan {
+        unsigned int chunk_size;    // bytes per CMD_WRITE_FILE in loads
+        unsigned int data_delay;    // ms between a write command and its data
+        int tuned;                  // zero while the defaults are used
+        // live stats
+        unsigned int writes;        // writes sent since the plan was set
+        unsigned int errors;        // writes that failed, each one goes back to the defaults
+        unsigned int rate;          // bytes/sec of recent large writes
+    };
+
+    // set with imx50_set_realtime()
+    struct realtime {
+        int priority;               // SCHED_FIFO priority, zero for REALTIME_PRIORITY
+        int cpu;                    // CPU to run on, -1 for any
+        int applied;                // gets the REALTIME_* that worked
+    };
+
+    // round trips from the last report sent to the HAB state, see imx50_get_latency()
+    struct latency {
+        unsigned int count;
+        unsigned int min_us;
+        unsigned int p50_us;
+        unsigned int p99_us;
+        unsigned int p999_us;
+        unsigned int max_us;
+    };
+
+    // USB IDs a SoC's ROM enumerates as
+    struct usb_id {
+        unsigned short vendor_id;
+        unsigned short product_id;
+    };
+
+    // what differs between SoCs that speak SDP, see imx50_get_profile()
+    struct soc_profile {
+        const char *name;
+        struct usb_id ids[SOC_MAX_IDS]; // zero after the last one
+        unsigned int data_report_size;  // with the report number, up to REPORT_DATA_SIZE
+        unsigned int status_report_size; // up to REPORT_STATUS_SIZE
+        unsigned int dcd_max;           // registers per CMD_DCD_WRITE, up to MAX_DCD_BATCH_CNT
+        unsigned int dcd_format;        // DCD_TRIPLES or DCD_TABLE
+        device_addr_t dcd_address;      // where the ROM copies a DCD table, zero for DCD_TRIPLES
+        unsigned int max_download;      // bytes per CMD_WRITE_FILE, up to MAX_DOWNLOAD_SIZE
+        device_addr_t iram_start;
+        unsigned int iram_size;
+        device_addr_t ddr_start;
+        unsigned int ddr_size;
+        device_addr_t routine;          // free IRAM for routines and write probes
+    };
+
+    // passed to the progress callback
+    struct progress {
+        unsigned int done;          // bytes sent or received
+        unsigned int total;
+        unsigned int rate;          // bytes/sec since the last call
+        unsigned int average;       // bytes/sec since the start
+        unsigned int eta;           // ms left at the average rate
+    };
+
+    // set with imx50_set_transfer_options()
+    struct transfer_options {
+        int (*progress)(void *context, const struct progress *status); // return non-zero to cancel
+        void *context;              // passed to progress
+        unsigned int interval;      // ms between calls, zero for PROGRESS_INTERVAL
+    };
+
     // abstration for hid_device
     struct imx50_device;
+    
+    // cached view of device memory
+    struct imx50_view;
 
     typedef struct sdp sdp_t;
     typedef struct dcd dcd_t;
     typedef struct ivt ivt_t;
     typedef struct boot_data boot_data_t;
+    typedef struct memtest memtest_t;
+    typedef struct crc_verify crc_verify_t;
+    typedef struct dcd_mask dcd_mask_t;
+    typedef struct dcd_mismatch dcd_mismatch_t;
+    typedef struct dcd_verify dcd_verify_t;
+    typedef struct verify_range verify_range_t;
+    typedef struct read_verify read_verify_t;
+    typedef struct sparse_load sparse_load_t;
+    typedef struct reenum reenum_t;
+    typedef struct transfer_plan transfer_plan_t;
+    typedef struct manifest_result manifest_result_t;
+    typedef struct realtime realtime_t;
+    typedef struct latency latency_t;
+    typedef struct usb_id usb_id_t;
+    typedef struct soc_profile soc_profile_t;
+    typedef struct progress progress_t;
+    typedef struct transfer_options transfer_options_t;
     typedef struct imx50_device imx50_device_t;
+    typedef struct imx50_view imx50_view_t;
 
     // helper functions (hidden to user)
-    //unsigned char *imx50_pack_command(sdp_t *command);
+    //void imx50_pack_command(const sdp_t *command, unsigned char *report);
 
     // device`management
     IMX50USB_EXPORT imx50_device_t *imx50_init_device();
+    IMX50USB_EXPORT imx50_device_t *imx50_open_device(int transport, unsigned int queue_depth);
     IMX50USB_EXPORT void imx50_close_device(imx50_device_t *device);
+    IMX50USB_EXPORT const soc_profile_t *imx50_get_profile(imx50_device_t *device);
+    IMX50USB_EXPORT const soc_profile_t *imx50_find_profile(unsigned short vendor_id, unsigned short product_id);
+
+    // background reader
+    IMX50USB_EXPORT int imx50_start_reader(imx50_device_t *device, unsigned int reports);
+    IMX50USB_EXPORT void imx50_stop_reader(imx50_device_t *device);
+    IMX50USB_EXPORT int imx50_reader_stats(imx50_device_t *device, unsigned int *stalled_p, unsigned int *dropped_p);
+
+    // capture and replay
+    IMX50USB_EXPORT int imx50_start_capture(imx50_device_t *device, const char *filename);
+    IMX50USB_EXPORT void imx50_stop_capture(imx50_device_t *device);
+    IMX50USB_EXPORT imx50_device_t *imx50_open_replay(const char *filename, int realtime);
+    
+    // timeline
+    IMX50USB_EXPORT int imx50_start_trace(const char *filename);
+    IMX50USB_EXPORT int imx50_stop_trace();
+    IMX50USB_EXPORT void imx50_span_begin(const char *name, const char *arg_name, unsigned int arg);
+    IMX50USB_EXPORT void imx50_span_end(const char *name);
 
     // other
     IMX50USB_EXPORT void imx50_log_level(int log_mask);
+    IMX50USB_EXPORT void imx50_set_timeout(imx50_device_t *device, unsigned short command_type, int timeout);
+    IMX50USB_EXPORT void imx50_set_transfer_options(imx50_device_t *device, const transfer_options_t *options);
+
+    // transfer planner
+    IMX50USB_EXPORT int imx50_tune_transfers(imx50_device_t *device, device_addr_t scratch, unsigned int size);
+    IMX50USB_EXPORT void imx50_get_plan(imx50_device_t *device, transfer_plan_t *plan);
+    IMX50USB_EXPORT int imx50_load_plan(imx50_device_t *device, const char *filename);
+    IMX50USB_EXPORT int imx50_save_plan(imx50_device_t *device, const char *filename);
+
+    // real-time mode
+    IMX50USB_EXPORT int imx50_set_realtime(imx50_device_t *device, realtime_t *options);
+    IMX50USB_EXPORT void imx50_get_latency(imx50_device_t *device, latency_t *latency, int reset);
+
+    // image cache
+    IMX50USB_EXPORT int imx50_set_cache(imx50_device_t *device, const char *directory);
 
     // reports
     IMX50USB_EXPORT int imx50_send_command(imx50_device_t *device, sdp_t *command);
+    IMX50USB_EXPORT int imx50_send_packed(imx50_device_t *device, const unsigned char *data);
     IMX50USB_EXPORT int imx50_send_data(imx50_device_t *device, unsigned char *payload, unsigned int size);
     IMX50USB_EXPORT int imx50_get_hab_type(imx50_device_t *device);
     IMX50USB_EXPORT int imx50_get_dev_ack(imx50_device_t *device, unsigned char **payload_p, unsigned int *size_p);
@@ -154,12 +439,53 @@ extern "C" {
     IMX50USB_EXPORT int imx50_write_memory(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count);
     IMX50USB_EXPORT int imx50_error_status(imx50_device_t *device);
     IMX50USB_EXPORT int imx50_dcd_write(imx50_device_t *device, dcd_t *buffer, unsigned int count);
+    IMX50USB_EXPORT int imx50_dcd_write_packed(imx50_device_t *device, const unsigned char *payload, unsigned int count);
+    IMX50USB_EXPORT int imx50_queue_register(imx50_device_t *device, device_addr_t address, unsigned int data, unsigned char format);
+    IMX50USB_EXPORT int imx50_queue_dcd(imx50_device_t *device, const dcd_t *buffer, unsigned int count);
+    IMX50USB_EXPORT int imx50_flush_queue(imx50_device_t *device);
+    IMX50USB_EXPORT int imx50_delay(imx50_device_t *device, unsigned int ms);
     IMX50USB_EXPORT int imx50_jump(imx50_device_t *device, device_addr_t address);
+    IMX50USB_EXPORT int imx50_re_enum(imx50_device_t *device);
+    IMX50USB_EXPORT int imx50_get_port(imx50_device_t *device, char *port, unsigned int size);
+    IMX50USB_EXPORT int imx50_jump_and_wait(imx50_device_t *device, device_addr_t address, unsigned int timeout, reenum_t *result, imx50_device_t **device_p);
+
+    // register shadow
+    IMX50USB_EXPORT void imx50_invalidate_shadow(imx50_device_t *device, device_addr_t address, unsigned int count);
+    IMX50USB_EXPORT int imx50_read_register(imx50_device_t *device, device_addr_t address, unsigned int *value_p);
+    IMX50USB_EXPORT int imx50_modify_field(imx50_device_t *device, device_addr_t address, unsigned int mask, unsigned int value);
+    IMX50USB_EXPORT int imx50_set_bits(imx50_device_t *device, device_addr_t address, unsigned int mask);
+    IMX50USB_EXPORT int imx50_clear_bits(imx50_device_t *device, device_addr_t address, unsigned int mask);
 
     // abstractions
     IMX50USB_EXPORT device_addr_t imx50_add_header(imx50_device_t *device, device_addr_t address);
     IMX50USB_EXPORT int imx50_load_file(imx50_device_t *device, device_addr_t address, const char *filename);
+    IMX50USB_EXPORT int imx50_load_and_jump(imx50_device_t *device, device_addr_t address, const char *filename, boot_data_t *boot_data);
+    IMX50USB_EXPORT int imx50_boot_image(imx50_device_t *device, const char *filename);
+    IMX50USB_EXPORT int imx50_run_manifest(imx50_device_t *device, const char *filename, manifest_result_t *result);
     IMX50USB_EXPORT int imx50_kindle_init(imx50_device_t *device);
+    IMX50USB_EXPORT int imx50_kindle_verify(imx50_device_t *device, dcd_verify_t *verify);
+    IMX50USB_EXPORT int imx50_memory_test(imx50_device_t *device, device_addr_t address, unsigned int size, memtest_t *test);
+
+    // read back
+    IMX50USB_EXPORT int imx50_dcd_verify(imx50_device_t *device, const dcd_t *buffer, unsigned int count, dcd_verify_t *verify);
+    IMX50USB_EXPORT int imx50_verify_memory(imx50_device_t *device, device_addr_t address, const unsigned char *data, unsigned int size, read_verify_t *verify);
+    IMX50USB_EXPORT int imx50_load_file_verify(imx50_device_t *device, device_addr_t address, const char *filename, read_verify_t *verify);
+
+    // cached memory
+    IMX50USB_EXPORT imx50_view_t *imx50_open_view(imx50_device_t *device, device_addr_t address, unsigned int size, unsigned int read_ahead);
+    IMX50USB_EXPORT int imx50_close_view(imx50_view_t *view);
+    IMX50USB_EXPORT int imx50_view_read(imx50_view_t *view, device_addr_t address, unsigned char *buffer, unsigned int count);
+    IMX50USB_EXPORT int imx50_view_write(imx50_view_t *view, device_addr_t address, const unsigned char *buffer, unsigned int count);
+    IMX50USB_EXPORT int imx50_view_peek(imx50_view_t *view, device_addr_t address, unsigned int *value_p);
+    IMX50USB_EXPORT int imx50_view_poke(imx50_view_t *view, device_addr_t address, unsigned int value);
+    IMX50USB_EXPORT int imx50_view_flush(imx50_view_t *view);
+    IMX50USB_EXPORT void imx50_view_invalidate(imx50_view_t *view);
+    
+    // routines run on the device
+    IMX50USB_EXPORT unsigned int imx50_crc32(unsigned int crc, const unsigned char *data, unsigned int size);
+    IMX50USB_EXPORT int imx50_device_crc(imx50_device_t *device, device_addr_t routine, device_addr_t address, unsigned int size, unsigned int block_size, unsigned int *crcs);
+    IMX50USB_EXPORT int imx50_load_file_crc(imx50_device_t *device, device_addr_t address, const char *filename, crc_verify_t *verify);
+    IMX50USB_EXPORT int imx50_load_file_sparse(imx50_device_t *device, device_addr_t address, const char *filename, sparse_load_t *sparse);
 
     #endif
 
@@ -0,0 +1,287 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// C++17 layer over imxusb.h, header only
+//
+//  constexpr auto init = imx50::pack_dcd({
+//      imx50::dcd_entry(0x53FD4068, 0xFFFFFFFF),
+//      imx50::dcd_entry(0x53FD406C, 0xFFFFFFFF),
+//  });
+//  auto dev = imx50::device::open();
+//  if(auto ret = dev->dcd_write(init); !ret) ...
+
+#ifndef IMX50USB_HPP
+#define IMX50USB_HPP
+
+#include "imxusb.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace imx50 {
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+    template<class T> using span = std::span<T>;
+#else
+    // the parts of std::span this file uses
+    template<class T>
+    class span {
+    public:
+        constexpr span() noexcept : data_(nullptr), size_(0) {}
+        constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+        template<std::size_t N>
+        constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+        // anything with data() and size(), like std::vector and std::array
+        template<class C, class = std::enable_if_t<std::is_convertible_v<decltype(std::declval<C&>().data()), T*>>>
+        constexpr span(C &c) noexcept : data_(c.data()), size_(c.size()) {}
+        template<class U, class = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+        constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+        constexpr T *data() const noexcept { return data_; }
+        constexpr std::size_t size() const noexcept { return size_; }
+        constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+        constexpr bool empty() const noexcept { return size_ == 0; }
+        constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+        constexpr T *begin() const noexcept { return data_; }
+        constexpr T *end() const noexcept { return data_ + size_; }
+        constexpr span subspan(std::size_t offset, std::size_t count) const noexcept { return span(data_ + offset, count); }
+
+    private:
+        T *data_;
+        std::size_t size_;
+    };
+#endif
+
+    // an ERROR_* code from the library, or a status from the device
+    class failure {
+    public:
+        constexpr explicit failure(int code) noexcept : code_(code) {}
+        constexpr int code() const noexcept { return code_; }
+        const char *what() const noexcept {
+            switch(code_) {
+                case ERROR_OUT_OF_MEMORY: return "out of memory";
+                case ERROR_IO: return "I/O error";
+                case ERROR_WRITE: return "write failed";
+                case ERROR_READ: return "read failed";
+                case ERROR_PARAMETER: return "bad parameter";
+                case ERROR_COMMAND: return "command failed";
+                case ERROR_RETURN: return "bad return from device";
+                case ERROR_VERIFY: return "verify failed";
+                case ERROR_CANCELLED: return "cancelled";
+                case ERROR_NO_HAB: return "no HAB report";
+                case ERROR_NO_ACK: return "no status report";
+                case ERROR_PARTIAL_DATA: return "partial data";
+                case ERROR_NO_DEVICE: return "device did not come back";
+                default: return "device status";
+            }
+        }
+
+    private:
+        int code_;
+    };
+
+    // a value or a failure, like std::expected<T, failure>
+    template<class T>
+    class result {
+    public:
+        result(const T &value) : has_(true) { new(&value_) T(value); }
+        result(T &&value) : has_(true) { new(&value_) T(std::move(value)); }
+        result(failure e) noexcept : has_(false), error_(e) {}
+        result(const result &other) : has_(other.has_), error_(other.error_) { if(has_) new(&value_) T(other.value_); }
+        result(result &&other) : has_(other.has_), error_(other.error_) { if(has_) new(&value_) T(std::move(other.value_)); }
+        result &operator=(const result &) = delete;
+        result &operator=(result &&) = delete;
+        ~result() { if(has_) value_.~T(); }
+
+        constexpr bool has_value() const noexcept { return has_; }
+        constexpr explicit operator bool() const noexcept { return has_; }
+        T &value() & { return value_; }
+        const T &value() const & { return value_; }
+        T &&value() && { return std::move(value_); }
+        T &operator*() & { return value_; }
+        T &&operator*() && { return std::move(value_); }
+        T *operator->() { return &value_; }
+        const T *operator->() const { return &value_; }
+        constexpr failure error() const noexcept { return error_; }
+
+    private:
+        bool has_;
+        failure error_{0};
+        union { T value_; };
+    };
+
+    template<>
+    class result<void> {
+    public:
+        constexpr result() noexcept : error_(0) {}
+        constexpr result(failure e) noexcept : error_(e) {}
+        constexpr bool has_value() const noexcept { return error_.code() == 0; }
+        constexpr explicit operator bool() const noexcept { return has_value(); }
+        constexpr failure error() const noexcept { return error_; }
+
+    private:
+        failure error_;
+    };
+
+    // zero is success, anything else goes in the error
+    inline result<void> check(int ret) noexcept {
+        return ret == 0 ? result<void>() : result<void>(failure(ret));
+    }
+
+    // reports packed at compile time, big-endian like the ROM wants
+    using command_report = std::array<std::uint8_t, REPORT_SDP_CMD_SIZE>;
+
+    constexpr void put_be32(std::uint8_t *p, std::uint32_t x) noexcept {
+        p[0] = static_cast<std::uint8_t>(x >> 24);
+        p[1] = static_cast<std::uint8_t>(x >> 16);
+        p[2] = static_cast<std::uint8_t>(x >> 8);
+        p[3] = static_cast<std::uint8_t>(x);
+    }
+
+    constexpr command_report pack_command(const sdp_t &command) noexcept {
+        command_report report{};
+        report[0] = REPORT_ID_SDP_CMD;
+        report[1] = static_cast<std::uint8_t>(command.command_type >> 8);
+        report[2] = static_cast<std::uint8_t>(command.command_type);
+        put_be32(&report[3], command.address);
+        report[7] = command.format;
+        put_be32(&report[8], command.data_count);
+        put_be32(&report[12], command.data);
+        return report;
+    }
+
+    constexpr command_report make_command(unsigned short command_type, device_addr_t address = 0, unsigned char format = 0, unsigned int data_count = 0, unsigned int data = 0) noexcept {
+        return pack_command(sdp_t{REPORT_ID_SDP_CMD, command_type, address, format, data_count, data, 0});
+    }
+
+    constexpr dcd_t dcd_entry(device_addr_t address, unsigned int value, unsigned int data_format = BITSOF(int)) noexcept {
+        return dcd_t{data_format, address, value};
+    }
+
+    // packed table for device::dcd_write(), DCD_PACKED_SIZE bytes each
+    template<std::size_t N>
+    constexpr std::array<std::uint8_t, N * DCD_PACKED_SIZE> pack_dcd(const dcd_t (&table)[N]) noexcept {
+        std::array<std::uint8_t, N * DCD_PACKED_SIZE> payload{};
+        for(std::size_t i = 0; i < N; i++) {
+            put_be32(&payload[i * DCD_PACKED_SIZE + 0], table[i].data_format);
+            put_be32(&payload[i * DCD_PACKED_SIZE + 4], table[i].address);
+            put_be32(&payload[i * DCD_PACKED_SIZE + 8], table[i].value);
+        }
+        return payload;
+    }
+
+    static_assert(make_command(CMD_WRITE_REGISTER, 0x12345678, 32, 4, 0xAABBCCDD)[3] == 0x12 &&
+        make_command(CMD_WRITE_REGISTER, 0x12345678, 32, 4, 0xAABBCCDD)[11] == 4 &&
+        make_command(CMD_WRITE_REGISTER, 0x12345678, 32, 4, 0xAABBCCDD)[15] == 0xDD,
+        "SDP commands are big-endian");
+
+    // owns an imx50_device_t, closed when destroyed
+    class device {
+    public:
+        device() noexcept : handle_(nullptr) {}
+        explicit device(imx50_device_t *handle) noexcept : handle_(handle) {}
+        device(device &&other) noexcept : handle_(other.release()) {}
+        device &operator=(device &&other) noexcept { reset(other.release()); return *this; }
+        device(const device &) = delete;
+        device &operator=(const device &) = delete;
+        ~device() { reset(); }
+
+        // blocks until a device is found, see imx50_open_device()
+        static result<device> open(int transport = TRANSPORT_HIDAPI, unsigned int queue_depth = 0) {
+            imx50_device_t *handle = imx50_open_device(transport, queue_depth);
+            if(!handle) {
+                return failure(ERROR_PARAMETER);
+            }
+            return device(handle);
+        }
+
+        imx50_device_t *get() const noexcept { return handle_; }
+        explicit operator bool() const noexcept { return handle_ != nullptr; }
+        imx50_device_t *release() noexcept { imx50_device_t *handle = handle_; handle_ = nullptr; return handle; }
+        void reset(imx50_device_t *handle = nullptr) noexcept {
+            if(handle_) {
+                imx50_close_device(handle_);
+            }
+            handle_ = handle;
+        }
+
+        result<void> read(device_addr_t address, span<std::uint8_t> buffer) {
+            return check(imx50_read_memory(handle_, address, buffer.data(), static_cast<unsigned int>(buffer.size())));
+        }
+        result<void> write(device_addr_t address, span<const std::uint8_t> buffer) {
+            // imx50_write_memory() only reads the buffer
+            return check(imx50_write_memory(handle_, address, const_cast<std::uint8_t*>(buffer.data()), static_cast<unsigned int>(buffer.size())));
+        }
+        result<unsigned int> read_register(device_addr_t address) {
+            unsigned int value;
+            int ret = imx50_read_register(handle_, address, &value);
+            if(ret != 0) {
+                return failure(ret);
+            }
+            return value;
+        }
+        result<void> write_register(device_addr_t address, unsigned int value, unsigned char format = BITSOF(int)) {
+            return check(imx50_write_register(handle_, address, value, format));
+        }
+        result<void> queue_register(device_addr_t address, unsigned int value, unsigned char format = BITSOF(int)) {
+            return check(imx50_queue_register(handle_, address, value, format));
+        }
+        result<void> flush_queue() {
+            return check(imx50_flush_queue(handle_));
+        }
+        // only the command report, read the reply with get()
+        result<void> send(const command_report &report) {
+            return check(imx50_send_packed(handle_, report.data()));
+        }
+        // a table from pack_dcd(), sent without repacking
+        result<void> dcd_write(span<const std::uint8_t> payload) {
+            if(payload.size() % DCD_PACKED_SIZE != 0) {
+                return failure(ERROR_PARAMETER);
+            }
+            return check(imx50_dcd_write_packed(handle_, payload.data(), static_cast<unsigned int>(payload.size() / DCD_PACKED_SIZE)));
+        }
+        result<void> jump(device_addr_t address) {
+            return check(imx50_jump(handle_, address));
+        }
+        result<void> load_file(device_addr_t address, const char *filename) {
+            return check(imx50_load_file(handle_, address, filename));
+        }
+        result<void> kindle_init() {
+            return check(imx50_kindle_init(handle_));
+        }
+        // ERROR_VERIFY if registers differ, they are in verify.bad
+        result<void> dcd_verify(span<const dcd_t> table, dcd_verify_t &verify) {
+            return check(imx50_dcd_verify(handle_, table.data(), static_cast<unsigned int>(table.size()), &verify));
+        }
+        result<void> kindle_verify(dcd_verify_t &verify) {
+            return check(imx50_kindle_verify(handle_, &verify));
+        }
+
+    private:
+        imx50_device_t *handle_;
+    };
+
+}
+
+#endif
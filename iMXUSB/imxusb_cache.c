@@ -0,0 +1,576 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// images kept on disk as the data reports that load them
+
+#include "imxusb_private.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef S_ISDIR
+#define S_ISDIR(m)              ( ((m) & S_IFMT) == S_IFDIR )
+#endif
+
+// nanoseconds of a file time
+#if defined(__APPLE__)
+#define STAT_NSEC(st, x)        ( (st).st_##x##timespec.tv_nsec )
+#elif defined(__linux__)
+#define STAT_NSEC(st, x)        ( (st).st_##x##tim.tv_nsec )
+#else
+#define STAT_NSEC(st, x)        0
+#endif
+
+#define CACHE_MAGIC             "IMX50C2"
+#define CACHE_PATH_SIZE         1024
+#define CACHE_KEY_SIZE          17 // 16 hex digits
+#define CACHE_NAME_SIZE         64 // longest name in the directory, temporary ones too
+
+// 64-bit FNV-1a, built from halves for compilers without long long constants
+#define FNV_BASIS               ( ((uint64_t)0xCBF29CE4 << 32) | 0x84222325 )
+#define FNV_PRIME               ( ((uint64_t)0x100 << 32) | 0x000001B3 )
+
+// start of an entry, in host byte order. entries are not
+// meant to be copied to other machines.
+typedef struct {
+    char magic[8];
+    uint32_t table_size;    // this and the chunk table, the frames follow
+    uint32_t image_size;    // load header and file
+    uint32_t header_size;   // load header (IVT) in front of the file
+    uint32_t chunk_size;    // bytes per write command
+    uint32_t report_size;   // bytes per frame, with the report number
+    uint32_t chunk_count;
+    uint32_t key_high;      // content key
+    uint32_t key_low;
+} imx50_cache_header_t;
+
+// one write command
+typedef struct {
+    uint32_t offset;        // in the image, the header starts at zero
+    uint32_t size;
+    uint32_t frame;         // where its first report is in the entry
+} imx50_cache_chunk_t;
+
+/**
+    @brief Adds bytes to a FNV-1a hash
+ */
+uint64_t imx50_cache_hash(uint64_t hash, const void *data, unsigned int size) {
+    const unsigned char *bytes = data;
+
+    while(size--) {
+        hash = (hash ^ *bytes++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+    @brief Adds a number to a FNV-1a hash
+ */
+uint64_t imx50_cache_hash_int(uint64_t hash, unsigned int value) {
+    unsigned char bytes[4];
+
+    PUT_BE32(bytes, value);
+    return imx50_cache_hash(hash, bytes, sizeof(bytes));
+}
+
+/**
+    @brief Makes the name of a file in the cache
+ */
+void imx50_cache_path(imx50_device_t *device, char *path, const char *prefix, uint64_t key, const char *suffix) {
+    snprintf(path, CACHE_PATH_SIZE, "%s/%s%08X%08X%s", device->cache, prefix, (unsigned int)(key >> 32), (unsigned int)key, suffix);
+}
+
+/**
+    @brief Maps a cache file read only
+
+    Every handle mapping the same entry shares its pages.
+
+    @param path The file
+    @param size_p Gets its size
+
+    @return Where it is mapped, NULL on error
+ */
+unsigned char *imx50_cache_map(const char *path, unsigned int *size_p) {
+    unsigned char *data;
+#ifdef _WIN32
+    HANDLE hFile;
+    HANDLE hMapping;
+    LARGE_INTEGER lsize;
+
+    hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    if(GetFileSizeEx(hFile, &lsize) == 0 || lsize.QuadPart < (LONGLONG)sizeof(imx50_cache_header_t)) {
+        CloseHandle(hFile);
+        return NULL;
+    }
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if(hMapping == NULL) {
+        return NULL;
+    }
+    data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping); // the view keeps it open
+    if(data == NULL) {
+        return NULL;
+    }
+    *size_p = (unsigned int)lsize.QuadPart;
+#else
+    struct stat st;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(imx50_cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps it open
+    if(data == MAP_FAILED) {
+        return NULL;
+    }
+    *size_p = (unsigned int)st.st_size;
+#endif
+
+    return data;
+}
+
+/**
+    @brief Unmaps a cache file
+ */
+void imx50_cache_unmap(unsigned char *data, unsigned int size) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+/**
+    @brief Checks that an entry is whole and built for this load
+
+    Only the header and the chunk table are looked at, the
+    frames are trusted. Every chunk must follow the one
+    before it and have all of its frames in the entry.
+
+    @return Zero if it can be used, negative otherwise
+ */
+int imx50_cache_check(const unsigned char *entry, unsigned int size, uint64_t key, unsigned int header_size, unsigned int chunk_size, unsigned int report_size) {
+    const imx50_cache_header_t *head = (const imx50_cache_header_t*)entry;
+    const imx50_cache_chunk_t *table = (const imx50_cache_chunk_t*)(entry + sizeof(imx50_cache_header_t));
+    unsigned int offset, frame, frames;
+    unsigned int i;
+
+    if(memcmp(head->magic, CACHE_MAGIC, sizeof(head->magic)) != 0 ||
+       head->key_high != (uint32_t)(key >> 32) || head->key_low != (uint32_t)key ||
+       head->header_size != header_size || head->chunk_size != chunk_size || head->report_size != report_size) {
+        return -1;
+    }
+    if(head->chunk_count != (head->image_size + chunk_size - 1) / chunk_size ||
+       head->table_size != sizeof(imx50_cache_header_t) + head->chunk_count * sizeof(imx50_cache_chunk_t) || head->table_size > size) {
+        return -1;
+    }
+    for(i = 0, offset = 0, frame = head->table_size; i < head->chunk_count; i++) {
+        if(table[i].offset != offset || table[i].size == 0 || table[i].size > chunk_size || table[i].size > head->image_size - offset ||
+           table[i].frame < frame || table[i].frame > size) {
+            return -1;
+        }
+        frames = (table[i].size + report_size - 2) / (report_size - 1);
+        if((size - table[i].frame) / report_size < frames) {
+            return -1; // cut short
+        }
+        offset += table[i].size;
+        frame = table[i].frame + frames * report_size;
+    }
+    if(offset != head->image_size) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+    @brief Writes an entry for an image
+
+    The entry is written next to its final name and renamed
+    into place, so other processes never see half of it. If
+    two build the same entry at once, either copy is kept,
+    they are the same.
+
+    @param device The device, for the cache directory
+    @param path Name of the entry
+    @param file Contents of the file
+    @param file_size Size of the file
+    @param header Load header, sent right before the file
+    @param header_size Size of header
+    @param chunk_size Bytes per write command
+    @param report_size Bytes per data report, with the report number
+    @param key Content key
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_cache_build(imx50_device_t *device, const char *path, const unsigned char *file, unsigned int file_size, const unsigned char *header, unsigned int header_size, unsigned int chunk_size, unsigned int report_size, uint64_t key) {
+    char temp[CACHE_PATH_SIZE];
+    imx50_cache_header_t head;
+    imx50_cache_chunk_t *table;
+    unsigned char *frame;
+    unsigned int data_size = report_size - 1;
+    unsigned int offset, done, size, piece, fill;
+    unsigned int frames;
+    unsigned int i;
+    FILE *fp;
+    int ret = 0;
+
+    memset(&head, 0, sizeof(imx50_cache_header_t));
+    memcpy(head.magic, CACHE_MAGIC, sizeof(head.magic));
+    head.image_size = header_size + file_size;
+    head.header_size = header_size;
+    head.chunk_size = chunk_size;
+    head.report_size = report_size;
+    head.chunk_count = (head.image_size + chunk_size - 1) / chunk_size;
+    head.table_size = sizeof(imx50_cache_header_t) + head.chunk_count * sizeof(imx50_cache_chunk_t);
+    head.key_high = (uint32_t)(key >> 32);
+    head.key_low = (uint32_t)key;
+
+    table = malloc(head.chunk_count * sizeof(imx50_cache_chunk_t) + 1);
+    frame = malloc(report_size);
+    if(!table || !frame) {
+        free(table);
+        free(frame);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    for(i = 0, offset = 0, frames = 0; i < head.chunk_count; i++, offset += chunk_size) {
+        table[i].offset = offset;
+        table[i].size = (head.image_size - offset > chunk_size) ? chunk_size : head.image_size - offset;
+        table[i].frame = head.table_size + frames * report_size;
+        frames += (table[i].size + data_size - 1) / data_size; // chunks start on a new report
+    }
+
+#ifdef _WIN32
+    snprintf(temp, sizeof(temp), "%s.%lu.%p", path, (unsigned long)GetCurrentProcessId(), (void*)device);
+#else
+    snprintf(temp, sizeof(temp), "%s.%lu.%p", path, (unsigned long)getpid(), (void*)device);
+#endif
+    if((fp = fopen(temp, "wb")) == NULL) {
+        free(table);
+        free(frame);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, temp, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    fseek(fp, head.table_size, SEEK_SET); // the header and table go in once the frames are written
+
+    // frames are the report number followed by the data, the last one of a chunk is padded
+    for(i = 0; i < head.chunk_count && ret == 0; i++) {
+        for(done = 0; done < table[i].size && ret == 0; done += size) {
+            size = (table[i].size - done > data_size) ? data_size : table[i].size - done;
+            memset(frame, 0, report_size);
+            frame[0] = REPORT_ID_DATA;
+            for(fill = 0; fill < size; fill += piece) {
+                offset = table[i].offset + done + fill;
+                if(offset < header_size) { // the IVT goes in the first frames
+                    piece = (header_size - offset < size - fill) ? header_size - offset : size - fill;
+                    memcpy(frame + 1 + fill, header + offset, piece);
+                } else {
+                    piece = size - fill;
+                    memcpy(frame + 1 + fill, file + offset - header_size, piece);
+                }
+            }
+            if(fwrite(frame, 1, report_size, fp) < report_size) {
+                ret = ERROR_IO;
+            }
+        }
+    }
+    if(ret == 0) {
+        fseek(fp, 0L, SEEK_SET);
+        if(fwrite(&head, 1, sizeof(head), fp) < sizeof(head) ||
+           fwrite(table, sizeof(imx50_cache_chunk_t), head.chunk_count, fp) < head.chunk_count) {
+            ret = ERROR_IO;
+        }
+    }
+    if(fclose(fp) != 0) {
+        ret = ERROR_IO;
+    }
+    free(table);
+    free(frame);
+
+    if(ret != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write %s [%s:%d]\n", __FUNCTION__, temp, __FILE__, __LINE__);
+        remove(temp);
+        return ret;
+    }
+#ifdef _WIN32
+    if(MoveFileEx(temp, path, MOVEFILE_REPLACE_EXISTING) == 0) {
+#else
+    if(rename(temp, path) != 0) {
+#endif
+        remove(temp); // in use by someone who built the same thing
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Built %s, %u chunks [%s:%d]\n", __FUNCTION__, path, head.chunk_count, __FILE__, __LINE__);
+
+    return 0;
+}
+
+/**
+    @brief Finds the key of a file without reading it
+
+    The index is named after the file's full path, size,
+    identity and times and what it is built with, so a
+    changed or replaced file is looked up under a new name.
+
+    @return Zero if the index has it, negative otherwise
+ */
+int imx50_cache_index_read(const char *index, uint64_t *key_p) {
+    char line[CACHE_KEY_SIZE];
+    unsigned int high, low;
+    FILE *fp;
+    int ret = -1;
+
+    if((fp = fopen(index, "r")) == NULL) {
+        return -1;
+    }
+    if(fgets(line, sizeof(line), fp) != NULL && strlen(line) == CACHE_KEY_SIZE - 1 &&
+       sscanf(line, "%8X%8X", &high, &low) == 2) {
+        *key_p = ((uint64_t)high << 32) | low;
+        ret = 0;
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+/**
+    @brief Names the index of a file
+ */
+int imx50_cache_index_name(imx50_device_t *device, const char *filename, const unsigned char *header, unsigned int header_size, unsigned int chunk_size, unsigned int report_size, char *index) {
+    char *full;
+    uint64_t hash = FNV_BASIS;
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if(GetFileAttributesEx(filename, GetFileExInfoStandard, &attributes) == 0) {
+        return ERROR_IO; // reading it says why
+    }
+    hash = imx50_cache_hash(hash, &attributes.ftCreationTime, sizeof(FILETIME));
+    hash = imx50_cache_hash(hash, &attributes.ftLastWriteTime, sizeof(FILETIME)); // 100ns
+    hash = imx50_cache_hash_int(hash, attributes.nFileSizeHigh);
+    hash = imx50_cache_hash_int(hash, attributes.nFileSizeLow);
+    full = _fullpath(NULL, filename, 0);
+#else
+    struct stat st;
+
+    if(stat(filename, &st) != 0) {
+        return ERROR_IO; // reading it says why
+    }
+    // a copy with its time kept has a new inode and ctime
+    hash = imx50_cache_hash(hash, &st.st_dev, sizeof(st.st_dev));
+    hash = imx50_cache_hash(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = imx50_cache_hash(hash, &st.st_size, sizeof(st.st_size));
+    hash = imx50_cache_hash(hash, &st.st_mtime, sizeof(st.st_mtime));
+    hash = imx50_cache_hash_int(hash, (unsigned int)STAT_NSEC(st, m));
+    hash = imx50_cache_hash(hash, &st.st_ctime, sizeof(st.st_ctime));
+    hash = imx50_cache_hash_int(hash, (unsigned int)STAT_NSEC(st, c));
+    full = realpath(filename, NULL);
+#endif
+    hash = imx50_cache_hash(hash, full ? full : filename, (unsigned int)strlen(full ? full : filename) + 1);
+    free(full);
+    hash = imx50_cache_hash_int(hash, header_size);
+    hash = imx50_cache_hash(hash, header, header_size);
+    hash = imx50_cache_hash_int(hash, chunk_size);
+    hash = imx50_cache_hash_int(hash, report_size);
+    imx50_cache_path(device, index, "idx-", hash, "");
+
+    return 0;
+}
+
+/**
+    @brief Maps the entry for a load, building it if needed
+
+    @param device The device
+    @param filename The name of the file to load
+    @param header Load header, can be NULL
+    @param header_size Size of header
+    @param size_p Gets the size of the entry
+
+    @return The mapped entry, NULL if the cache cannot be used
+ */
+unsigned char *imx50_cache_open(imx50_device_t *device, const char *filename, const unsigned char *header, unsigned int header_size, unsigned int *size_p) {
+    char index[CACHE_PATH_SIZE];
+    char path[CACHE_PATH_SIZE];
+    unsigned int chunk_size = PLAN_CHUNK(device);
+    unsigned int report_size = device->profile->data_report_size;
+    unsigned char *entry;
+    unsigned char *file;
+    unsigned int file_size;
+    uint64_t key;
+    FILE *fp;
+
+    if(imx50_cache_index_name(device, filename, header, header_size, chunk_size, report_size, index) != 0) {
+        return NULL;
+    }
+    if(imx50_cache_index_read(index, &key) == 0) {
+        imx50_cache_path(device, path, "", key, ".imx50c");
+        if((entry = imx50_cache_map(path, size_p)) != NULL) {
+            if(imx50_cache_check(entry, *size_p, key, header_size, chunk_size, report_size) == 0) {
+                if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Using %s for %s [%s:%d]\n", __FUNCTION__, path, filename, __FILE__, __LINE__);
+                return entry;
+            }
+            imx50_cache_unmap(entry, *size_p);
+        }
+    }
+
+    // new or changed file, the entry may still be there under its contents
+    if((file = imx50_read_file(filename, &file_size)) == NULL) {
+        return NULL;
+    }
+    key = imx50_cache_hash(FNV_BASIS, file, file_size);
+    key = imx50_cache_hash_int(key, file_size);
+    key = imx50_cache_hash(key, header, header_size);
+    key = imx50_cache_hash_int(key, header_size);
+    key = imx50_cache_hash_int(key, chunk_size);
+    key = imx50_cache_hash_int(key, report_size);
+    imx50_cache_path(device, path, "", key, ".imx50c");
+
+    if((entry = imx50_cache_map(path, size_p)) != NULL && imx50_cache_check(entry, *size_p, key, header_size, chunk_size, report_size) != 0) {
+        imx50_cache_unmap(entry, *size_p);
+        entry = NULL;
+        remove(path); // damaged, or a stray key collision
+    }
+    if(entry == NULL) {
+        if(imx50_cache_build(device, path, file, file_size, header, header_size, chunk_size, report_size, key) != 0 ||
+           (entry = imx50_cache_map(path, size_p)) == NULL) {
+            free(file);
+            return NULL;
+        }
+        if(imx50_cache_check(entry, *size_p, key, header_size, chunk_size, report_size) != 0) {
+            imx50_cache_unmap(entry, *size_p);
+            free(file);
+            return NULL;
+        }
+    }
+    free(file);
+
+    // a lost race only costs the next run a hash
+    if((fp = fopen(index, "w")) != NULL) {
+        fprintf(fp, "%08X%08X", (unsigned int)(key >> 32), (unsigned int)key);
+        fclose(fp);
+    }
+
+    return entry;
+}
+
+/**
+    @brief Loads a file from its cache entry
+
+    Each chunk is one write command whose data reports are
+    sent straight from the mapped entry.
+
+    @param device the HID device to write to
+    @param address The address to write the file to on the device
+    @param filename The name of the file to load
+    @param header Data to put right before address, can be NULL
+    @param header_size Size of header
+
+    @see imx50_load_file_header
+    @return Zero on success, ERROR_IO if the cache cannot be
+        used and nothing was sent, error code otherwise
+ */
+int imx50_load_cached(imx50_device_t *device, device_addr_t address, const char *filename, const unsigned char *header, unsigned int header_size) {
+    const imx50_cache_header_t *head;
+    const imx50_cache_chunk_t *table;
+    unsigned char *entry;
+    unsigned int size;
+    unsigned int i;
+    int started;
+    int ret = 0;
+
+    SPAN_BEGIN_ARG("address", address);
+    if((entry = imx50_cache_open(device, filename, header, header_size, &size)) == NULL) {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Cannot use the cache in %s for %s [%s:%d]\n", __FUNCTION__, device->cache, filename, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_IO;
+    }
+    head = (const imx50_cache_header_t*)entry;
+    table = (const imx50_cache_chunk_t*)(entry + sizeof(imx50_cache_header_t));
+    address -= header_size;
+
+    started = imx50_progress_begin(device, head->image_size);
+    for(i = 0; i < head->chunk_count; i++) {
+        if((ret = imx50_write_memory_framed(device, address + table[i].offset, NULL, table[i].size, entry + table[i].frame)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, address + table[i].offset, __FILE__, __LINE__);
+            break;
+        }
+        if(device->progress.cancel && i + 1 < head->chunk_count) { // stop between commands
+            ret = ERROR_CANCELLED;
+            break;
+        }
+    }
+    imx50_progress_end(device, started);
+    imx50_cache_unmap(entry, size);
+
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Keeps loaded files in a cache directory
+
+    The first load of a file writes an entry holding the
+    data reports that load it, IVT included. Later loads
+    of the same file, by any handle or process, map the
+    entry and send the reports from it without reading or
+    copying the file. Entries are named after their
+    contents and built for one chunk size and report size,
+    so a tuned plan gets entries of its own. Loads fall
+    back to reading the file if the cache cannot be used.
+
+    @param device The device
+    @param directory Existing directory for the entries,
+        NULL to stop using it
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_set_cache(imx50_device_t *device, const char *directory) {
+    struct stat st;
+    char *copy = NULL;
+
+    if(directory) {
+        if(stat(directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, directory, __FILE__, __LINE__);
+            return ERROR_IO;
+        }
+        if(strlen(directory) + CACHE_NAME_SIZE > CACHE_PATH_SIZE) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Path too long: %s [%s:%d]\n", __FUNCTION__, directory, __FILE__, __LINE__);
+            return ERROR_PARAMETER;
+        }
+        if((copy = malloc(strlen(directory) + 1)) == NULL) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            return ERROR_OUT_OF_MEMORY;
+        }
+        strcpy(copy, directory);
+    }
+    free(device->cache);
+    device->cache = copy;
+
+    return 0;
+}
@@ -0,0 +1,408 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// recording reports to a file and playing the device side back
+
+#include "imxusb_private.h"
+
+// file is "IMXT", version, then records of
+// time spent in the transport (us), size, type, zero, then the report
+// everything little-endian
+#define CAPTURE_MAGIC           "IMXT"
+#define CAPTURE_VERSION         1
+#define CAPTURE_HEADER_SIZE     8
+#define CAPTURE_RECORD_SIZE     8
+
+// record types
+#define CAPTURE_WRITE           0   // host to device
+#define CAPTURE_READ            1   // device to host
+#define CAPTURE_TIMEOUT         2   // read got nothing
+#define CAPTURE_ERROR           3   // last read or write failed
+
+// wraps the real transport
+typedef struct {
+    const imx50_transport_t *transport;
+    void *context;
+    FILE *fp;
+    int error;              // could not write the file
+} imx50_capture_t;
+
+// plays back a trace as the device
+typedef struct {
+    unsigned char *trace;
+    unsigned int size;
+    unsigned int offset;    // next record
+    int realtime;           // take as long as the device did
+    unsigned int differ;    // writes not the same as recorded
+} imx50_replay_t;
+
+/**
+    @brief Adds a record to the capture file
+
+    @param capture The capture
+    @param start When the transport was called
+    @param type CAPTURE_* type of record
+    @param data The report, NULL if size is zero
+    @param size Size of data
+ */
+void imx50_capture_record(imx50_capture_t *capture, uint64_t start, unsigned char type, const unsigned char *data, unsigned int size) {
+    unsigned char record[CAPTURE_RECORD_SIZE];
+    uint64_t delta = imx50_time_us() - start;
+
+    if(capture->error) {
+        return;
+    }
+    if(delta > 0xFFFFFFFF) {
+        delta = 0xFFFFFFFF;
+    }
+    record[0] = (unsigned char)delta;
+    record[1] = (unsigned char)(delta >> 8);
+    record[2] = (unsigned char)(delta >> 16);
+    record[3] = (unsigned char)(delta >> 24);
+    record[4] = (unsigned char)size;
+    record[5] = (unsigned char)(size >> 8);
+    record[6] = type;
+    record[7] = 0;
+
+    if(fwrite(record, 1, sizeof(record), capture->fp) != sizeof(record) ||
+       (size > 0 && fwrite(data, 1, size, capture->fp) != size)) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write capture, stopped recording [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        capture->error = 1;
+    }
+}
+
+void *imx50_capture_open(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth) {
+    (void)vendor_id;
+    (void)product_id;
+    (void)queue_depth;
+    return NULL; // only made by imx50_start_capture()
+}
+
+int imx50_capture_write(void *context, const unsigned char *data, unsigned int size) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+    uint64_t start = imx50_time_us();
+    int ret;
+
+    ret = capture->transport->write(capture->context, data, size);
+    imx50_capture_record(capture, start, CAPTURE_WRITE, data, size);
+    if(ret < 0) {
+        imx50_capture_record(capture, imx50_time_us(), CAPTURE_ERROR, NULL, 0);
+    }
+
+    return ret;
+}
+
+int imx50_capture_read(void *context, unsigned char *data, unsigned int size, int timeout) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+    uint64_t start = imx50_time_us();
+    int ret;
+
+    ret = capture->transport->read(capture->context, data, size, timeout);
+    if(ret > 0) {
+        imx50_capture_record(capture, start, CAPTURE_READ, data, ret);
+    } else {
+        imx50_capture_record(capture, start, ret == 0 ? CAPTURE_TIMEOUT : CAPTURE_ERROR, NULL, 0);
+    }
+
+    return ret;
+}
+
+void imx50_capture_close(void *context) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+
+    capture->transport->close(capture->context);
+    fclose(capture->fp);
+    free(capture);
+}
+
+void imx50_capture_expect(void *context, unsigned int count) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+
+    if(capture->transport->expect) {
+        capture->transport->expect(capture->context, count);
+    }
+}
+
+int imx50_capture_port(void *context, char *port, unsigned int size) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+
+    if(!capture->transport->port) {
+        return -1;
+    }
+    return capture->transport->port(capture->context, port, size);
+}
+
+int imx50_capture_probe(void *context, const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum) {
+    imx50_capture_t *capture = (imx50_capture_t*)context;
+
+    if(!capture->transport->probe) {
+        return -1;
+    }
+    return capture->transport->probe(capture->context, port, vendor_id, product_id, devnum);
+}
+
+const imx50_transport_t g_imx50_capture_transport = {
+    "capture",
+    imx50_capture_open,
+    imx50_capture_write,
+    imx50_capture_read,
+    imx50_capture_close,
+    imx50_capture_expect,
+    imx50_capture_port,
+    imx50_capture_probe
+};
+
+/**
+    @brief Records every report to a file
+
+    Every report sent and received after this is written
+    with how long the transport took, so the session can
+    be played back with imx50_open_replay(). Cannot be used
+    with the background reader.
+
+    @param device the HID device
+    @param filename File to write the capture to
+
+    @see imx50_stop_capture
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_start_capture(imx50_device_t *device, const char *filename) {
+    imx50_capture_t *capture;
+    unsigned char header[CAPTURE_HEADER_SIZE] = { 0 };
+
+    if(device->reader || device->transport == &g_imx50_capture_transport) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot capture with the reader or another capture running [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    capture = malloc(sizeof(imx50_capture_t));
+    if(!capture) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memset(capture, 0, sizeof(imx50_capture_t));
+    capture->fp = fopen(filename, "wb");
+    if(!capture->fp) {
+        free(capture);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_VERSION;
+    if(fwrite(header, 1, sizeof(header), capture->fp) != sizeof(header)) {
+        fclose(capture->fp);
+        free(capture);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+
+    capture->transport = device->transport;
+    capture->context = device->context;
+    device->transport = &g_imx50_capture_transport;
+    device->context = capture;
+
+    return 0;
+}
+
+/**
+    @brief Stops recording reports
+
+    Does nothing if imx50_start_capture() was not called.
+
+    @param device the HID device
+**/
+IMX50USB_EXPORT void imx50_stop_capture(imx50_device_t *device) {
+    imx50_capture_t *capture;
+
+    if(device->transport != &g_imx50_capture_transport) {
+        return;
+    }
+    capture = (imx50_capture_t*)device->context;
+    device->transport = capture->transport;
+    device->context = capture->context;
+    fclose(capture->fp);
+    free(capture);
+}
+
+/**
+    @brief Finds the next record to play
+
+    In real time, does not return until the call has taken 
+    as long as it did when it was recorded.
+
+    @param replay The replay
+    @param start When the transport was called
+    @param type_p Gets the CAPTURE_* type
+    @param size_p Gets the size of the report
+
+    @return The report, NULL at the end of the trace
+ */
+unsigned char *imx50_replay_next(imx50_replay_t *replay, uint64_t start, unsigned char *type_p, unsigned int *size_p) {
+    unsigned char *record = replay->trace + replay->offset;
+    uint64_t delta;
+    uint64_t now;
+
+    if(replay->size - replay->offset < CAPTURE_RECORD_SIZE) {
+        return NULL;
+    }
+    delta = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t)record[3] << 24);
+    *size_p = record[4] | (record[5] << 8);
+    *type_p = record[6];
+    if(replay->size - replay->offset - CAPTURE_RECORD_SIZE < *size_p) {
+        return NULL;
+    }
+    replay->offset += CAPTURE_RECORD_SIZE + *size_p;
+
+    // time between calls is the host's, so only calls are timed
+    while(replay->realtime && (now = imx50_time_us()) - start < delta) {
+        if(delta - (now - start) > 2000) {
+            SLEEP(1);
+        } else {
+            YIELD();
+        }
+    }
+
+    return record + CAPTURE_RECORD_SIZE;
+}
+
+void *imx50_replay_open(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth) {
+    (void)vendor_id;
+    (void)product_id;
+    (void)queue_depth;
+    return NULL; // only made by imx50_open_replay()
+}
+
+int imx50_replay_write(void *context, const unsigned char *data, unsigned int size) {
+    imx50_replay_t *replay = (imx50_replay_t*)context;
+    unsigned char *report;
+    unsigned char type;
+    unsigned int length;
+
+    if((report = imx50_replay_next(replay, imx50_time_us(), &type, &length)) == NULL || type != CAPTURE_WRITE) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Trace has no write here, at offset %u [%s:%d]\n", __FUNCTION__, replay->offset, __FILE__, __LINE__);
+        return -1;
+    }
+    if(length != size || memcmp(report, data, size) != 0) {
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Write differs from trace at offset %u [%s:%d]\n", __FUNCTION__, replay->offset, __FILE__, __LINE__);
+        replay->differ++;
+    }
+    // a write that failed is followed by an error
+    if(replay->size - replay->offset >= CAPTURE_RECORD_SIZE && replay->trace[replay->offset + 6] == CAPTURE_ERROR) {
+        imx50_replay_next(replay, 0, &type, &length);
+        return -1;
+    }
+
+    return size;
+}
+
+/**
+    @brief Plays back the next read in the trace
+
+    The caller's timeout is ignored: a read that timed out
+    when recorded times out again, and one that got a report
+    gets the same report, so the library takes the same path.
+ */
+int imx50_replay_read(void *context, unsigned char *data, unsigned int size, int timeout) {
+    imx50_replay_t *replay = (imx50_replay_t*)context;
+    unsigned char *report;
+    unsigned char type;
+    unsigned int length;
+
+    (void)timeout;
+
+    if((report = imx50_replay_next(replay, imx50_time_us(), &type, &length)) == NULL || type == CAPTURE_WRITE) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Trace has no read here, at offset %u [%s:%d]\n", __FUNCTION__, replay->offset, __FILE__, __LINE__);
+        return -1;
+    }
+    if(type == CAPTURE_TIMEOUT) {
+        return 0;
+    }
+    if(type == CAPTURE_ERROR) {
+        return -1;
+    }
+    if(length > size) {
+        length = size;
+    }
+    memcpy(data, report, length);
+
+    return length;
+}
+
+void imx50_replay_close(void *context) {
+    imx50_replay_t *replay = (imx50_replay_t*)context;
+
+    if(replay->differ && IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:%u writes were not the same as the trace [%s:%d]\n", __FUNCTION__, replay->differ, __FILE__, __LINE__);
+    free(replay->trace);
+    free(replay);
+}
+
+const imx50_transport_t g_imx50_replay_transport = {
+    "replay",
+    imx50_replay_open,
+    imx50_replay_write,
+    imx50_replay_read,
+    imx50_replay_close,
+    NULL,
+    NULL,
+    NULL
+};
+
+/**
+    @brief Get a device that plays back a capture
+
+    Every read returns the next report the device sent in
+    the capture, so host side changes can be timed without
+    hardware. The host must send the same reports in the
+    same order, writes that differ are counted and logged.
+
+    @param filename A file from imx50_start_capture()
+    @param realtime Non-zero to take as long as the device
+        did for each report, zero to answer at once
+
+    @see imx50_start_capture
+    @return A device will be returned on success, NULL on error
+**/
+IMX50USB_EXPORT imx50_device_t *imx50_open_replay(const char *filename, int realtime) {
+    imx50_replay_t *replay;
+    imx50_device_t *device;
+
+    replay = malloc(sizeof(imx50_replay_t));
+    if(!replay) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(replay, 0, sizeof(imx50_replay_t));
+    if((replay->trace = imx50_read_file(filename, &replay->size)) == NULL) {
+        free(replay);
+        return NULL;
+    }
+    if(replay->size < CAPTURE_HEADER_SIZE || memcmp(replay->trace, CAPTURE_MAGIC, 4) != 0 || replay->trace[4] != CAPTURE_VERSION) {
+        imx50_replay_close(replay);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%s is not a capture [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return NULL;
+    }
+    replay->offset = CAPTURE_HEADER_SIZE;
+    replay->realtime = realtime;
+
+    if((device = imx50_new_device(&g_imx50_replay_transport)) == NULL) {
+        imx50_replay_close(replay);
+        return NULL;
+    }
+    device->context = replay;
+
+    return device;
+}
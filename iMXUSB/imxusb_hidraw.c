@@ -0,0 +1,429 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Linux hidraw transport using io_uring, only built with IMX50_HIDRAW defined
+
+#if defined(IMX50_HIDRAW) && defined(__linux__)
+
+#include "imxusb_private.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+
+#define HIDRAW_SYSFS            "/sys/class/hidraw"
+#define HIDRAW_BUS_USB          0x03
+
+#define TAG_WRITE               0x10000
+#define TAG_READ                0x20000
+#define TAG_INDEX(x)            ( (x) & 0xFFFF )
+
+// writes are sent in linked chains of up to depth reports. One
+// chain is in the kernel while the next one is being filled.
+// reads are submitted up to depth at a time, not linked: hidraw
+// reports are shorter than the buffers and a short read would
+// cancel the rest of a chain. Each read takes the next report
+// off the node's list, so they are given back in the order
+// they finish.
+typedef struct {
+    struct io_uring ring;
+    int fd;
+    unsigned int depth;
+    unsigned char *buffers;         // 2 * depth write buffers, then depth read buffers
+    struct io_uring_sqe *last_sqe;  // end of the chain being filled
+    unsigned int chain_base;        // first write buffer of the chain being filled
+    unsigned int filling;           // reports in the chain being filled
+    unsigned int writes_in_flight;
+    unsigned int *write_size;
+    unsigned int reads_expected;    // reports imx50_hidraw_expect() said are coming
+    unsigned int reads_submitted;   // in the current batch
+    unsigned int reads_finished;
+    unsigned int read_head;         // next finished read to give back
+    int *read_result;               // by buffer
+    unsigned int *read_order;       // buffers in the order they finished
+    int error;
+    char port[REENUM_PORT_SIZE];
+} imx50_hidraw_t;
+
+#define WRITE_BUFFER(h, i)      ( (h)->buffers + (i) * REPORT_DATA_SIZE )
+#define READ_BUFFER(h, i)       ( (h)->buffers + (2 * (h)->depth + (i)) * REPORT_DATA_SIZE )
+
+/**
+    @brief Finds the hidraw node of a device
+
+    @param path Where to put the /dev path
+    @param size Size of path
+
+    @return Zero if found, negative otherwise
+ */
+int imx50_hidraw_find(unsigned short vendor_id, unsigned short product_id, char *path, unsigned int size) {
+    DIR *dir;
+    struct dirent *entry;
+    FILE *fp;
+    char line[256];
+    unsigned int bus, vendor, product;
+    int found = -1;
+
+    dir = opendir(HIDRAW_SYSFS);
+    if(!dir) {
+        return -1;
+    }
+    while(found != 0 && (entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "hidraw", 6) != 0) {
+            continue;
+        }
+        if(snprintf(line, sizeof(line), "%s/%s/device/uevent", HIDRAW_SYSFS, entry->d_name) >= (int)sizeof(line)) {
+            continue; // not a name hidraw gives
+        }
+        if((fp = fopen(line, "r")) == NULL) {
+            continue;
+        }
+        while(fgets(line, sizeof(line), fp) != NULL) {
+            if(sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3) {
+                if(bus == HIDRAW_BUS_USB && vendor == vendor_id && product == product_id) {
+                    snprintf(path, size, "/dev/%s", entry->d_name);
+                    found = 0;
+                }
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+
+    return found;
+}
+
+/**
+    @brief Handles finished requests
+
+    @param wait Block until at least one is done
+    @param timeout For wait, in ms. -1 blocks.
+
+    @return Zero on success, 1 on timeout, negative on error
+ */
+int imx50_hidraw_reap(imx50_hidraw_t *hidraw, int wait, int timeout) {
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts;
+    unsigned int tag;
+    int ret;
+
+    if(wait) {
+        if(timeout < 0) {
+            ret = io_uring_wait_cqe(&hidraw->ring, &cqe);
+        } else {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000L;
+            ret = io_uring_wait_cqe_timeout(&hidraw->ring, &cqe, &ts);
+        }
+        if(ret == -ETIME) {
+            return 1;
+        }
+        if(ret < 0) {
+            return -1;
+        }
+    }
+    while(io_uring_peek_cqe(&hidraw->ring, &cqe) == 0) {
+        tag = (unsigned int)io_uring_cqe_get_data64(cqe);
+        if(tag & TAG_WRITE) {
+            if(cqe->res < 0 || (unsigned int)cqe->res != hidraw->write_size[TAG_INDEX(tag)]) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Write failed: %d [%s:%d]\n", __FUNCTION__, cqe->res, __FILE__, __LINE__);
+                hidraw->error = 1;
+            }
+            hidraw->writes_in_flight--;
+        } else {
+            hidraw->read_result[TAG_INDEX(tag)] = cqe->res;
+            hidraw->read_order[hidraw->reads_finished++] = TAG_INDEX(tag);
+        }
+        io_uring_cqe_seen(&hidraw->ring, cqe);
+    }
+    return 0;
+}
+
+/**
+    @brief Sends the chain being filled
+
+    Waits for the previous chain first, the kernel does not
+    keep separate chains in order.
+
+    @return Zero on success, negative on error
+ */
+int imx50_hidraw_submit(imx50_hidraw_t *hidraw) {
+    if(hidraw->filling == 0) {
+        return 0;
+    }
+    while(hidraw->writes_in_flight > 0) {
+        if(imx50_hidraw_reap(hidraw, 1, -1) < 0) {
+            return -1;
+        }
+    }
+    hidraw->last_sqe->flags &= ~IOSQE_IO_LINK; // chain ends here
+    if(io_uring_submit(&hidraw->ring) < 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot submit writes [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return -1;
+    }
+    hidraw->writes_in_flight = hidraw->filling;
+    hidraw->filling = 0;
+    hidraw->chain_base ^= hidraw->depth; // fill the other half next
+    return 0;
+}
+
+/**
+    @brief Waits for all writes to be done
+
+    @return Zero on success, negative if any write failed
+ */
+int imx50_hidraw_flush(imx50_hidraw_t *hidraw) {
+    if(imx50_hidraw_submit(hidraw) != 0) {
+        return -1;
+    }
+    while(hidraw->writes_in_flight > 0) {
+        if(imx50_hidraw_reap(hidraw, 1, -1) < 0) {
+            return -1;
+        }
+    }
+    if(hidraw->error) {
+        hidraw->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void imx50_hidraw_close(void *context) {
+    imx50_hidraw_t *hidraw = (imx50_hidraw_t*)context;
+
+    if(hidraw->ring.ring_fd > 0) {
+        imx50_hidraw_flush(hidraw);
+        io_uring_queue_exit(&hidraw->ring); // cancels reads still waiting
+    }
+    if(hidraw->fd >= 0) {
+        close(hidraw->fd);
+    }
+    free(hidraw->buffers);
+    free(hidraw->write_size);
+    free(hidraw->read_result);
+    free(hidraw->read_order);
+    free(hidraw);
+}
+
+/**
+    @brief Opens the first iMX50 hidraw node
+
+    Buffers and the file are registered with the ring once
+    here, so sending does not map or look up anything.
+
+    @return The transport context, NULL if none found
+ */
+void *imx50_hidraw_open(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth) {
+    imx50_hidraw_t *hidraw;
+    struct iovec *iovecs;
+    char path[64];
+    unsigned int i;
+
+    if(queue_depth > TAG_INDEX(~0u) / 3) {
+        queue_depth = TAG_INDEX(~0u) / 3;
+    }
+    if(imx50_hidraw_find(vendor_id, product_id, path, sizeof(path)) != 0) {
+        return NULL;
+    }
+    hidraw = malloc(sizeof(imx50_hidraw_t));
+    if(!hidraw) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(hidraw, 0, sizeof(imx50_hidraw_t));
+    hidraw->depth = queue_depth;
+    hidraw->fd = open(path, O_RDWR);
+    if(hidraw->fd < 0) {
+        imx50_hidraw_close(hidraw);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot open %s [%s:%d]\n", __FUNCTION__, path, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Opened %s [%s:%d]\n", __FUNCTION__, path, __FILE__, __LINE__);
+    if(imx50_sysfs_port(path + 5, hidraw->port, sizeof(hidraw->port)) != 0) {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Cannot find the USB port of %s [%s:%d]\n", __FUNCTION__, path, __FILE__, __LINE__);
+    }
+
+    hidraw->buffers = malloc(3 * queue_depth * REPORT_DATA_SIZE);
+    hidraw->write_size = malloc(2 * queue_depth * sizeof(unsigned int));
+    hidraw->read_result = malloc(queue_depth * sizeof(int));
+    hidraw->read_order = malloc(queue_depth * sizeof(unsigned int));
+    iovecs = malloc(3 * queue_depth * sizeof(struct iovec));
+    if(!hidraw->buffers || !hidraw->write_size || !hidraw->read_result || !hidraw->read_order || !iovecs) {
+        free(iovecs);
+        imx50_hidraw_close(hidraw);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    for(i = 0; i < 3 * queue_depth; i++) {
+        iovecs[i].iov_base = hidraw->buffers + i * REPORT_DATA_SIZE;
+        iovecs[i].iov_len = REPORT_DATA_SIZE;
+    }
+
+    if(io_uring_queue_init(4 * queue_depth, &hidraw->ring, 0) < 0) {
+        free(iovecs);
+        imx50_hidraw_close(hidraw);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot set up io_uring [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(io_uring_register_buffers(&hidraw->ring, iovecs, 3 * queue_depth) < 0 ||
+       io_uring_register_files(&hidraw->ring, &hidraw->fd, 1) < 0) {
+        free(iovecs);
+        imx50_hidraw_close(hidraw);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot register buffers [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    free(iovecs);
+
+    return hidraw;
+}
+
+/**
+    @brief Adds a report to the chain being filled
+
+    The chain is only submitted when it is full or before
+    the next read, so most reports cost no system call.
+ */
+int imx50_hidraw_write(void *context, const unsigned char *data, unsigned int size) {
+    imx50_hidraw_t *hidraw = (imx50_hidraw_t*)context;
+    struct io_uring_sqe *sqe;
+    unsigned int slot;
+
+    if(size > REPORT_DATA_SIZE || hidraw->error) {
+        hidraw->error = 0;
+        return -1;
+    }
+    if(hidraw->filling == hidraw->depth && imx50_hidraw_submit(hidraw) != 0) {
+        return -1;
+    }
+    sqe = io_uring_get_sqe(&hidraw->ring);
+    if(!sqe) {
+        return -1;
+    }
+    slot = hidraw->chain_base + hidraw->filling;
+    memcpy(WRITE_BUFFER(hidraw, slot), data, size);
+    hidraw->write_size[slot] = size;
+    io_uring_prep_write_fixed(sqe, 0, WRITE_BUFFER(hidraw, slot), size, 0, slot);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, TAG_WRITE | slot);
+    hidraw->last_sqe = sqe;
+    hidraw->filling++;
+
+    return size;
+}
+
+/**
+    @brief Reads a report, after all queued writes are sent
+
+    If more reports are expected, reads for them are
+    submitted together with this one.
+ */
+int imx50_hidraw_read(void *context, unsigned char *data, unsigned int size, int timeout) {
+    imx50_hidraw_t *hidraw = (imx50_hidraw_t*)context;
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int i, count;
+    int ret;
+
+    if(imx50_hidraw_flush(hidraw) != 0) {
+        return -1;
+    }
+    if(hidraw->reads_submitted == 0) {
+        count = hidraw->reads_expected;
+        if(count > hidraw->depth) {
+            count = hidraw->depth;
+        } else if(count == 0) {
+            count = 1;
+        }
+        for(i = 0; i < count; i++) {
+            sqe = io_uring_get_sqe(&hidraw->ring);
+            if(!sqe) {
+                break;
+            }
+            io_uring_prep_read_fixed(sqe, 0, READ_BUFFER(hidraw, i), REPORT_DATA_SIZE, 0, 2 * hidraw->depth + i);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data64(sqe, TAG_READ | i);
+        }
+        if(i == 0) {
+            return -1;
+        }
+        if(io_uring_submit(&hidraw->ring) < 0) {
+            return -1;
+        }
+        hidraw->reads_submitted = i;
+        hidraw->reads_finished = 0;
+        hidraw->read_head = 0;
+        hidraw->reads_expected -= (hidraw->reads_expected > i) ? i : hidraw->reads_expected;
+    }
+
+    while(hidraw->read_head == hidraw->reads_finished) {
+        ret = imx50_hidraw_reap(hidraw, 1, timeout);
+        if(ret == 1) {
+            return 0; // timed out, the read stays queued for next time
+        }
+        if(ret < 0) {
+            return -1;
+        }
+    }
+    ret = hidraw->read_result[hidraw->read_order[hidraw->read_head]];
+    if(ret > 0) {
+        if((unsigned int)ret > size) {
+            ret = size;
+        }
+        memcpy(data, READ_BUFFER(hidraw, hidraw->read_order[hidraw->read_head]), ret);
+    }
+    if(++hidraw->read_head == hidraw->reads_submitted) {
+        hidraw->reads_submitted = 0;
+    }
+
+    return ret < 0 ? -1 : ret;
+}
+
+/**
+    @brief Tells the transport how many reports are coming
+ */
+void imx50_hidraw_expect(void *context, unsigned int count) {
+    ((imx50_hidraw_t*)context)->reads_expected = count;
+}
+
+int imx50_hidraw_port(void *context, char *port, unsigned int size) {
+    imx50_hidraw_t *hidraw = (imx50_hidraw_t*)context;
+
+    if(hidraw->port[0] == '\0') {
+        return -1;
+    }
+    snprintf(port, size, "%s", hidraw->port);
+    return 0;
+}
+
+int imx50_hidraw_probe(void *context, const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum) {
+    (void)context;
+    return imx50_sysfs_probe(port, vendor_id, product_id, devnum);
+}
+
+const imx50_transport_t g_imx50_hidraw_transport = {
+    "hidraw",
+    imx50_hidraw_open,
+    imx50_hidraw_write,
+    imx50_hidraw_read,
+    imx50_hidraw_close,
+    imx50_hidraw_expect,
+    imx50_hidraw_port,
+    imx50_hidraw_probe
+};
+
+#endif
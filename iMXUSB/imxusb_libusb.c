@@ -0,0 +1,354 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// libusb transport, only built with IMX50_LIBUSB defined
+
+#ifdef IMX50_LIBUSB
+
+#include "imxusb_private.h"
+#include <libusb.h>
+
+#define HID_SET_REPORT          0x09
+#define HID_REPORT_TYPE_OUTPUT  0x02
+#define LIBUSB_WRITE_TIMEOUT    5000
+#define LIBUSB_POLL_TIMEOUT     1 // libusb waits forever on zero
+
+struct imx50_libusb;
+
+// a preallocated transfer
+typedef struct {
+    struct libusb_transfer *transfer;
+    unsigned char *buffer;
+    struct imx50_libusb *owner;
+    int busy;
+} imx50_libusb_slot_t;
+
+typedef struct imx50_libusb {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    int interface;
+    int detached;
+    unsigned char ep_in;
+    unsigned char ep_out; // zero if the device only takes reports on ep0
+    unsigned int depth;
+    unsigned int in_flight;
+    int error; // set if any queued transfer failed
+    imx50_libusb_slot_t *slots;
+    unsigned char in_buffer[REPORT_DATA_SIZE];
+} imx50_libusb_t;
+
+/**
+    @brief Called by libusb when a queued report is done
+ */
+void LIBUSB_CALL imx50_libusb_callback(struct libusb_transfer *transfer) {
+    imx50_libusb_slot_t *slot = (imx50_libusb_slot_t*)transfer->user_data;
+
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length - (slot->owner->ep_out ? 0 : LIBUSB_CONTROL_SETUP_SIZE)) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Transfer failed, status %d [%s:%d]\n", __FUNCTION__, transfer->status, __FILE__, __LINE__);
+        slot->owner->error = 1;
+    }
+    slot->busy = 0;
+    slot->owner->in_flight--;
+}
+
+/**
+    @brief Waits for every queued report to be sent
+
+    @return Zero on success, negative if any report failed
+ */
+int imx50_libusb_flush(imx50_libusb_t *usb) {
+    while(usb->in_flight > 0) {
+        if(libusb_handle_events(usb->ctx) != 0) {
+            return -1;
+        }
+    }
+    if(usb->error) {
+        usb->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void imx50_libusb_close(void *context) {
+    imx50_libusb_t *usb = (imx50_libusb_t*)context;
+    unsigned int i;
+
+    if(usb->handle) {
+        imx50_libusb_flush(usb);
+    }
+    if(usb->slots) {
+        for(i = 0; i < usb->depth; i++) {
+            libusb_free_transfer(usb->slots[i].transfer);
+            free(usb->slots[i].buffer);
+        }
+        free(usb->slots);
+    }
+    if(usb->handle) {
+        libusb_release_interface(usb->handle, usb->interface);
+        if(usb->detached) {
+            libusb_attach_kernel_driver(usb->handle, usb->interface);
+        }
+        libusb_close(usb->handle);
+    }
+    libusb_exit(usb->ctx);
+    free(usb);
+}
+
+/**
+    @brief Opens the first iMX50 found with libusb
+
+    Finds the interrupt endpoints and allocates queue_depth
+    transfers up front so nothing is allocated while sending.
+
+    @return The transport context, NULL if none found
+ */
+void *imx50_libusb_open(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth) {
+    imx50_libusb_t *usb;
+    struct libusb_config_descriptor *config;
+    const struct libusb_interface_descriptor *desc;
+    unsigned int i;
+
+    usb = malloc(sizeof(imx50_libusb_t));
+    if(!usb) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(usb, 0, sizeof(imx50_libusb_t));
+    if(libusb_init(&usb->ctx) != 0) {
+        free(usb);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot start libusb [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+
+    usb->handle = libusb_open_device_with_vid_pid(usb->ctx, vendor_id, product_id);
+    if(usb->handle == NULL) {
+        imx50_libusb_close(usb);
+        return NULL;
+    }
+
+    // find the interrupt endpoints of the HID interface
+    if(libusb_get_active_config_descriptor(libusb_get_device(usb->handle), &config) != 0) {
+        imx50_libusb_close(usb);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot get config descriptor [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    desc = &config->interface[0].altsetting[0];
+    usb->interface = desc->bInterfaceNumber;
+    for(i = 0; i < desc->bNumEndpoints; i++) {
+        if((desc->endpoint[i].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+            continue;
+        }
+        if(desc->endpoint[i].bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+            usb->ep_in = desc->endpoint[i].bEndpointAddress;
+        } else {
+            usb->ep_out = desc->endpoint[i].bEndpointAddress;
+        }
+    }
+    libusb_free_config_descriptor(config);
+    if(usb->ep_in == 0) {
+        imx50_libusb_close(usb);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:No interrupt IN endpoint [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Interface %d, IN %#02X, OUT %#02X (zero is control) [%s:%d]\n", __FUNCTION__, usb->interface, usb->ep_in, usb->ep_out, __FILE__, __LINE__);
+
+    // take the interface from the HID driver
+    if(libusb_kernel_driver_active(usb->handle, usb->interface) == 1) {
+        if(libusb_detach_kernel_driver(usb->handle, usb->interface) == 0) {
+            usb->detached = 1;
+        }
+    }
+    if(libusb_claim_interface(usb->handle, usb->interface) != 0) {
+        imx50_libusb_close(usb);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot claim interface %d [%s:%d]\n", __FUNCTION__, usb->interface, __FILE__, __LINE__);
+        return NULL;
+    }
+
+    // the transfer pool
+    usb->slots = malloc(queue_depth * sizeof(imx50_libusb_slot_t));
+    if(!usb->slots) {
+        imx50_libusb_close(usb);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(usb->slots, 0, queue_depth * sizeof(imx50_libusb_slot_t));
+    usb->depth = queue_depth;
+    for(i = 0; i < queue_depth; i++) {
+        usb->slots[i].owner = usb;
+        usb->slots[i].transfer = libusb_alloc_transfer(0);
+        usb->slots[i].buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + REPORT_DATA_SIZE);
+        if(!usb->slots[i].transfer || !usb->slots[i].buffer) {
+            imx50_libusb_close(usb);
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            return NULL;
+        }
+    }
+
+    return usb;
+}
+
+/**
+    @brief Queues a report to be sent
+
+    Returns as soon as the report is submitted. Only blocks
+    if queue_depth reports are already in flight.
+ */
+int imx50_libusb_write(void *context, const unsigned char *data, unsigned int size) {
+    imx50_libusb_t *usb = (imx50_libusb_t*)context;
+    imx50_libusb_slot_t *slot = NULL;
+    unsigned int i;
+
+    if(size > REPORT_DATA_SIZE || usb->error) {
+        usb->error = 0;
+        return -1;
+    }
+    while(usb->in_flight >= usb->depth) {
+        if(libusb_handle_events(usb->ctx) != 0) {
+            return -1;
+        }
+    }
+    for(i = 0; i < usb->depth; i++) {
+        if(!usb->slots[i].busy) {
+            slot = &usb->slots[i];
+            break;
+        }
+    }
+
+    if(usb->ep_out) {
+        memcpy(slot->buffer, data, size);
+        libusb_fill_interrupt_transfer(slot->transfer, usb->handle, usb->ep_out, slot->buffer, size,
+            imx50_libusb_callback, slot, LIBUSB_WRITE_TIMEOUT);
+    } else {
+        // SET_REPORT, first byte is report number
+        libusb_fill_control_setup(slot->buffer, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+            HID_SET_REPORT, (HID_REPORT_TYPE_OUTPUT << 8) | data[0], usb->interface, size);
+        memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+        libusb_fill_control_transfer(slot->transfer, usb->handle, slot->buffer,
+            imx50_libusb_callback, slot, LIBUSB_WRITE_TIMEOUT);
+    }
+    if(libusb_submit_transfer(slot->transfer) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot submit transfer [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return -1;
+    }
+    slot->busy = 1;
+    usb->in_flight++;
+
+    return size;
+}
+
+/**
+    @brief Reads a report, after all queued reports are sent
+ */
+int imx50_libusb_read(void *context, unsigned char *data, unsigned int size, int timeout) {
+    imx50_libusb_t *usb = (imx50_libusb_t*)context;
+    int actual = 0;
+    int ret;
+
+    if(imx50_libusb_flush(usb) != 0) {
+        return -1;
+    }
+    // read into our own buffer so a long report can't overflow data
+    if(timeout == 0) {
+        timeout = LIBUSB_POLL_TIMEOUT;
+    } else if(timeout < 0) {
+        timeout = 0;
+    }
+    ret = libusb_interrupt_transfer(usb->handle, usb->ep_in, usb->in_buffer, sizeof(usb->in_buffer), &actual, timeout);
+    if(ret == LIBUSB_ERROR_TIMEOUT) {
+        return 0;
+    }
+    if(ret != 0) {
+        return -1;
+    }
+    if((unsigned int)actual > size) {
+        actual = size;
+    }
+    memcpy(data, usb->in_buffer, actual);
+
+    return actual;
+}
+
+/**
+    @brief Makes a port path like 1-1.2, same as sysfs
+
+    @return Zero on success, negative on error
+ */
+int imx50_libusb_port_path(libusb_device *dev, char *port, unsigned int size) {
+    uint8_t numbers[8];
+    unsigned int used;
+    int count, i;
+
+    count = libusb_get_port_numbers(dev, numbers, sizeof(numbers));
+    if(count <= 0) {
+        return -1;
+    }
+    used = snprintf(port, size, "%d-%d", libusb_get_bus_number(dev), numbers[0]);
+    for(i = 1; i < count && used < size; i++) {
+        used += snprintf(port + used, size - used, ".%d", numbers[i]);
+    }
+    return 0;
+}
+
+int imx50_libusb_port(void *context, char *port, unsigned int size) {
+    return imx50_libusb_port_path(libusb_get_device(((imx50_libusb_t*)context)->handle), port, size);
+}
+
+/**
+    @brief Looks for any USB device on a port
+ */
+int imx50_libusb_probe(void *context, const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum) {
+    imx50_libusb_t *usb = (imx50_libusb_t*)context;
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    char path[REENUM_PORT_SIZE];
+    ssize_t count, i;
+    int found = 0;
+
+    count = libusb_get_device_list(usb->ctx, &list);
+    if(count < 0) {
+        return -1;
+    }
+    for(i = 0; i < count; i++) {
+        if(imx50_libusb_port_path(list[i], path, sizeof(path)) != 0 || strcmp(path, port) != 0) {
+            continue;
+        }
+        if(libusb_get_device_descriptor(list[i], &desc) == 0) {
+            *vendor_id = desc.idVendor;
+            *product_id = desc.idProduct;
+            *devnum = libusb_get_device_address(list[i]);
+            found = 1;
+        }
+        break;
+    }
+    libusb_free_device_list(list, 1);
+
+    return found;
+}
+
+const imx50_transport_t g_imx50_libusb_transport = {
+    "libusb",
+    imx50_libusb_open,
+    imx50_libusb_write,
+    imx50_libusb_read,
+    imx50_libusb_close,
+    NULL,
+    imx50_libusb_port,
+    imx50_libusb_probe
+};
+
+#endif
@@ -0,0 +1,479 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// flashing several files in one job, see imx50_run_manifest()
+
+#include "imxusb_private.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define MANIFEST_LINE_SIZE      1024
+
+// one file and where it goes, read by its own thread
+// ready is only written by the thread, the stream only reads it
+typedef struct {
+    device_addr_t address;
+    unsigned int size;
+    char *path;
+    unsigned char *data;
+    volatile unsigned int ready;    // bytes of data read so far
+    volatile int error;             // the file could not be read, thread is gone
+    volatile int *stop;             // the job is over, stop reading
+    int started;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} imx50_payload_t;
+
+typedef struct {
+    imx50_payload_t payloads[MANIFEST_MAX_PAYLOADS];
+    unsigned int payload_count;
+    dcd_t writes[MANIFEST_MAX_WRITES];
+    unsigned int write_count;
+    int kindle;
+    device_addr_t jump;             // zero for none
+    volatile int stop;
+} imx50_manifest_t;
+
+/**
+    @brief Reads a payload's file ahead of the stream
+
+    Publishes each MANIFEST_READ_BLOCK as it is read, so
+    the first chunk can go out before the file is done.
+ */
+#ifdef _WIN32
+DWORD WINAPI imx50_payload_thread(LPVOID param) {
+#else
+void *imx50_payload_thread(void *param) {
+#endif
+    imx50_payload_t *payload = (imx50_payload_t*)param;
+    unsigned int block;
+    FILE *fp;
+
+    if((fp = fopen(payload->path, "rb")) == NULL) {
+        payload->error = 1;
+        return 0;
+    }
+    while(payload->ready < payload->size && !*payload->stop) {
+        block = payload->size - payload->ready;
+        if(block > MANIFEST_READ_BLOCK) {
+            block = MANIFEST_READ_BLOCK;
+        }
+        if(fread(payload->data + payload->ready, 1, block, fp) < block) {
+            payload->error = 1;
+            break;
+        }
+        MEMORY_BARRIER(); // data is there before it is published
+        payload->ready += block;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+    @brief Waits for a payload's file to be read up to a point
+
+    Sleeps a millisecond at a time, a block takes much
+    longer than that to read.
+
+    @return Zero on success, ERROR_IO if the file could not
+        be read
+ */
+int imx50_payload_wait(imx50_payload_t *payload, unsigned int end) {
+    while(payload->ready < end) {
+        if(payload->error) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %s [%s:%d]\n", __FUNCTION__, payload->path, __FILE__, __LINE__);
+            return ERROR_IO;
+        }
+        SLEEP(1);
+    }
+    MEMORY_BARRIER(); // see the data as the thread left it
+    return 0;
+}
+
+/**
+    @brief Frees a manifest, stopping its threads first
+ */
+void imx50_free_manifest(imx50_manifest_t *manifest) {
+    unsigned int i;
+
+    manifest->stop = 1;
+    for(i = 0; i < manifest->payload_count; i++) {
+        if(manifest->payloads[i].started) {
+#ifdef _WIN32
+            WaitForSingleObject(manifest->payloads[i].thread, INFINITE);
+            CloseHandle(manifest->payloads[i].thread);
+#else
+            pthread_join(manifest->payloads[i].thread, NULL);
+#endif
+        }
+        free(manifest->payloads[i].path);
+        free(manifest->payloads[i].data);
+    }
+    free(manifest);
+}
+
+/**
+    @brief Gets a number from a manifest line, like strtoul
+        with base 0
+
+    @return Zero on success, negative if it is not a number
+ */
+int imx50_manifest_number(char **line_p, unsigned int *value_p) {
+    char *end;
+
+    *value_p = (unsigned int)strtoul(*line_p, &end, 0);
+    if(end == *line_p) {
+        return -1;
+    }
+    *line_p = end;
+    return 0;
+}
+
+/**
+    @brief Adds a payload, finding its size
+
+    Relative paths are from the manifest's directory.
+ */
+int imx50_manifest_payload(imx50_manifest_t *manifest, const char *manifest_path, device_addr_t address, const char *name) {
+    imx50_payload_t *payload;
+    unsigned int dir_size = 0;
+    const char *p;
+    FILE *fp;
+    long size;
+
+    if(manifest->payload_count == MANIFEST_MAX_PAYLOADS) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:More than %u files [%s:%d]\n", __FUNCTION__, MANIFEST_MAX_PAYLOADS, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    payload = &manifest->payloads[manifest->payload_count];
+    if(name[0] != '/' && name[0] != '\\' && !(name[0] && name[1] == ':')) {
+        for(p = manifest_path; *p; p++) {
+            if(*p == '/' || *p == '\\') {
+                dir_size = (unsigned int)(p - manifest_path) + 1;
+            }
+        }
+    }
+    if((payload->path = malloc(dir_size + strlen(name) + 1)) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(payload->path, manifest_path, dir_size);
+    strcpy(payload->path + dir_size, name);
+    manifest->payload_count++; // freed with the manifest from here on
+
+    if((fp = fopen(payload->path, "rb")) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, payload->path, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    fseek(fp, 0L, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    if(size < 0 || (uint64_t)address + (uint64_t)size > ((uint64_t)1 << 32)) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%s does not fit at %#X [%s:%d]\n", __FUNCTION__, payload->path, address, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    payload->address = address;
+    payload->size = (unsigned int)size;
+    payload->stop = &manifest->stop;
+
+    return 0;
+}
+
+/**
+    @brief Reads a manifest file
+
+    @return Zero on success, error code otherwise. The
+        manifest is always set and must be freed.
+ */
+int imx50_parse_manifest(const char *filename, imx50_manifest_t **manifest_p) {
+    imx50_manifest_t *manifest;
+    char line[MANIFEST_LINE_SIZE];
+    char name[MANIFEST_LINE_SIZE];
+    char keyword[16];
+    char *rest;
+    unsigned int address, value;
+    unsigned int number = 0;
+    int ret = 0;
+    FILE *fp;
+
+    if((*manifest_p = manifest = malloc(sizeof(imx50_manifest_t))) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memset(manifest, 0, sizeof(imx50_manifest_t));
+    if((fp = fopen(filename, "r")) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    while(ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        number++;
+        if(sscanf(line, "%15s", keyword) != 1 || keyword[0] == '#') {
+            continue; // blank or comment
+        }
+        rest = strstr(line, keyword) + strlen(keyword);
+        if(strcmp(keyword, "load") == 0 && imx50_manifest_number(&rest, &address) == 0 && sscanf(rest, " %[^\r\n]", name) == 1) {
+            ret = imx50_manifest_payload(manifest, filename, address, name);
+        } else if(strcmp(keyword, "write") == 0 && imx50_manifest_number(&rest, &address) == 0 && imx50_manifest_number(&rest, &value) == 0) {
+            if(manifest->write_count == MANIFEST_MAX_WRITES) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:More than %u register writes [%s:%d]\n", __FUNCTION__, MANIFEST_MAX_WRITES, __FILE__, __LINE__);
+                ret = ERROR_PARAMETER;
+                break;
+            }
+            manifest->writes[manifest->write_count].data_format = BITSOF(int);
+            manifest->writes[manifest->write_count].address = address;
+            manifest->writes[manifest->write_count].value = value;
+            manifest->write_count++;
+        } else if(strcmp(keyword, "init") == 0 && sscanf(rest, "%15s", name) == 1 && strcmp(name, "kindle") == 0) {
+            manifest->kindle = 1;
+        } else if(strcmp(keyword, "jump") == 0 && imx50_manifest_number(&rest, &address) == 0 && address != 0) {
+            manifest->jump = address;
+        } else {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%s:%u: cannot parse '%s' [%s:%d]\n", __FUNCTION__, filename, number, keyword, __FILE__, __LINE__);
+            ret = ERROR_PARAMETER;
+        }
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+/**
+    @brief Orders payloads by address
+ */
+int imx50_payload_compare(const void *a, const void *b) {
+    const imx50_payload_t *x = (const imx50_payload_t*)a;
+    const imx50_payload_t *y = (const imx50_payload_t*)b;
+
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+/**
+    @brief Sends payloads that follow each other without a gap
+
+    The payloads are streamed as one region, so files only
+    share CMD_WRITE_FILE chunks and the only short chunk is
+    the region's last. A chunk inside one file is sent
+    straight from it.
+
+    @param device the HID device
+    @param payloads First payload of the region
+    @param count Payloads in the region
+    @param size Bytes in the region
+    @param chunk Buffer for chunks that cross files
+    @param result Gets the commands sent
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_stream_region(imx50_device_t *device, imx50_payload_t *payloads, unsigned int count, unsigned int size, unsigned char *chunk, manifest_result_t *result) {
+    unsigned int offset;            // in the region
+    unsigned int trans_size;
+    unsigned int start = 0;         // region offset of payloads[first]
+    unsigned int first = 0;         // first payload in the chunk
+    unsigned int filled, from, part;
+    unsigned int i;
+    unsigned char *data;
+    int ret;
+
+    SPAN_BEGIN_ARG("address", payloads[0].address);
+    for(offset = 0; offset < size; offset += trans_size) {
+        trans_size = size - offset;
+        if(trans_size > PLAN_CHUNK(device)) {
+            trans_size = PLAN_CHUNK(device);
+        }
+        while(offset >= start + payloads[first].size) {
+            start += payloads[first++].size;
+        }
+
+        from = offset - start;
+        if(from + trans_size <= payloads[first].size) {
+            if((ret = imx50_payload_wait(&payloads[first], from + trans_size)) != 0) {
+                SPAN_END();
+                return ret;
+            }
+            data = payloads[first].data + from;
+        } else {
+            // crosses into the next files
+            for(filled = 0, i = first; filled < trans_size && i < count; i++, from = 0) {
+                part = payloads[i].size - from;
+                if(part > trans_size - filled) {
+                    part = trans_size - filled;
+                }
+                if((ret = imx50_payload_wait(&payloads[i], from + part)) != 0) {
+                    SPAN_END();
+                    return ret;
+                }
+                memcpy(chunk + filled, payloads[i].data + from, part);
+                filled += part;
+            }
+            data = chunk;
+        }
+
+        if(imx50_write_memory(device, payloads[0].address + offset, data, trans_size) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, payloads[0].address + offset, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_WRITE;
+        }
+        result->commands++;
+        if(device->progress.cancel && offset + trans_size < size) { // stop between commands
+            SPAN_END();
+            return ERROR_CANCELLED;
+        }
+    }
+
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Runs a flash job described in a manifest file
+
+    A manifest lists files to load and what to do around
+    them, one per line. # starts a comment.
+
+        init kindle                 run imx50_kindle_init()
+        write <address> <value>     32 bit register write, queued
+        load <address> <file>       relative to the manifest
+        jump <address>              add a header and jump to it
+
+    Board set up is done first, in the order given. Files
+    may be listed in any order but must not overlap. They
+    are all read at once on their own threads while the
+    first ones are sent. Files that end where the next one
+    starts are sent as one region, in chunks of the
+    transfer plan's size. The jump is sent last.
+
+    @param device the HID device
+    @param filename The manifest
+    @param result Gets what was done, can be NULL
+
+    @return Zero on success, ERROR_PARAMETER if the manifest
+        is not valid, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_run_manifest(imx50_device_t *device, const char *filename, manifest_result_t *result) {
+    imx50_manifest_t *manifest;
+    imx50_payload_t *payloads;
+    manifest_result_t local;
+    unsigned char *chunk = NULL;
+    unsigned int total = 0;
+    unsigned int i, j, size;
+    device_addr_t header;
+    int started;
+    int ret;
+
+    SPAN_BEGIN();
+    if(!result) {
+        result = &local;
+    }
+    memset(result, 0, sizeof(manifest_result_t));
+    if((ret = imx50_parse_manifest(filename, &manifest)) != 0) {
+        if(manifest) {
+            imx50_free_manifest(manifest);
+        }
+        SPAN_END();
+        return ret;
+    }
+    payloads = manifest->payloads;
+
+    // order by address and check for overlaps
+    qsort(payloads, manifest->payload_count, sizeof(imx50_payload_t), imx50_payload_compare);
+    for(i = 0; i < manifest->payload_count; i++) {
+        if(i > 0 && payloads[i - 1].address + payloads[i - 1].size > payloads[i].address) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%s (%#X-%#X) overlaps %s (%#X-%#X) [%s:%d]\n", __FUNCTION__,
+                payloads[i - 1].path, payloads[i - 1].address, payloads[i - 1].address + payloads[i - 1].size - 1,
+                payloads[i].path, payloads[i].address, payloads[i].address + payloads[i].size - 1, __FILE__, __LINE__);
+            imx50_free_manifest(manifest);
+            SPAN_END();
+            return ERROR_PARAMETER;
+        }
+        total += payloads[i].size;
+    }
+
+    // read everything at once, ahead of the stream
+    for(i = 0; i < manifest->payload_count; i++) {
+        if((payloads[i].data = malloc(payloads[i].size ? payloads[i].size : 1)) == NULL) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            imx50_free_manifest(manifest);
+            SPAN_END();
+            return ERROR_OUT_OF_MEMORY;
+        }
+#ifdef _WIN32
+        payloads[i].thread = CreateThread(NULL, 0, imx50_payload_thread, &payloads[i], 0, NULL);
+        payloads[i].started = (payloads[i].thread != NULL);
+#else
+        payloads[i].started = (pthread_create(&payloads[i].thread, NULL, imx50_payload_thread, &payloads[i]) == 0);
+#endif
+        if(!payloads[i].started) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot start reading %s [%s:%d]\n", __FUNCTION__, payloads[i].path, __FILE__, __LINE__);
+            imx50_free_manifest(manifest);
+            SPAN_END();
+            return ERROR_IO;
+        }
+    }
+    if((chunk = malloc(PLAN_CHUNK(device))) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        imx50_free_manifest(manifest);
+        SPAN_END();
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    // board set up while the files are read
+    if(manifest->kindle && (ret = imx50_kindle_init(device)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot set up the board [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    }
+    if(ret == 0 && manifest->write_count > 0) {
+        ret = imx50_queue_dcd(device, manifest->writes, manifest->write_count);
+    }
+
+    started = imx50_progress_begin(device, total);
+    for(i = 0; ret == 0 && i < manifest->payload_count; i = j) {
+        size = payloads[i].size;
+        for(j = i + 1; j < manifest->payload_count && payloads[j].address == payloads[j - 1].address + payloads[j - 1].size; j++) {
+            size += payloads[j].size;
+        }
+        if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Sending %u file(s) at %#X, %u bytes [%s:%d]\n", __FUNCTION__, j - i, payloads[i].address, size, __FILE__, __LINE__);
+        if(size > 0) {
+            ret = imx50_stream_region(device, &payloads[i], j - i, size, chunk, result);
+            result->regions++;
+        }
+        result->payloads += j - i;
+        result->bytes += size;
+    }
+    imx50_progress_end(device, started);
+    if(ret == 0) {
+        ret = imx50_flush_queue(device); // writes with no command after them
+    }
+
+    if(ret == 0 && manifest->jump) {
+        if((header = imx50_add_header(device, manifest->jump)) == 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot add header at %#X [%s:%d]\n", __FUNCTION__, manifest->jump, __FILE__, __LINE__);
+            ret = ERROR_WRITE;
+        } else {
+            ret = imx50_jump(device, header);
+        }
+    }
+
+    free(chunk);
+    imx50_free_manifest(manifest);
+    SPAN_END();
+    return ret;
+}
@@ -0,0 +1,384 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// picking the chunk size and delay of writes for each handle
+
+#include "imxusb_private.h"
+
+#define PLAN_KEY_SIZE           (REENUM_PORT_SIZE + 16)
+#define PLAN_LINE_SIZE          (PLAN_KEY_SIZE + 32)
+#define PLAN_MAX_OVERHEAD       100 // a chunk takes at least this many times the command's own cost
+
+/**
+    @brief Goes back to the defaults
+
+    The largest chunks the SoC takes with the reference
+    delay, which every device takes.
+ */
+void imx50_plan_defaults(imx50_device_t *device) {
+    device->plan.current.chunk_size = device->profile->max_download;
+    device->plan.current.data_delay = PLAN_DATA_DELAY;
+    device->plan.current.tuned = 0;
+}
+
+/**
+    @brief Forgets anything tuned
+ */
+void imx50_plan_reset(imx50_device_t *device) {
+    memset(&device->plan, 0, sizeof(imx50_plan_state_t));
+    imx50_plan_defaults(device);
+}
+
+/**
+    @brief Uses a tuned plan from now on
+ */
+void imx50_plan_use(imx50_device_t *device, unsigned int chunk_size, unsigned int data_delay) {
+    device->plan.tuned_chunk = chunk_size;
+    device->plan.tuned_delay = data_delay;
+    device->plan.current.chunk_size = chunk_size;
+    device->plan.current.data_delay = data_delay;
+    device->plan.current.tuned = 1;
+    device->plan.current.writes = 0;
+    device->plan.current.errors = 0;
+    device->plan.current.rate = 0;
+    device->plan.good = 0;
+    device->plan.tuned_rate = 0;
+    device->plan.recover = PLAN_RECOVER_WRITES;
+}
+
+/**
+    @brief Learns from a write
+
+    Any error goes straight back to the defaults. If the
+    tuned plan was in use, its delay is also raised, so a
+    delay that is too short for this device stops being
+    tried. After PLAN_RECOVER_WRITES good writes at the
+    defaults, the tuned plan is used again.
+
+    The rate of large writes is kept for each plan. Once
+    both have been seen, the slower one is left after
+    PLAN_RECOVER_WRITES writes. Each time the tuned plan
+    loses, it waits twice as long (up to PLAN_MAX_RECOVER
+    writes) to be measured again, since the bus or the
+    device may have changed.
+
+    @param device The device
+    @param bytes Size of the write
+    @param time_us How long it took, from the command to
+        the last status
+    @param ok Zero if it failed
+ */
+void imx50_plan_result(imx50_device_t *device, unsigned int bytes, uint64_t time_us, int ok) {
+    transfer_plan_t *current = &device->plan.current;
+    unsigned int *plan_rate;
+    unsigned int rate;
+
+    current->writes++;
+    if(!ok) {
+        current->errors++;
+        device->plan.good = 0;
+        if(current->tuned) {
+            device->plan.tuned_delay = device->plan.tuned_delay * 2 + 1;
+            if(device->plan.tuned_delay >= PLAN_DATA_DELAY) {
+                device->plan.tuned_delay = PLAN_DATA_DELAY;
+            }
+            if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Write failed, back to the default plan, tuned delay is now %u ms [%s:%d]\n", __FUNCTION__, device->plan.tuned_delay, __FILE__, __LINE__);
+        }
+        imx50_plan_defaults(device);
+        return;
+    }
+
+    // small writes are mostly round trips and say little about the rate
+    if(bytes >= PLAN_MIN_CHUNK && time_us > 0) {
+        rate = (unsigned int)((uint64_t)bytes * 1000000 / time_us);
+        plan_rate = current->tuned ? &device->plan.tuned_rate : &device->plan.default_rate;
+        *plan_rate = *plan_rate ? (unsigned int)(((uint64_t)*plan_rate * 7 + rate) / 8) : rate;
+        current->rate = *plan_rate;
+    }
+    device->plan.good++;
+    if(!device->plan.tuned_chunk) {
+        return;
+    }
+    if(!current->tuned && device->plan.good >= device->plan.recover) {
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Back to the tuned plan, %u bytes per write, %u ms delay [%s:%d]\n", __FUNCTION__, device->plan.tuned_chunk, device->plan.tuned_delay, __FILE__, __LINE__);
+        current->chunk_size = device->plan.tuned_chunk;
+        current->data_delay = device->plan.tuned_delay;
+        current->tuned = 1;
+        current->rate = 0;
+        device->plan.tuned_rate = 0; // measure it again
+        device->plan.good = 0;
+    } else if(current->tuned && device->plan.good >= PLAN_RECOVER_WRITES && device->plan.tuned_rate && device->plan.tuned_rate < device->plan.default_rate) {
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Tuned plan is slower (%u < %u bytes/sec), back to the defaults [%s:%d]\n", __FUNCTION__, device->plan.tuned_rate, device->plan.default_rate, __FILE__, __LINE__);
+        imx50_plan_defaults(device);
+        current->rate = device->plan.default_rate;
+        device->plan.good = 0;
+        if(device->plan.recover < PLAN_MAX_RECOVER) {
+            device->plan.recover *= 2;
+        }
+    }
+}
+
+/**
+    @brief Names the device model and the port it is on
+
+    Tuned plans are kept per model and port, since hubs and
+    host controllers differ as much as devices do.
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_plan_key(imx50_device_t *device, char *key, unsigned int size) {
+    char port[REENUM_PORT_SIZE];
+    unsigned short vendor_id = device->profile->ids[0].vendor_id;
+    unsigned short product_id = device->profile->ids[0].product_id;
+    unsigned int devnum;
+
+    if(!device->transport->port || device->transport->port(device->context, port, sizeof(port)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot find the port with %s [%s:%d]\n", __FUNCTION__, device->transport->name, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    if(device->transport->probe && device->transport->probe(device->context, port, &vendor_id, &product_id, &devnum) != 1) {
+        vendor_id = device->profile->ids[0].vendor_id;
+        product_id = device->profile->ids[0].product_id;
+    }
+    snprintf(key, size, "%04hX:%04hX %s", vendor_id, product_id, port);
+
+    return 0;
+}
+
+/**
+    @brief Tunes the chunk size and delay of writes
+
+    Writes a ROM_TRANSFER_SIZE and a size byte probe with
+    shorter and shorter delays, starting at PLAN_DATA_DELAY,
+    until one fails or the delay is zero. The shortest one
+    that worked is kept. Those two writes also give the
+    cost of a command and the rate, and the chunk size is
+    the smallest (down to PLAN_MIN_CHUNK) where the command
+    costs under 1% of the chunk, so cancelling a load or an
+    error loses little.
+
+    Writes that fail later go back to the defaults, see
+    imx50_get_plan().
+
+    @param device The device
+    @param scratch Memory that can be overwritten, size
+        bytes
+    @param size Probe size, zero for PLAN_PROBE_SIZE. Must
+        be more than ROM_TRANSFER_SIZE.
+
+    @see imx50_save_plan
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_tune_transfers(imx50_device_t *device, device_addr_t scratch, unsigned int size) {
+    static const unsigned int delays[] = { PLAN_DATA_DELAY, 5, 2, 1, 0 };
+    unsigned char *probe;
+    uint64_t start, small_us = 0, large_us = 0;
+    uint64_t t1, t2;
+    unsigned int best = PLAN_DATA_DELAY;
+    unsigned int default_rate = 0;
+    unsigned int chunk;
+    double byte_us, overhead_us;
+    unsigned int i;
+    int ret = 0;
+
+    SPAN_BEGIN_ARG("scratch", scratch);
+    if(size == 0) {
+        size = PLAN_PROBE_SIZE;
+    }
+    if(size <= ROM_TRANSFER_SIZE || size > device->profile->max_download) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Bad probe size %u [%s:%d]\n", __FUNCTION__, size, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    if((probe = malloc(size)) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_OUT_OF_MEMORY;
+    }
+    for(i = 0; i < size; i++) {
+        probe[i] = (unsigned char)(i * 7 + (i >> 8));
+    }
+
+    imx50_plan_reset(device);
+    for(i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        device->plan.current.data_delay = delays[i];
+        start = imx50_time_us();
+        if((ret = imx50_write_memory(device, scratch, probe, ROM_TRANSFER_SIZE)) != 0) {
+            break;
+        }
+        t1 = imx50_time_us();
+        if((ret = imx50_write_memory(device, scratch, probe, size)) != 0) {
+            break;
+        }
+        t2 = imx50_time_us();
+        small_us = t1 - start;
+        large_us = t2 - t1;
+        if(i == 0 && large_us > 0) { // the first pass is the defaults
+            default_rate = (unsigned int)((uint64_t)size * 1000000 / large_us);
+        }
+        best = delays[i];
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Delay %u ms: %u bytes in %u us, %u bytes in %u us [%s:%d]\n", __FUNCTION__, delays[i], ROM_TRANSFER_SIZE, (unsigned int)small_us, size, (unsigned int)large_us, __FILE__, __LINE__);
+    }
+    free(probe);
+    if(i == 0) { // not even the defaults work
+        imx50_plan_reset(device);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write to %#X [%s:%d]\n", __FUNCTION__, scratch, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+
+    // the command costs what the small write does beyond its bytes
+    chunk = device->profile->max_download;
+    if(large_us > small_us) {
+        byte_us = (double)(large_us - small_us) / (size - ROM_TRANSFER_SIZE);
+        overhead_us = small_us - byte_us * ROM_TRANSFER_SIZE;
+        if(overhead_us < 0) {
+            overhead_us = 0;
+        }
+        for(chunk = PLAN_MIN_CHUNK; chunk < device->profile->max_download && chunk * byte_us < overhead_us * PLAN_MAX_OVERHEAD; chunk *= 2);
+    }
+    imx50_plan_use(device, chunk, best);
+    device->plan.default_rate = default_rate; // the other passes were not the defaults
+    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Writes of %u bytes with %u ms delay [%s:%d]\n", __FUNCTION__, chunk, best, __FILE__, __LINE__);
+
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Gets the plan writes use now
+
+    @param device The device
+    @param plan Gets the chunk size, delay and stats
+**/
+IMX50USB_EXPORT void imx50_get_plan(imx50_device_t *device, transfer_plan_t *plan) {
+    *plan = device->plan.current;
+}
+
+/**
+    @brief Uses a plan saved by imx50_save_plan()
+
+    @param device The device
+    @param filename File of saved plans
+
+    @return Zero on success, ERROR_PARAMETER if there is no
+        plan for this model on this port, error code
+        otherwise
+**/
+IMX50USB_EXPORT int imx50_load_plan(imx50_device_t *device, const char *filename) {
+    char key[PLAN_KEY_SIZE];
+    char line[PLAN_LINE_SIZE];
+    char vidpid[16], port[REENUM_PORT_SIZE];
+    unsigned int chunk, delay;
+    FILE *fp;
+    int ret;
+
+    if((ret = imx50_plan_key(device, key, sizeof(key))) != 0) {
+        return ret;
+    }
+    if((fp = fopen(filename, "r")) == NULL) { // nothing saved yet
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    ret = ERROR_PARAMETER;
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        if(sscanf(line, "%15s %255s %u %u", vidpid, port, &chunk, &delay) != 4) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s %s", vidpid, port);
+        if(strcmp(line, key) != 0) {
+            continue;
+        }
+        if(chunk < PLAN_MIN_CHUNK || chunk > device->profile->max_download || delay > PLAN_DATA_DELAY) {
+            if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Ignoring bad plan for %s [%s:%d]\n", __FUNCTION__, key, __FILE__, __LINE__);
+            continue;
+        }
+        imx50_plan_use(device, chunk, delay);
+        ret = 0;
+    }
+    fclose(fp);
+    if(ret != 0 && IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:No plan for %s [%s:%d]\n", __FUNCTION__, key, __FILE__, __LINE__);
+
+    return ret;
+}
+
+/**
+    @brief Saves the tuned plan for the device's model and
+    port
+
+    Plans for other devices and ports in the file are kept.
+
+    @param device The device, after imx50_tune_transfers()
+        or imx50_load_plan()
+    @param filename File of saved plans, made if missing
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_save_plan(imx50_device_t *device, const char *filename) {
+    char key[PLAN_KEY_SIZE];
+    char line[PLAN_LINE_SIZE];
+    char *others = NULL, *grown;
+    size_t length = 0, size;
+    FILE *fp;
+    int ret;
+
+    if(!device->plan.tuned_chunk) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:No tuned plan to save [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    if((ret = imx50_plan_key(device, key, sizeof(key))) != 0) {
+        return ret;
+    }
+
+    // keep the lines for everything else
+    if((fp = fopen(filename, "r")) != NULL) {
+        while(fgets(line, sizeof(line), fp) != NULL) {
+            if(strncmp(line, key, strlen(key)) == 0 && line[strlen(key)] == ' ') {
+                continue;
+            }
+            size = strlen(line);
+            if((grown = realloc(others, length + size + 1)) == NULL) {
+                free(others);
+                fclose(fp);
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+                return ERROR_OUT_OF_MEMORY;
+            }
+            others = grown;
+            memcpy(others + length, line, size + 1);
+            length += size;
+        }
+        fclose(fp);
+    }
+
+    if((fp = fopen(filename, "w")) == NULL) {
+        free(others);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    if(length > 0) {
+        fwrite(others, 1, length, fp);
+    }
+    fprintf(fp, "%s %u %u\n", key, device->plan.tuned_chunk, device->plan.tuned_delay);
+    free(others);
+    if(ferror(fp) || fclose(fp) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//  
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//  
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// shared between the library's source files, not for users
+
+#ifndef IMX50USB_PRIVATE
+#define IMX50USB_PRIVATE
+
+#include "imxusb.h"
+#include <stdio.h>
+
+#ifndef _WIN32
+
+// posix includes
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
+// function macros
+#define SLEEP(x) usleep(x * 1000)
+#define YIELD() sched_yield()
+#define MEMORY_BARRIER() __sync_synchronize()
+#define TRACE(msg...) \
+    (fprintf(stderr, msg))
+
+#else // windows
+
+// fixed width integers
+// unfortunally, VC++ lacks unsigned types
+typedef __int8 uint8_t;
+typedef __int16 uint16_t;
+typedef __int32 uint32_t;
+typedef __int64 uint64_t;
+// WinRT includes
+#include <windows.h>
+#include <memory.h>
+// function macros
+#define SLEEP(x) Sleep(x)
+#define YIELD() SwitchToThread()
+#define MEMORY_BARRIER() MemoryBarrier()
+#define TRACE printf
+
+#endif
+
+// fields sent to the device are big-endian
+#define PUT_BE16(p, x)          ( (p)[0] = (unsigned char)((x) >> 8), (p)[1] = (unsigned char)(x) )
+#define PUT_BE32(p, x)          ( PUT_BE16(p, (x) >> 16), PUT_BE16((p) + 2, x) )
+#define GET_BE16(p)             ( ((unsigned int)(p)[0] << 8) | (p)[1] )
+#define GET_BE32(p)             ( (GET_BE16(p) << 16) | GET_BE16((p) + 2) )
+
+// number of registers remembered per handle (direct mapped)
+#define SHADOW_SIZE             256
+#define SHADOW_INDEX(x)         ( ((x) >> 2) & (SHADOW_SIZE - 1) )
+
+// last known value of a register on the device
+typedef struct {
+    device_addr_t address;
+    unsigned int value;
+    int valid;
+} imx50_shadow_t;
+
+// commands are 0xXYXY, the low nibble is unique
+#define TIMEOUT_INDEX(x)        ( (x) & 0xF )
+#define TIMEOUT_COUNT           16
+
+// progress of the outermost transfer
+typedef struct {
+    transfer_options_t options;
+    int active;
+    int cancel;             // callback asked to stop
+    progress_t status;
+    uint64_t start;
+    uint64_t last;          // time of the last call
+    unsigned int last_done;
+    unsigned int next_check;
+} imx50_progress_state_t;
+
+// chunk size and delay used for writes, see imxusb_plan.c
+typedef struct {
+    transfer_plan_t current;    // what writes use now
+    unsigned int tuned_chunk;   // what tuning found, zero if not tuned
+    unsigned int tuned_delay;
+    unsigned int good;          // writes since the last error or switch
+    unsigned int tuned_rate;    // bytes/sec of large writes with each plan, zero if not seen
+    unsigned int default_rate;
+    unsigned int recover;       // good writes at the defaults before the tuned plan is tried again
+} imx50_plan_state_t;
+
+#define PLAN_CHUNK(device)      ( (device)->plan.current.chunk_size )
+
+// timeline being recorded, see imxusb_trace.c
+typedef struct imx50_trace imx50_trace_t;
+
+// spans on the timeline, named after the function
+#define IS_TRACING()            ( g_imx50_trace != NULL )
+#define SPAN_BEGIN()            if(IS_TRACING()) imx50_span_begin(__FUNCTION__, NULL, 0)
+#define SPAN_BEGIN_ARG(n, x)    if(IS_TRACING()) imx50_span_begin(__FUNCTION__, n, x)
+#define SPAN_END()              if(IS_TRACING()) imx50_span_end(__FUNCTION__)
+
+// what the transfer thread was before real-time mode, see imxusb_realtime.c
+typedef struct imx50_realtime imx50_realtime_t;
+
+// per-report logging is left out in real-time mode
+#define IS_LOGGING_HOT(device, scope)   ( (device)->realtime == NULL && IS_LOGGING(scope) )
+
+// round trip histogram, LATENCY_SUB buckets for each power of two
+#define LATENCY_SUB             16
+#define LATENCY_BUCKETS         464 // up to 2^32 us
+
+typedef struct {
+    unsigned int counts[LATENCY_BUCKETS];
+    unsigned int count;
+    unsigned int min_us;
+    unsigned int max_us;
+} imx50_latency_state_t;
+
+// ring of reports filled by a thread, see imxusb_reader.c
+typedef struct imx50_reader imx50_reader_t;
+
+// how reports get to and from the device
+// all functions return a negative number on error
+typedef struct {
+    const char *name;
+    // returns NULL if no device is found, does not wait
+    void *(*open)(unsigned short vendor_id, unsigned short product_id, unsigned int queue_depth);
+    // may return before the report is sent, read() waits for it
+    int (*write)(void *context, const unsigned char *data, unsigned int size);
+    // timeout is in ms, -1 blocks, zero only takes a report that
+    // is already there. returns zero if none came in time.
+    int (*read)(void *context, unsigned char *data, unsigned int size, int timeout);
+    void (*close)(void *context);
+    // optional, number of reports the next reads will return
+    void (*expect)(void *context, unsigned int count);
+    // optional, USB port path of the open device
+    int (*port)(void *context, char *port, unsigned int size);
+    // optional, what is on a port now. returns 1 if something is
+    // there, zero if not. devnum changes every time it enumerates.
+    int (*probe)(void *context, const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum);
+} imx50_transport_t;
+
+// the handle given to the user
+struct imx50_device {
+    const imx50_transport_t *transport;
+    const soc_profile_t *profile; // what the ROM enumerated as
+    void *context;
+    imx50_shadow_t shadow[SHADOW_SIZE];
+    imx50_progress_state_t progress;
+    imx50_plan_state_t plan;
+    imx50_reader_t *reader; // NULL unless imx50_start_reader() was called
+    imx50_realtime_t *realtime; // NULL unless imx50_set_realtime() was called
+    char *cache;            // directory given to imx50_set_cache(), NULL if not used
+    imx50_latency_state_t latency;
+    uint64_t sent;          // when the last report went out
+    int timeouts[TIMEOUT_COUNT]; // ms to wait for each report, -1 forever
+    unsigned short command; // last command sent
+    int stale;              // a read timed out, its report may still come
+    dcd_t queue[MAX_DCD_BATCH_CNT]; // register writes not sent yet
+    unsigned int queued;
+    unsigned int queue_depth; // given to transport->open
+};
+
+extern int g_imx50_log_mask;
+extern imx50_trace_t *g_imx50_trace;
+
+extern const soc_profile_t g_imx50_profiles[];
+
+extern const imx50_transport_t g_imx50_hidapi_transport;
+extern const imx50_transport_t g_imx50_capture_transport;
+extern const imx50_transport_t g_imx50_replay_transport;
+#ifdef IMX50_LIBUSB
+extern const imx50_transport_t g_imx50_libusb_transport;
+#endif
+#if defined(IMX50_HIDRAW) && defined(__linux__)
+extern const imx50_transport_t g_imx50_hidraw_transport;
+#endif
+
+imx50_device_t *imx50_new_device(const imx50_transport_t *transport);
+uint64_t imx50_time_us();
+void imx50_pack_command(const sdp_t *command, unsigned char *report);
+int imx50_progress_begin(imx50_device_t *device, unsigned int total);
+void imx50_progress_update(imx50_device_t *device, unsigned int bytes);
+void imx50_progress_end(imx50_device_t *device, int started);
+int imx50_reader_read(imx50_reader_t *reader, unsigned char *data, unsigned int size, unsigned int skip, int timeout);
+void imx50_reader_drop(imx50_reader_t *reader);
+int imx50_restart_reader(imx50_device_t *device);
+int imx50_read_dev_ack(imx50_device_t *device, unsigned char *payload);
+int imx50_read_report(imx50_device_t *device, unsigned char *data, unsigned int size, unsigned int skip, int timeout);
+int imx50_write_memory_framed(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count, const unsigned char *frames);
+int imx50_read_memory_each(imx50_device_t *device, device_addr_t address, unsigned char *buffer, unsigned int count, void (*arrived)(void *context, unsigned int offset, unsigned int size), void *context);
+unsigned char *imx50_read_file(const char *filename, unsigned int *size_p);
+int imx50_load_cached(imx50_device_t *device, device_addr_t address, const char *filename, const unsigned char *header, unsigned int header_size);
+int imx50_run_routine(imx50_device_t *device, device_addr_t routine, const uint32_t *code, unsigned int code_size, const void *params, unsigned int params_size);
+void *imx50_open_any(const imx50_transport_t *transport, unsigned int queue_depth, const soc_profile_t **profile_p);
+int imx50_realtime_thread(const imx50_realtime_t *realtime);
+void imx50_latency_record(imx50_device_t *device, uint64_t time_us);
+void imx50_plan_reset(imx50_device_t *device);
+void imx50_plan_result(imx50_device_t *device, unsigned int bytes, uint64_t time_us, int ok);
+#ifdef __linux__
+int imx50_sysfs_port(const char *hidraw, char *port, unsigned int size);
+int imx50_sysfs_probe(const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum);
+#endif
+int imx50_fill_runs(imx50_device_t *device, device_addr_t routine, uint32_t *params);
+
+#endif
@@ -0,0 +1,366 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// background thread that reads reports into a ring as they come in
+
+#include "imxusb_private.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define READER_POLL_TIME        100 // ms, how often the thread checks if it should stop
+#define READER_SLOT(r, i)       ( (r)->slots + ((i) & ((r)->count - 1)) * REPORT_STATUS_SIZE )
+
+// single producer (the thread), single consumer (the user)
+// head is only written by the thread, tail only by the user.
+// a side that has to wait sleeps until the other one moves.
+struct imx50_reader {
+    const imx50_transport_t *transport;
+    void *context;
+    unsigned char *slots;
+    int *lengths;
+    unsigned int count;             // power of two
+    volatile unsigned int head;     // next slot to fill
+    volatile unsigned int tail;     // next slot to read
+    volatile int stop;
+    volatile int error;             // transport read failed, thread is gone
+    volatile unsigned int stalled;  // times the ring was full
+    unsigned int dropped;           // stale reports thrown away
+    const imx50_realtime_t *realtime; // the handle's, NULL if not in real-time mode
+#ifdef _WIN32
+    HANDLE thread;
+    HANDLE filled;                  // auto-reset, set when head moves
+    HANDLE freed;                   // auto-reset, set when tail moves
+#else
+    pthread_t thread;
+    pthread_mutex_t lock;           // only taken to sleep and wake
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+#endif
+};
+
+/**
+    @brief Wakes the side waiting for head (filled) or tail to move
+ */
+void imx50_reader_signal(imx50_reader_t *reader, int filled) {
+#ifdef _WIN32
+    SetEvent(filled ? reader->filled : reader->freed);
+#else
+    pthread_mutex_lock(&reader->lock);
+    pthread_cond_signal(filled ? &reader->filled : &reader->freed);
+    pthread_mutex_unlock(&reader->lock);
+#endif
+}
+
+/**
+    @brief Sleeps until there is a report (filled) or a free slot
+
+    Also wakes up on an error or stop, and after ms. The 
+    caller checks again either way.
+ */
+void imx50_reader_wait(imx50_reader_t *reader, int filled, unsigned int ms) {
+#ifdef _WIN32
+    WaitForSingleObject(filled ? reader->filled : reader->freed, ms);
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if(ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&reader->lock);
+    // checked under the lock, the other side signals under it
+    if(filled ? (reader->head == reader->tail && !reader->error) : (reader->head - reader->tail >= reader->count && !reader->stop)) {
+        pthread_cond_timedwait(filled ? &reader->filled : &reader->freed, &reader->lock, &ts);
+    }
+    pthread_mutex_unlock(&reader->lock);
+#endif
+}
+
+/**
+    @brief Frees a reader and what it waits on
+ */
+void imx50_reader_free(imx50_reader_t *reader) {
+#ifdef _WIN32
+    if(reader->filled) {
+        CloseHandle(reader->filled);
+    }
+    if(reader->freed) {
+        CloseHandle(reader->freed);
+    }
+#else
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->filled);
+    pthread_cond_destroy(&reader->freed);
+#endif
+    free(reader->slots);
+    free(reader->lengths);
+    free(reader);
+}
+
+/**
+    @brief The reader thread
+ 
+    Reads reports as fast as the transport gives them. If 
+    the ring is full, waits for the user instead of dropping 
+    reports, the protocol can't recover from a lost one.
+ */
+#ifdef _WIN32
+DWORD WINAPI imx50_reader_thread(LPVOID param) {
+#else
+void *imx50_reader_thread(void *param) {
+#endif
+    imx50_reader_t *reader = (imx50_reader_t*)param;
+    int ret;
+    
+    if(reader->realtime) {
+        imx50_realtime_thread(reader->realtime);
+    }
+    while(!reader->stop) {
+        if(reader->head - reader->tail >= reader->count) {
+            reader->stalled++;
+            while(reader->head - reader->tail >= reader->count && !reader->stop) {
+                imx50_reader_wait(reader, 0, READER_POLL_TIME);
+            }
+            continue;
+        }
+        ret = reader->transport->read(reader->context, READER_SLOT(reader, reader->head), REPORT_STATUS_SIZE, READER_POLL_TIME);
+        if(ret < 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error reading report [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            reader->error = 1;
+            imx50_reader_signal(reader, 1);
+            break;
+        }
+        if(ret == 0) { // timed out
+            continue;
+        }
+        reader->lengths[reader->head & (reader->count - 1)] = ret;
+        MEMORY_BARRIER(); // slot is filled before it is published
+        reader->head++;
+        imx50_reader_signal(reader, 1);
+    }
+    
+    return 0;
+}
+
+/**
+    @brief Starts reading reports in the background
+ 
+    After this, reports are read by a thread as soon as the 
+    device sends them, so the device never waits for the 
+    host during big reads. Only the hidapi transport can be 
+    read and written from two threads at once, the others 
+    already queue their reads.
+ 
+    @param device the HID device
+    @param reports Size of the ring in reports, rounded up to a power of two. Zero for READER_DEFAULT_SIZE
+ 
+    @see imx50_stop_reader
+    @return Zero on success, error code otherwise
+ */
+IMX50USB_EXPORT int imx50_start_reader(imx50_device_t *device, unsigned int reports) {
+    imx50_reader_t *reader;
+    
+    if(device->reader) {
+        return 0;
+    }
+    if(device->transport != &g_imx50_hidapi_transport) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Reader not supported with %s [%s:%d]\n", __FUNCTION__, device->transport->name, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    
+    reader = malloc(sizeof(imx50_reader_t));
+    if(!reader) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memset(reader, 0, sizeof(imx50_reader_t));
+    reader->transport = device->transport;
+    reader->context = device->context;
+    reader->realtime = device->realtime;
+    for(reader->count = 1; reader->count < (reports ? reports : READER_DEFAULT_SIZE); reader->count <<= 1);
+#ifdef _WIN32
+    reader->filled = CreateEvent(NULL, FALSE, FALSE, NULL);
+    reader->freed = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->filled, NULL);
+    pthread_cond_init(&reader->freed, NULL);
+#endif
+    reader->slots = malloc(reader->count * REPORT_STATUS_SIZE);
+    reader->lengths = malloc(reader->count * sizeof(int));
+#ifdef _WIN32
+    if(!reader->slots || !reader->lengths || !reader->filled || !reader->freed) {
+#else
+    if(!reader->slots || !reader->lengths) {
+#endif
+        imx50_reader_free(reader);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    
+#ifdef _WIN32
+    reader->thread = CreateThread(NULL, 0, imx50_reader_thread, reader, 0, NULL);
+    if(reader->thread == NULL) {
+#else
+    if(pthread_create(&reader->thread, NULL, imx50_reader_thread, reader) != 0) {
+#endif
+        imx50_reader_free(reader);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot start reader thread [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Reader started with %u reports [%s:%d]\n", __FUNCTION__, reader->count, __FILE__, __LINE__);
+    device->reader = reader;
+    
+    return 0;
+}
+
+/**
+    @brief Stops the background reader
+ 
+    Reports left in the ring are lost.
+ 
+    @param device the HID device
+ */
+IMX50USB_EXPORT void imx50_stop_reader(imx50_device_t *device) {
+    imx50_reader_t *reader = device->reader;
+    
+    if(!reader) {
+        return;
+    }
+    reader->stop = 1;
+    imx50_reader_signal(reader, 0); // in case the ring is full
+#ifdef _WIN32
+    WaitForSingleObject(reader->thread, INFINITE);
+    CloseHandle(reader->thread);
+#else
+    pthread_join(reader->thread, NULL);
+#endif
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Reader stopped, stalled %u times, dropped %u reports [%s:%d]\n", __FUNCTION__, reader->stalled, reader->dropped, __FILE__, __LINE__);
+    imx50_reader_free(reader);
+    device->reader = NULL;
+}
+
+/**
+    @brief Starts the background reader again
+ 
+    So the thread picks up a change to real-time mode. 
+    Reports left in the ring are lost.
+ 
+    @param device the HID device, with a reader
+ 
+    @return Zero on success, error code otherwise
+ */
+int imx50_restart_reader(imx50_device_t *device) {
+    unsigned int count = device->reader->count;
+    
+    imx50_stop_reader(device);
+    return imx50_start_reader(device, count);
+}
+
+/**
+    @brief Gets counters of the background reader
+ 
+    @param device the HID device
+    @param stalled_p Times the ring was full and the device had to wait
+    @param dropped_p Reports that came when nothing was waiting for them
+ 
+    @return Zero on success, error code otherwise
+ */
+IMX50USB_EXPORT int imx50_reader_stats(imx50_device_t *device, unsigned int *stalled_p, unsigned int *dropped_p) {
+    if(!device->reader) {
+        return ERROR_PARAMETER;
+    }
+    *stalled_p = device->reader->stalled;
+    *dropped_p = device->reader->dropped;
+    return 0;
+}
+
+/**
+    @brief Takes the next report out of the ring
+ 
+    Copies straight into data, skipping the first bytes of 
+    the report (to leave out the report number).
+ 
+    @param reader The background reader
+    @param data Where to copy the report
+    @param size Most bytes to copy
+    @param skip Bytes of the report to leave out
+    @param timeout In ms, -1 waits forever
+ 
+    @return Bytes copied, zero on timeout, negative on error
+ */
+int imx50_reader_read(imx50_reader_t *reader, unsigned char *data, unsigned int size, unsigned int skip, int timeout) {
+    uint64_t deadline = timeout < 0 ? 0 : imx50_time_us() + (uint64_t)timeout * 1000;
+    uint64_t now;
+    unsigned int length;
+    unsigned int wait;
+    
+    while(reader->head == reader->tail) {
+        if(reader->error) {
+            return -1;
+        }
+        wait = READER_POLL_TIME;
+        if(timeout >= 0) {
+            if((now = imx50_time_us()) >= deadline) {
+                return 0;
+            }
+            if(deadline - now < (uint64_t)wait * 1000) {
+                wait = (unsigned int)((deadline - now + 999) / 1000);
+            }
+        }
+        imx50_reader_wait(reader, 1, wait);
+    }
+    MEMORY_BARRIER(); // see the slot as the thread left it
+    
+    length = reader->lengths[reader->tail & (reader->count - 1)];
+    length = length > skip ? length - skip : 0;
+    if(length > size) {
+        length = size;
+    }
+    memcpy(data, READER_SLOT(reader, reader->tail) + skip, length);
+    MEMORY_BARRIER(); // done with the slot before giving it back
+    reader->tail++;
+    imx50_reader_signal(reader, 0);
+    
+    return length;
+}
+
+/**
+    @brief Throws away reports nothing asked for
+ 
+    Called before a new command so a report left over from 
+    an earlier one is not taken as the answer.
+ 
+    @param reader The background reader
+ */
+void imx50_reader_drop(imx50_reader_t *reader) {
+    unsigned int head = reader->head;
+    
+    if(head != reader->tail) {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Dropping %u stale reports [%s:%d]\n", __FUNCTION__, head - reader->tail, __FILE__, __LINE__);
+        reader->dropped += head - reader->tail;
+        MEMORY_BARRIER();
+        reader->tail = head;
+        imx50_reader_signal(reader, 0);
+    }
+}
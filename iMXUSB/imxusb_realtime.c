@@ -0,0 +1,352 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// keeping the scheduler and page faults out of round trips, and measuring them
+
+#ifdef __linux__
+#define _GNU_SOURCE // CPU affinity
+#endif
+#include "imxusb_private.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+struct imx50_realtime {
+    realtime_t options;
+#ifdef _WIN32
+    int priority;               // of the thread before
+    DWORD_PTR affinity;         // zero if not changed
+#else
+    int policy;
+    struct sched_param param;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+#endif
+};
+
+// memory is locked for the whole process, while any handle is real-time
+static unsigned int g_imx50_realtime_count = 0;
+static int g_imx50_realtime_locked = 0;
+
+/**
+    @brief Puts the calling thread in real-time mode
+
+    Used for the thread calling imx50_set_realtime() and for
+    the reader thread.
+
+    @param realtime The options
+
+    @return REALTIME_* that worked
+ */
+int imx50_realtime_thread(const imx50_realtime_t *realtime) {
+    int applied = 0;
+#ifdef _WIN32
+    if(SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+        applied |= REALTIME_FIFO;
+    }
+    if(realtime->options.cpu >= 0 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << realtime->options.cpu) != 0) {
+        applied |= REALTIME_AFFINITY;
+    }
+#else
+    struct sched_param param;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = realtime->options.priority ? realtime->options.priority : REALTIME_PRIORITY;
+    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+        applied |= REALTIME_FIFO;
+    } else {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Cannot use SCHED_FIFO, needs CAP_SYS_NICE or RLIMIT_RTPRIO [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    }
+#ifdef __linux__
+    if(realtime->options.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(realtime->options.cpu, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+            applied |= REALTIME_AFFINITY;
+        }
+    }
+#endif
+#endif
+    if(realtime->options.cpu >= 0 && !(applied & REALTIME_AFFINITY) && IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Cannot run on CPU %d [%s:%d]\n", __FUNCTION__, realtime->options.cpu, __FILE__, __LINE__);
+
+    return applied;
+}
+
+/**
+    @brief Touches the stack the transfer thread will use
+
+    So the first load does not fault it in one page at a
+    time between reports.
+ */
+void imx50_prefault_stack() {
+    volatile unsigned char stack[REALTIME_STACK];
+    unsigned int i;
+
+    for(i = 0; i < sizeof(stack); i += 0x1000) {
+        stack[i] = 0;
+    }
+}
+
+/**
+    @brief Locks the process in memory
+
+    Locks what is mapped now (handles, report rings, images
+    already read) and what is mapped later, so images read
+    by a load are faulted in when read and stay there. The
+    heap is not given back to the system, or the next
+    allocation would fault again.
+
+    @return REALTIME_LOCKED if it worked, zero otherwise
+ */
+int imx50_lock_memory() {
+#ifdef _WIN32
+    if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Locking memory not supported [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    return 0;
+#else
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Cannot lock memory, needs CAP_IPC_LOCK or RLIMIT_MEMLOCK [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        imx50_prefault_stack(); // still better than nothing
+        return 0;
+    }
+    imx50_prefault_stack();
+    return REALTIME_LOCKED;
+#endif
+}
+
+/**
+    @brief Undoes imx50_lock_memory()
+ */
+void imx50_unlock_memory() {
+#ifndef _WIN32
+    munlockall();
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, 128 * 1024); // glibc's defaults
+    mallopt(M_MMAP_MAX, 65536);
+#endif
+#endif
+}
+
+/**
+    @brief Runs transfers with as little jitter as possible
+
+    Puts the calling thread, and the reader thread if there
+    is one, at SCHED_FIFO priority (time critical on
+    Windows), optionally on one CPU. Locks the process in
+    memory with the stack prefaulted, and loads read the
+    whole image before the first command. Per-report
+    logging is left out. What cannot be done (usually for
+    lack of privileges) is skipped with a warning, see
+    options->applied.
+
+    Call it from the thread that does the transfers, and
+    again with NULL from the same thread to go back. A
+    running reader is restarted, so call it between
+    commands.
+
+    @param device the HID device
+    @param options What to use, NULL to leave real-time mode
+
+    @see imx50_get_latency
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_set_realtime(imx50_device_t *device, realtime_t *options) {
+    imx50_realtime_t *realtime = device->realtime;
+#ifdef _WIN32
+    DWORD_PTR system_affinity;
+#endif
+    int ret;
+
+    if(realtime) { // leave, even to change the options
+        device->realtime = NULL;
+#ifdef _WIN32
+        SetThreadPriority(GetCurrentThread(), realtime->priority);
+        if(realtime->affinity) {
+            SetThreadAffinityMask(GetCurrentThread(), realtime->affinity);
+        }
+#else
+        pthread_setschedparam(pthread_self(), realtime->policy, &realtime->param);
+#ifdef __linux__
+        pthread_setaffinity_np(pthread_self(), sizeof(realtime->cpus), &realtime->cpus);
+#endif
+#endif
+        if(--g_imx50_realtime_count == 0 && g_imx50_realtime_locked) {
+            imx50_unlock_memory();
+            g_imx50_realtime_locked = 0;
+        }
+        free(realtime);
+        // the new thread takes after this one
+        if(device->reader && (ret = imx50_restart_reader(device)) != 0) {
+            return ret;
+        }
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Left real-time mode [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+    }
+    if(!options) {
+        return 0;
+    }
+
+    realtime = malloc(sizeof(imx50_realtime_t));
+    if(!realtime) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memset(realtime, 0, sizeof(imx50_realtime_t));
+    realtime->options = *options;
+#ifdef _WIN32
+    realtime->priority = GetThreadPriority(GetCurrentThread());
+    if(options->cpu >= 0) {
+        // threads start with the process' mask
+        GetProcessAffinityMask(GetCurrentProcess(), &realtime->affinity, &system_affinity);
+    }
+    options->applied = imx50_realtime_thread(realtime);
+#else
+    pthread_getschedparam(pthread_self(), &realtime->policy, &realtime->param);
+#ifdef __linux__
+    pthread_getaffinity_np(pthread_self(), sizeof(realtime->cpus), &realtime->cpus);
+#endif
+    options->applied = imx50_realtime_thread(realtime);
+#endif
+
+    if(g_imx50_realtime_count++ == 0) {
+        g_imx50_realtime_locked = imx50_lock_memory();
+    }
+    options->applied |= g_imx50_realtime_locked;
+    realtime->options.applied = options->applied;
+    device->realtime = realtime;
+
+    if(device->reader && (ret = imx50_restart_reader(device)) != 0) {
+        return ret;
+    }
+    if(IS_LOGGING(INFO_LOG)) TRACE("[%s] I:Real-time mode:%s%s%s [%s:%d]\n", __FUNCTION__,
+        (options->applied & REALTIME_FIFO) ? " priority" : "", (options->applied & REALTIME_AFFINITY) ? " affinity" : "",
+        (options->applied & REALTIME_LOCKED) ? " locked" : "", __FILE__, __LINE__);
+
+    return 0;
+}
+
+/**
+    @brief Finds the histogram bucket of a round trip
+ */
+unsigned int imx50_latency_bucket(unsigned int us) {
+    unsigned int shift = 0;
+
+    while((us >> shift) >= 2 * LATENCY_SUB) {
+        shift++;
+    }
+    return shift * LATENCY_SUB + (us >> shift);
+}
+
+/**
+    @brief Gets the longest round trip in a bucket
+ */
+unsigned int imx50_latency_value(unsigned int bucket) {
+    unsigned int shift;
+
+    if(bucket < 2 * LATENCY_SUB) {
+        return bucket;
+    }
+    shift = bucket / LATENCY_SUB - 1;
+    return ((bucket - shift * LATENCY_SUB + 1) << shift) - 1;
+}
+
+/**
+    @brief Counts a round trip
+
+    Called for every HAB state, so no allocation and no
+    sorting.
+
+    @param device the HID device
+    @param time_us From the last report sent to the HAB state
+ */
+void imx50_latency_record(imx50_device_t *device, uint64_t time_us) {
+    imx50_latency_state_t *latency = &device->latency;
+    unsigned int us = (time_us > 0xFFFFFFFF) ? 0xFFFFFFFF : (unsigned int)time_us;
+
+    if(latency->count == 0 || us < latency->min_us) {
+        latency->min_us = us;
+    }
+    if(us > latency->max_us) {
+        latency->max_us = us;
+    }
+    latency->counts[imx50_latency_bucket(us)]++;
+    latency->count++;
+}
+
+/**
+    @brief Finds a percentile in the histogram
+
+    @return Round trip in us, rounded up to its bucket
+        (within 1/LATENCY_SUB)
+ */
+unsigned int imx50_latency_percentile(const imx50_latency_state_t *latency, unsigned int per_mille) {
+    unsigned int rank = (unsigned int)(((uint64_t)latency->count * per_mille + 999) / 1000);
+    unsigned int seen = 0;
+    unsigned int i;
+
+    if(rank == 0) {
+        rank = 1;
+    }
+    for(i = 0; i < LATENCY_BUCKETS; i++) {
+        if((seen += latency->counts[i]) >= rank) {
+            break;
+        }
+    }
+    if(i == LATENCY_BUCKETS || imx50_latency_value(i) > latency->max_us) {
+        return latency->max_us;
+    }
+    return imx50_latency_value(i);
+}
+
+/**
+    @brief Gets the round trip times of a handle
+
+    A round trip is from the last report sent for a command
+    (the command itself, or its last data report) to the
+    HAB state coming back. They are counted for every
+    command, in and out of real-time mode, so the two can
+    be compared with the same workload.
+
+    @param device the HID device
+    @param latency Gets the counts, all zero if there were none
+    @param reset Start counting again after this
+**/
+IMX50USB_EXPORT void imx50_get_latency(imx50_device_t *device, latency_t *latency, int reset) {
+    memset(latency, 0, sizeof(latency_t));
+    if(device->latency.count > 0) {
+        latency->count = device->latency.count;
+        latency->min_us = device->latency.min_us;
+        latency->p50_us = imx50_latency_percentile(&device->latency, 500);
+        latency->p99_us = imx50_latency_percentile(&device->latency, 990);
+        latency->p999_us = imx50_latency_percentile(&device->latency, 999);
+        latency->max_us = device->latency.max_us;
+    }
+    if(reset) {
+        memset(&device->latency, 0, sizeof(imx50_latency_state_t));
+    }
+}
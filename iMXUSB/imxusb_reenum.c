@@ -0,0 +1,319 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// following the device by its USB port when it leaves the bus and comes back
+
+#include "imxusb_private.h"
+#ifdef __linux__
+#include <limits.h>
+#endif
+
+#define SYSFS_HIDRAW            "/sys/class/hidraw"
+#define SYSFS_USB_DEVICES       "/sys/bus/usb/devices"
+
+#ifdef __linux__
+
+/**
+    @brief Finds the USB port of a hidraw node
+
+    The device link goes through the USB interface, like
+    .../1-1/1-1.2/1-1.2:1.0/0003:15A2:0052.0001, and the
+    port is the interface without the :config.interface.
+
+    @param hidraw Name of the node, like hidraw0
+    @param port Gets the port
+    @param size Size of port
+
+    @return Zero on success, negative otherwise
+ */
+int imx50_sysfs_port(const char *hidraw, char *port, unsigned int size) {
+    char link[PATH_MAX];
+    char path[PATH_MAX];
+    char *part, *next, *found = NULL;
+
+    snprintf(link, sizeof(link), "%s/%s/device", SYSFS_HIDRAW, hidraw);
+    if(realpath(link, path) == NULL) {
+        return -1;
+    }
+    for(part = path; part != NULL; part = next) {
+        if((next = strchr(part, '/')) != NULL) {
+            *next++ = '\0';
+        }
+        if(strchr(part, '-') && strchr(part, ':')) {
+            found = part; // the last one is the interface
+        }
+    }
+    if(found == NULL) {
+        return -1;
+    }
+    *strchr(found, ':') = '\0';
+    snprintf(port, size, "%s", found);
+
+    return 0;
+}
+
+/**
+    @brief Reads a number from a USB device's sysfs file
+
+    @return Zero on success, negative if it is not there
+ */
+int imx50_sysfs_read(const char *port, const char *name, const char *format, unsigned int *value_p) {
+    char path[PATH_MAX];
+    FILE *fp;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", SYSFS_USB_DEVICES, port, name);
+    if((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    ret = fscanf(fp, format, value_p);
+    fclose(fp);
+
+    return (ret == 1) ? 0 : -1;
+}
+
+/**
+    @brief Looks for any USB device on a port
+
+    Works for devices no driver has taken, so it also sees
+    what the device becomes after leaving the ROM.
+
+    @return 1 if something is there, zero if not
+ */
+int imx50_sysfs_probe(const char *port, unsigned short *vendor_id, unsigned short *product_id, unsigned int *devnum) {
+    unsigned int vendor, product;
+
+    if(imx50_sysfs_read(port, "idVendor", "%x", &vendor) != 0 ||
+       imx50_sysfs_read(port, "idProduct", "%x", &product) != 0 ||
+       imx50_sysfs_read(port, "devnum", "%u", devnum) != 0) {
+        return 0; // gone, or not set up yet
+    }
+    *vendor_id = vendor;
+    *product_id = product;
+
+    return 1;
+}
+
+#endif
+
+/**
+    @brief Gets the USB port a device is plugged into
+
+    The port stays the same when the device re-enumerates,
+    so it can be used to find the device again.
+
+    @param device The device
+    @param port Gets the port, like 1-1.2
+    @param size Size of port, REENUM_PORT_SIZE is enough
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_get_port(imx50_device_t *device, char *port, unsigned int size) {
+    if(!device->transport->port || device->transport->port(device->context, port, size) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot find the port with %s [%s:%d]\n", __FUNCTION__, device->transport->name, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    return 0;
+}
+
+/**
+    @brief Waits for the device on a port to change
+
+    @param device The old device, only used to probe
+    @param port The port
+    @param start When the jump was sent
+    @param timeout When to give up, in ms after start
+    @param gone Wait for the port to be empty or used by
+        another device than this one. If zero, wait for
+        anything to be there.
+    @param result Gets the identity found
+    @param devnum_p The device number. For gone, what it
+        was before, otherwise gets what was found.
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_wait_port(imx50_device_t *device, const char *port, uint64_t start, unsigned int timeout, int gone, reenum_t *result, unsigned int *devnum_p) {
+    unsigned short vendor_id, product_id;
+    unsigned int devnum;
+    int ret;
+
+    SPAN_BEGIN_ARG("gone", gone);
+    for(;;) {
+        ret = device->transport->probe(device->context, port, &vendor_id, &product_id, &devnum);
+        if(ret < 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot probe %s [%s:%d]\n", __FUNCTION__, port, __FILE__, __LINE__);
+            SPAN_END();
+            return ERROR_IO;
+        }
+        if(ret > 0 && (!gone || devnum != *devnum_p || vendor_id != result->vendor_id || product_id != result->product_id)) {
+            result->vendor_id = vendor_id;
+            result->product_id = product_id;
+            *devnum_p = devnum;
+            SPAN_END();
+            return 0; // back, maybe without ever looking gone
+        }
+        if(ret == 0 && gone) {
+            SPAN_END();
+            return 0;
+        }
+        if(imx50_time_us() - start >= (uint64_t)timeout * 1000) {
+            SPAN_END();
+            return ERROR_NO_DEVICE;
+        }
+        SLEEP(REENUM_POLL_TIME);
+    }
+}
+
+/**
+    @brief Opens the SDP device on a port
+
+    The USB device shows up before its HID interface is
+    ready, so this keeps trying until the timeout.
+
+    @return The new handle, NULL on error
+ */
+imx50_device_t *imx50_reopen(imx50_device_t *device, const char *port, uint64_t start, unsigned int timeout) {
+    imx50_device_t *next;
+    char found[REENUM_PORT_SIZE];
+    unsigned int queue_depth;
+
+    SPAN_BEGIN();
+    if((next = imx50_new_device(device->transport)) == NULL) {
+        SPAN_END();
+        return NULL;
+    }
+    memcpy(next->timeouts, device->timeouts, sizeof(next->timeouts));
+    if(device->cache && imx50_set_cache(next, device->cache) != 0) {
+        free(next);
+        SPAN_END();
+        return NULL;
+    }
+    queue_depth = device->queue_depth ? device->queue_depth : DEFAULT_QUEUE_DEPTH;
+    next->queue_depth = queue_depth;
+    for(;;) {
+        next->context = imx50_open_any(next->transport, queue_depth, &next->profile);
+        if(next->context) {
+            if(!next->transport->port || next->transport->port(next->context, found, sizeof(found)) != 0 || strcmp(found, port) == 0) {
+                imx50_plan_reset(next);
+                SPAN_END();
+                return next;
+            }
+            if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Skipping device on %s [%s:%d]\n", __FUNCTION__, found, __FILE__, __LINE__);
+            next->transport->close(next->context);
+        }
+        if(imx50_time_us() - start >= (uint64_t)timeout * 1000) {
+            imx50_set_cache(next, NULL);
+            free(next);
+            SPAN_END();
+            return NULL;
+        }
+        SLEEP(REENUM_POLL_TIME);
+    }
+}
+
+/**
+    @brief Jumps and follows the device through re-enumeration
+
+    Polls the device's USB port every REENUM_POLL_TIME ms
+    to see it leave and come back. If it comes back as the
+    SDP device and device_p is given, a new handle is opened
+    on the same port with the same transport, timeouts and 
+    cache. Captures, the reader and real-time mode are not 
+    carried over.
+
+    Unless the jump cannot be sent, the old handle is
+    closed. Linux sees any USB device that comes back,
+    elsewhere hidapi only sees HID devices with the same
+    path and libusb is needed to see the rest.
+
+    @param device The device, closed by this call
+    @param address Header to jump to, zero to send
+        CMD_RE_ENUM instead
+    @param timeout Give up after this many ms, zero for
+        REENUM_TIMEOUT
+    @param result Gets the port, what came back and how
+        long it took
+    @param device_p Gets the new handle, NULL if it did not
+        come back as the SDP device. May be NULL.
+
+    @return Zero on success, ERROR_NO_DEVICE if the device
+        did not leave or come back in time, error code
+        otherwise
+    @see imx50_jump
+**/
+IMX50USB_EXPORT int imx50_jump_and_wait(imx50_device_t *device, device_addr_t address, unsigned int timeout, reenum_t *result, imx50_device_t **device_p) {
+    imx50_device_t *next = NULL;
+    unsigned int devnum = 0;
+    uint64_t start;
+    int ret;
+
+    SPAN_BEGIN_ARG("address", address);
+    memset(result, 0, sizeof(reenum_t));
+    if(timeout == 0) {
+        timeout = REENUM_TIMEOUT;
+    }
+    if(!device->transport->probe) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot follow a device with %s [%s:%d]\n", __FUNCTION__, device->transport->name, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    if((ret = imx50_get_port(device, result->port, sizeof(result->port))) != 0) {
+        SPAN_END();
+        return ret;
+    }
+    if(device->transport->probe(device->context, result->port, &result->vendor_id, &result->product_id, &devnum) != 1) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Nothing found on %s [%s:%d]\n", __FUNCTION__, result->port, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_IO;
+    }
+    if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Device %04hX:%04hX is on %s [%s:%d]\n", __FUNCTION__, result->vendor_id, result->product_id, result->port, __FILE__, __LINE__);
+
+    start = imx50_time_us();
+    ret = address ? imx50_jump(device, address) : imx50_re_enum(device);
+    if(ret != 0) {
+        SPAN_END();
+        return ret;
+    }
+    imx50_stop_reader(device);
+    imx50_stop_capture(device);
+
+    if((ret = imx50_wait_port(device, result->port, start, timeout, 1, result, &devnum)) == 0) {
+        result->gone_ms = (unsigned int)((imx50_time_us() - start) / 1000);
+        ret = imx50_wait_port(device, result->port, start, timeout, 0, result, &devnum);
+    }
+    if(ret == 0) {
+        result->back_ms = (unsigned int)((imx50_time_us() - start) / 1000);
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Left after %u ms, back as %04hX:%04hX after %u ms [%s:%d]\n", __FUNCTION__, result->gone_ms, result->vendor_id, result->product_id, result->back_ms, __FILE__, __LINE__);
+        if(device_p && imx50_find_profile(result->vendor_id, result->product_id)) {
+            if((next = imx50_reopen(device, result->port, start, timeout)) != NULL) {
+                result->ready_ms = (unsigned int)((imx50_time_us() - start) / 1000);
+            } else {
+                ret = ERROR_NO_DEVICE;
+            }
+        }
+    }
+    if(ret == ERROR_NO_DEVICE && IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Device on %s did not come back in %u ms [%s:%d]\n", __FUNCTION__, result->port, timeout, __FILE__, __LINE__);
+
+    imx50_close_device(device);
+    if(device_p) {
+        *device_p = next;
+    }
+
+    SPAN_END();
+    return ret;
+}
@@ -0,0 +1,506 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// small routines run on the device to save USB transfers
+
+#include "imxusb_private.h"
+
+// layout of a routine in IRAM: IVT, boot data, then code 
+// with its parameters right after it
+#define ROUTINE_CODE_OFFSET     0x30
+#define ROUTINE_MAX_SIZE        0x1000  // everything a routine touches, including its tables
+
+// parameters of the checksum routine
+#define CRC_PARAMS_SIZE         12      // size, block size, address, then the results
+
+// parameters of the fill routine
+#define FILL_MAX_RUNS           64      // runs per call, count then address, length, value for each
+
+/**
+    CRC32 (same as zlib) over blocks of memory. Called by the 
+    ROM as a plugin, so it returns to the ROM when done and 
+    the device takes commands again. Builds its table 1K 
+    after the parameters.
+    
+    params: size, block size, address
+    results: one CRC32 per block
+**/
+static const uint32_t crc_routine[] = 
+    {
+        // entry:
+        0xE92D47F0, // push {r4, r5, r6, r7, r8, r9, r10, lr}
+        0xE28F0090, // adr r0, params
+        0xE5901000, // ldr r1, [r0]          size
+        0xE5902004, // ldr r2, [r0, #4]      block size
+        0xE5903008, // ldr r3, [r0, #8]      address
+        0xE280400C, // add r4, r0, #12       results
+        0xE2805B01, // add r5, r0, #1024     table
+        0xE59F7074, // ldr r7, poly
+        0xE3A06000, // mov r6, #0
+        // gen:
+        0xE1A08006, // mov r8, r6
+        0xE3A09008, // mov r9, #8
+        // bit:
+        0xE1B080A8, // lsrs r8, r8, #1
+        0x20288007, // eorhs r8, r8, r7
+        0xE2599001, // subs r9, r9, #1
+        0x1AFFFFFB, // bne bit
+        0xE7858106, // str r8, [r5, r6, lsl #2]
+        0xE2866001, // add r6, r6, #1
+        0xE3560C01, // cmp r6, #256
+        0x1AFFFFF5, // bne gen
+        // block:
+        0xE3510000, // cmp r1, #0
+        0x0A00000E, // beq done
+        0xE1510002, // cmp r1, r2
+        0x31A09001, // movlo r9, r1
+        0x21A09002, // movhs r9, r2
+        0xE0411009, // sub r1, r1, r9
+        0xE3E08000, // mvn r8, #0
+        // byte:
+        0xE4D3A001, // ldrb r10, [r3], #1
+        0xE02AA008, // eor r10, r10, r8
+        0xE20AA0FF, // and r10, r10, #255
+        0xE795A10A, // ldr r10, [r5, r10, lsl #2]
+        0xE02A8428, // eor r8, r10, r8, lsr #8
+        0xE2599001, // subs r9, r9, #1
+        0x1AFFFFF8, // bne byte
+        0xE1E08008, // mvn r8, r8
+        0xE4848004, // str r8, [r4], #4
+        0xEAFFFFEE, // b block
+        // done:
+        0xE3A00001, // mov r0, #1
+        0xE8BD87F0, // pop {r4, r5, r6, r7, r8, r9, r10, pc}
+        // poly:
+        0xEDB88320
+        // params:
+    };
+
+/**
+    Fills runs of memory with one byte value. Called by the 
+    ROM as a plugin like the CRC routine. Writes words once 
+    the address is aligned.
+    
+    params: count, then address, length, value (the byte 
+        repeated 4 times) for each run
+**/
+static const uint32_t fill_routine[] = 
+    {
+        // entry:
+        0xE92D4010, // push {r4, lr}
+        0xE28F0058, // adr r0, params
+        0xE4901004, // ldr r1, [r0], #4      count
+        // run:
+        0xE2511001, // subs r1, r1, #1
+        0x4A000011, // bmi done
+        0xE8B0001C, // ldm r0!, {r2, r3, r4} address, length, value
+        // head:
+        0xE3530000, // cmp r3, #0
+        0x0AFFFFFA, // beq run
+        0xE3120003, // tst r2, #3
+        0x0A000002, // beq words
+        0xE4C24001, // strb r4, [r2], #1
+        0xE2433001, // sub r3, r3, #1
+        0xEAFFFFF8, // b head
+        // words:
+        0xE3530004, // cmp r3, #4
+        0x3A000002, // blo tail
+        0xE4824004, // str r4, [r2], #4
+        0xE2433004, // sub r3, r3, #4
+        0xEAFFFFFA, // b words
+        // tail:
+        0xE3530000, // cmp r3, #0
+        0x0AFFFFEE, // beq run
+        0xE4C24001, // strb r4, [r2], #1
+        0xE2433001, // sub r3, r3, #1
+        0xEAFFFFFA, // b tail
+        // done:
+        0xE3A00001, // mov r0, #1
+        0xE8BD8010  // pop {r4, pc}
+        // params:
+    };
+
+/**
+    @brief Runs a routine on the device
+    
+    The routine, its IVT and its parameters go in one 
+    CMD_WRITE_FILE. The boot data marks it as a plugin so 
+    the ROM calls it and goes back to waiting for commands 
+    when it returns.
+    
+    @param device the HID device
+    @param routine Where to put it, must be free IRAM
+    @param code The routine, must be position independent
+    @param code_size Size of code, a multiple of 4
+    @param params Parameters to put right after the code
+    @param params_size Size of params
+    
+    @return Zero on success, error code otherwise
+**/
+int imx50_run_routine(imx50_device_t *device, device_addr_t routine, const uint32_t *code, unsigned int code_size, const void *params, unsigned int params_size) {
+    unsigned char blob[ROM_TRANSFER_SIZE];
+    ivt_t *ivt_header = (ivt_t*)blob;
+    boot_data_t *boot_data = (boot_data_t*)(blob + sizeof(ivt_t));
+    unsigned int size = ROUTINE_CODE_OFFSET + code_size + params_size;
+    int ret;
+    
+    SPAN_BEGIN_ARG("routine", routine);
+    if(size > sizeof(blob)) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Routine too big: %u [%s:%d]\n", __FUNCTION__, size, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    memset(blob, 0, sizeof(blob));
+    ivt_header->header = IVT_BARKER_HEADER;
+    ivt_header->entry_address = routine + ROUTINE_CODE_OFFSET;
+    ivt_header->boot_data_address = routine + sizeof(ivt_t);
+    ivt_header->self_address = routine;
+    boot_data->start_address = routine;
+    boot_data->size = size;
+    boot_data->plugin_flag = 1;
+    memcpy(blob + ROUTINE_CODE_OFFSET, code, code_size);
+    memcpy(blob + ROUTINE_CODE_OFFSET + code_size, params, params_size);
+    
+    if((ret = imx50_write_memory(device, routine, blob, size)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot load routine to %#08X [%s:%d]\n", __FUNCTION__, routine, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    if((ret = imx50_jump(device, routine)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot run routine at %#08X [%s:%d]\n", __FUNCTION__, routine, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    // it wrote its own memory
+    imx50_invalidate_shadow(device, routine, ROUTINE_MAX_SIZE);
+    
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Computes a CRC32 on the host
+    
+    Same CRC as zlib's crc32(), pass zero to start and the 
+    last return value to continue.
+    
+    @param crc CRC so far
+    @param data Data to add
+    @param size Size of data
+    
+    @return The new CRC
+**/
+IMX50USB_EXPORT unsigned int imx50_crc32(unsigned int crc, const unsigned char *data, unsigned int size) {
+    static uint32_t table[256];
+    static int table_ready = 0;
+    unsigned int i, j, c;
+    
+    if(!table_ready) {
+        for(i = 0; i < 256; i++) {
+            for(c = i, j = 0; j < 8; j++) {
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+    
+    crc = ~crc;
+    while(size--) {
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+    @brief Computes CRC32s of device memory on the device
+    
+    Only the checksums come back over USB, one report for 
+    every 16 blocks.
+    
+    @param device the HID device
+    @param routine Free IRAM for the routine, ROUTINE_MAX_SIZE bytes
+    @param address Memory to check
+    @param size Bytes to check
+    @param block_size Bytes per CRC, the last block may be shorter
+    @param crcs Gets one CRC per block, at most VERIFY_MAX_BLOCKS
+    
+    @see imx50_crc32
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_device_crc(imx50_device_t *device, device_addr_t routine, device_addr_t address, unsigned int size, unsigned int block_size, unsigned int *crcs) {
+    uint32_t params[CRC_PARAMS_SIZE / sizeof(uint32_t)];
+    unsigned int blocks;
+    int ret;
+    
+    SPAN_BEGIN_ARG("address", address);
+    if(block_size == 0 || (blocks = (size + block_size - 1) / block_size) > VERIFY_MAX_BLOCKS) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Bad block size %u for %u bytes [%s:%d]\n", __FUNCTION__, block_size, size, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    params[0] = size;
+    params[1] = block_size;
+    params[2] = address;
+    
+    if((ret = imx50_run_routine(device, routine, crc_routine, sizeof(crc_routine), params, sizeof(params))) != 0) {
+        SPAN_END();
+        return ret;
+    }
+    if(blocks == 0) {
+        SPAN_END();
+        return 0;
+    }
+    
+    ret = imx50_read_memory(device, routine + ROUTINE_CODE_OFFSET + sizeof(crc_routine) + CRC_PARAMS_SIZE, (unsigned char*)crcs, blocks * sizeof(int));
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Loads a file and checks it with CRC32s
+    
+    The host side CRCs are worked out chunk by chunk as the 
+    file is sent, then the device works out its own with 
+    imx50_device_crc() and only those are read back. Much 
+    faster than reading the file back.
+    
+    @param device the HID device
+    @param address Where to load the file
+    @param filename The name of the file to load
+    @param verify Where to put the routine (ROUTINE_MAX_SIZE bytes 
+        that must not overlap the file) and the block size, gets 
+        the blocks that differ
+    
+    @see imx50_device_crc
+    @return Zero on success, ERROR_VERIFY if any block differs, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_load_file_crc(imx50_device_t *device, device_addr_t address, const char *filename, crc_verify_t *verify) {
+    unsigned char *data;
+    unsigned int size;
+    unsigned int offset;
+    unsigned int trans_size;
+    unsigned int block;
+    unsigned int done;
+    unsigned int host_crcs[VERIFY_MAX_BLOCKS];
+    unsigned int device_crcs[VERIFY_MAX_BLOCKS];
+    device_addr_t routine = verify->routine ? verify->routine : device->profile->routine;
+    int started;
+    int ret = 0;
+    
+    SPAN_BEGIN_ARG("address", address);
+    if((data = imx50_read_file(filename, &size)) == NULL) {
+        SPAN_END();
+        return ERROR_IO;
+    }
+    if(address < routine + ROUTINE_MAX_SIZE && routine < address + size) { // the routine would write over it
+        free(data);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:File overlaps the routine at %#08X [%s:%d]\n", __FUNCTION__, routine, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    
+    verify->blocks = 0;
+    verify->bad_count = 0;
+    if(verify->block_size == 0) { // as few blocks as fit, in whole ROM_TRANSFER_SIZE
+        verify->block_size = (size + VERIFY_MAX_BLOCKS - 1) / VERIFY_MAX_BLOCKS;
+        verify->block_size = (verify->block_size + ROM_TRANSFER_SIZE - 1) & ~(ROM_TRANSFER_SIZE - 1);
+        if(verify->block_size == 0) {
+            verify->block_size = ROM_TRANSFER_SIZE;
+        }
+    }
+    if((size + verify->block_size - 1) / verify->block_size > VERIFY_MAX_BLOCKS) {
+        free(data);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Block size %u too small for %u bytes [%s:%d]\n", __FUNCTION__, verify->block_size, size, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    
+    started = imx50_progress_begin(device, size);
+    for(offset = 0, block = 0; offset < size && ret == 0; offset += trans_size) {
+        trans_size = (size - offset > PLAN_CHUNK(device)) ? PLAN_CHUNK(device) : size - offset;
+        if((ret = imx50_write_memory(device, address + offset, data + offset, trans_size)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, address + offset, __FILE__, __LINE__);
+            break;
+        }
+        if(device->progress.cancel && offset + trans_size < size) {
+            ret = ERROR_CANCELLED;
+            break;
+        }
+        // checksum what was just sent, blocks can span chunks
+        for(done = 0; done < trans_size; ) {
+            unsigned int in_block = (offset + done) % verify->block_size;
+            unsigned int length = verify->block_size - in_block;
+            if(length > trans_size - done) {
+                length = trans_size - done;
+            }
+            block = (offset + done) / verify->block_size;
+            host_crcs[block] = imx50_crc32(in_block ? host_crcs[block] : 0, data + offset + done, length);
+            done += length;
+        }
+    }
+    imx50_progress_end(device, started);
+    free(data);
+    if(ret != 0) {
+        SPAN_END();
+        return ret;
+    }
+    
+    if((ret = imx50_device_crc(device, routine, address, size, verify->block_size, device_crcs)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot get CRCs from device [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    
+    verify->blocks = (size + verify->block_size - 1) / verify->block_size;
+    for(block = 0; block < verify->blocks; block++) {
+        if(host_crcs[block] != device_crcs[block]) {
+            if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:Block at %#08X differs, expected CRC %#08X, got %#08X [%s:%d]\n", __FUNCTION__, address + block * verify->block_size, host_crcs[block], device_crcs[block], __FILE__, __LINE__);
+            verify->bad[verify->bad_count++] = block;
+        }
+    }
+    
+    SPAN_END();
+    return verify->bad_count ? ERROR_VERIFY : 0;
+}
+
+/**
+    @brief Fills runs of device memory on the device
+    
+    @param device the HID device
+    @param routine Free IRAM for the routine, ROUTINE_MAX_SIZE bytes
+    @param params Count, then address, length, value for each run
+    
+    @return Zero on success, error code otherwise
+**/
+int imx50_fill_runs(imx50_device_t *device, device_addr_t routine, uint32_t *params) {
+    unsigned int i;
+    int ret;
+    
+    SPAN_BEGIN_ARG("runs", params[0]);
+    if(params[0] == 0) {
+        SPAN_END();
+        return 0;
+    }
+    if((ret = imx50_run_routine(device, routine, fill_routine, sizeof(fill_routine), params, (1 + params[0] * 3) * sizeof(uint32_t))) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot fill %u runs [%s:%d]\n", __FUNCTION__, params[0], __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+    for(i = 0; i < params[0]; i++) {
+        imx50_invalidate_shadow(device, params[1 + i * 3], params[2 + i * 3]);
+    }
+    params[0] = 0;
+    
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Loads a file, filling constant runs on the device
+    
+    Runs of one byte value at least min_run long (zeroed 
+    BSS, padding) are not sent. Everything else is sent with 
+    imx50_write_memory(), then a fill routine sets the runs, 
+    up to FILL_MAX_RUNS in each call.
+    
+    @param device the HID device
+    @param address Where to load the file
+    @param filename The name of the file to load
+    @param sparse Where to put the routine and the shortest run, gets the bytes saved
+    
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_load_file_sparse(imx50_device_t *device, device_addr_t address, const char *filename, sparse_load_t *sparse) {
+    unsigned char *data;
+    unsigned int size;
+    unsigned int offset;
+    unsigned int end;
+    unsigned int start;
+    unsigned int trans_size;
+    unsigned int min_run = sparse->min_run ? sparse->min_run : SPARSE_MIN_RUN;
+    uint32_t params[1 + FILL_MAX_RUNS * 3];
+    device_addr_t routine = sparse->routine ? sparse->routine : device->profile->routine;
+    int started;
+    int ret = 0;
+    
+    SPAN_BEGIN_ARG("address", address);
+    if((data = imx50_read_file(filename, &size)) == NULL) {
+        SPAN_END();
+        return ERROR_IO;
+    }
+    if(address < routine + ROUTINE_MAX_SIZE && routine < address + size) {
+        free(data);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:File overlaps the routine at %#08X [%s:%d]\n", __FUNCTION__, routine, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_PARAMETER;
+    }
+    
+    sparse->runs = 0;
+    sparse->sent = 0;
+    sparse->skipped = 0;
+    params[0] = 0;
+    started = imx50_progress_begin(device, size);
+    for(offset = 0, start = 0; offset <= size && ret == 0; offset = end) {
+        if(offset < size) {
+            for(end = offset + 1; end < size && data[end] == data[offset]; end++);
+            if(end - offset < min_run) {
+                continue;
+            }
+        } else { // send the rest
+            end = size + 1;
+        }
+        // send everything before the run
+        for(; start < offset && ret == 0; start += trans_size) {
+            trans_size = (offset - start > PLAN_CHUNK(device)) ? PLAN_CHUNK(device) : offset - start;
+            if((ret = imx50_write_memory(device, address + start, data + start, trans_size)) != 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, address + start, __FILE__, __LINE__);
+                break;
+            }
+            sparse->sent += trans_size;
+            if(device->progress.cancel && start + trans_size < size) {
+                ret = ERROR_CANCELLED;
+            }
+        }
+        if(ret != 0 || end > size) {
+            break;
+        }
+        // then queue the run
+        params[1 + params[0] * 3] = address + offset;
+        params[2 + params[0] * 3] = end - offset;
+        params[3 + params[0] * 3] = data[offset] * 0x01010101;
+        params[0]++;
+        sparse->runs++;
+        sparse->skipped += end - offset;
+        imx50_progress_update(device, end - offset);
+        if(params[0] == FILL_MAX_RUNS) {
+            ret = imx50_fill_runs(device, routine, params);
+        }
+        start = end;
+    }
+    if(ret == 0) {
+        ret = imx50_fill_runs(device, routine, params);
+    }
+    imx50_progress_end(device, started);
+    free(data);
+    
+    if(ret == 0 && IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Sent %u bytes, filled %u bytes in %u runs [%s:%d]\n", __FUNCTION__, sparse->sent, sparse->skipped, sparse->runs, __FILE__, __LINE__);
+    
+    SPAN_END();
+    return ret;
+}
@@ -0,0 +1,119 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// other i.MX parts whose ROM speaks the same SDP
+
+#include "imxusb_private.h"
+
+// the first one is used when the SoC is not known (replays)
+const soc_profile_t g_imx50_profiles[] =
+    {
+        {
+            "i.MX50",
+            { { IMX50_VID, IMX50_PID } },
+            REPORT_DATA_SIZE, REPORT_STATUS_SIZE,
+            MAX_DCD_WRITE_REG_CNT, // one data report
+            DCD_TRIPLES, 0,
+            MAX_DOWNLOAD_SIZE,
+            0xF8000000, 0x20000, // 128K IRAM
+            0x70000000, 0x80000000, // CSD0 and CSD1
+            DEFAULT_ROUTINE_ADDRESS
+        },
+        {
+            "i.MX53",
+            { { 0x15A2, 0x004E } },
+            REPORT_DATA_SIZE, REPORT_STATUS_SIZE,
+            MAX_DCD_BATCH_CNT, // 1768 byte DCD table
+            DCD_TABLE, 0xF8018000, // past the routine and write probes
+            MAX_DOWNLOAD_SIZE,
+            0xF8000000, 0x20000,
+            0x70000000, 0x80000000,
+            0xF8010000
+        },
+        {
+            "i.MX6",
+            { { 0x15A2, 0x0054 }, { 0x15A2, 0x0061 }, { 0x15A2, 0x0063 }, { 0x15A2, 0x0071 } }, // Q/D, DL/S, SL, SX
+            REPORT_DATA_SIZE, REPORT_STATUS_SIZE,
+            MAX_DCD_BATCH_CNT,
+            DCD_TABLE, 0x00918000,
+            MAX_DOWNLOAD_SIZE,
+            0x00900000, 0x20000, // OCRAM, the DL/S has the least
+            0x10000000, 0xF0000000, // MMDC
+            0x00910000
+        }
+    };
+
+/**
+    @brief Finds the profile of a SoC by its USB IDs
+
+    @param vendor_id USB vendor ID of the ROM
+    @param product_id USB product ID of the ROM
+
+    @return The profile, NULL if it is not a known SoC
+**/
+IMX50USB_EXPORT const soc_profile_t *imx50_find_profile(unsigned short vendor_id, unsigned short product_id) {
+    unsigned int i, j;
+
+    for(i = 0; i < sizeof(g_imx50_profiles) / sizeof(soc_profile_t); i++) {
+        for(j = 0; j < SOC_MAX_IDS && g_imx50_profiles[i].ids[j].vendor_id; j++) {
+            if(g_imx50_profiles[i].ids[j].vendor_id == vendor_id && g_imx50_profiles[i].ids[j].product_id == product_id) {
+                return &g_imx50_profiles[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+    @brief Gets the profile of the SoC a device was found as
+
+    @param device The device
+
+    @return The profile, i.MX50 for replays
+**/
+IMX50USB_EXPORT const soc_profile_t *imx50_get_profile(imx50_device_t *device) {
+    return device->profile;
+}
+
+/**
+    @brief Opens any known SoC
+
+    Tries every USB ID of every profile once.
+
+    @param transport How to open it
+    @param queue_depth Given to the transport
+    @param profile_p Gets the profile of what was found
+
+    @return The transport's context, NULL if nothing was
+        found
+ */
+void *imx50_open_any(const imx50_transport_t *transport, unsigned int queue_depth, const soc_profile_t **profile_p) {
+    void *context;
+    unsigned int i, j;
+
+    for(i = 0; i < sizeof(g_imx50_profiles) / sizeof(soc_profile_t); i++) {
+        for(j = 0; j < SOC_MAX_IDS && g_imx50_profiles[i].ids[j].vendor_id; j++) {
+            if((context = transport->open(g_imx50_profiles[i].ids[j].vendor_id, g_imx50_profiles[i].ids[j].product_id, queue_depth)) != NULL) {
+                if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:Found %s (%04hX:%04hX) [%s:%d]\n", __FUNCTION__, g_imx50_profiles[i].name, g_imx50_profiles[i].ids[j].vendor_id, g_imx50_profiles[i].ids[j].product_id, __FILE__, __LINE__);
+                *profile_p = &g_imx50_profiles[i];
+                return context;
+            }
+        }
+    }
+    return NULL;
+}
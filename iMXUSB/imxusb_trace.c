@@ -0,0 +1,147 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// timeline of library calls in Chrome trace JSON, for chrome://tracing or ui.perfetto.dev
+
+#include "imxusb_private.h"
+
+struct imx50_trace {
+    FILE *fp;
+    uint64_t start;
+    unsigned int events;
+    unsigned int depth;     // spans begun but not ended
+};
+
+imx50_trace_t *g_imx50_trace = NULL;
+
+/**
+    @brief Writes one event
+
+    @param phase "B" to begin a span, "E" to end one
+ */
+void imx50_trace_event(const char *phase, const char *name, const char *arg_name, unsigned int arg) {
+    imx50_trace_t *trace = g_imx50_trace;
+
+    fprintf(trace->fp, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":1,\"tid\":1",
+        trace->events ? "," : "", name, phase, (unsigned long long)(imx50_time_us() - trace->start));
+    if(arg_name) {
+        fprintf(trace->fp, ",\"args\":{\"%s\":\"%#X\"}", arg_name, arg);
+    }
+    fputc('}', trace->fp);
+    trace->events++;
+}
+
+/**
+    @brief Starts recording a timeline
+
+    Every library call after this (opening the device, each
+    report, waits and sleeps) is written to filename as a
+    span in Chrome trace JSON. Spans nest, so a load shows
+    the commands and reports it is made of. The library
+    must only be used from one thread while tracing.
+
+    @param filename Where to write the trace
+
+    @see imx50_stop_trace
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_start_trace(const char *filename) {
+    imx50_trace_t *trace;
+
+    if(g_imx50_trace) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Already tracing [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    trace = malloc(sizeof(imx50_trace_t));
+    if(!trace) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memset(trace, 0, sizeof(imx50_trace_t));
+    trace->fp = fopen(filename, "w");
+    if(!trace->fp) {
+        free(trace);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot access %s [%s:%d]\n", __FUNCTION__, filename, __FILE__, __LINE__);
+        return ERROR_IO;
+    }
+    fprintf(trace->fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace->start = imx50_time_us();
+    g_imx50_trace = trace;
+
+    return 0;
+}
+
+/**
+    @brief Stops recording and finishes the file
+
+    Spans still open are ended now.
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_stop_trace() {
+    imx50_trace_t *trace = g_imx50_trace;
+    int ret = 0;
+
+    if(!trace) {
+        return 0;
+    }
+    while(trace->depth > 0) {
+        imx50_span_end("(unfinished)");
+    }
+    fprintf(trace->fp, "\n]}\n");
+    if(ferror(trace->fp) || fclose(trace->fp) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write the trace [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        ret = ERROR_IO;
+    }
+    g_imx50_trace = NULL;
+    free(trace);
+
+    return ret;
+}
+
+/**
+    @brief Begins a span on the timeline
+
+    Library functions call this through SPAN_BEGIN(). Users
+    can add their own spans, like one per station cycle.
+
+    @param name Shown on the span
+    @param arg_name Name of a value shown with the span,
+        NULL for none
+    @param arg The value
+**/
+IMX50USB_EXPORT void imx50_span_begin(const char *name, const char *arg_name, unsigned int arg) {
+    if(!g_imx50_trace) {
+        return;
+    }
+    imx50_trace_event("B", name, arg_name, arg);
+    g_imx50_trace->depth++;
+}
+
+/**
+    @brief Ends the last span begun
+
+    @param name Same as given to imx50_span_begin()
+**/
+IMX50USB_EXPORT void imx50_span_end(const char *name) {
+    if(!g_imx50_trace || g_imx50_trace->depth == 0) {
+        return;
+    }
+    imx50_trace_event("E", name, NULL, 0);
+    g_imx50_trace->depth--;
+}
@@ -0,0 +1,464 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// reading back what was written to the device
+
+#include "imxusb_private.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VERIFY_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define VERIFY_NEON
+#endif
+
+// one register to compare
+typedef struct imx50_dcd_check {
+    device_addr_t address;
+    unsigned int width;         // in bytes
+    unsigned int expected;
+    unsigned int mask;
+    unsigned int order;         // position in the table, the last write wins
+} imx50_dcd_check_t;
+
+// a read chunk being compared as its reports arrive
+typedef struct imx50_read_check {
+    device_addr_t address;      // of the chunk
+    const unsigned char *expected;
+    const unsigned char *actual;
+    unsigned int merge_gap;
+    read_verify_t *verify;
+} imx50_read_check_t;
+
+/**
+    @brief Sorts registers by address, then by when they
+    were written
+ */
+int imx50_dcd_check_compare(const void *a, const void *b) {
+    const imx50_dcd_check_t *x = a;
+    const imx50_dcd_check_t *y = b;
+
+    if(x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+/**
+    @brief Compares registers against one read span
+
+    @param checks Registers inside the span
+    @param count Number of registers
+    @param start Device address of data
+    @param data What was read
+    @param verify Gets the mismatches
+ */
+void imx50_dcd_compare(const imx50_dcd_check_t *checks, unsigned int count, device_addr_t start, const unsigned char *data, dcd_verify_t *verify) {
+    const unsigned char *p;
+    unsigned int actual;
+    unsigned int i, j;
+
+    for(i = 0; i < count; i++) {
+        p = data + (checks[i].address - start);
+        actual = 0;
+        for(j = checks[i].width; j > 0; j--) {
+            actual = (actual << 8) | p[j - 1]; // the device is little-endian
+        }
+        verify->checked++;
+        if((actual & checks[i].mask) == (checks[i].expected & checks[i].mask)) {
+            continue;
+        }
+        if(IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:%0#8X is %0#8X, wrote %0#8X (mask %0#8X) [%s:%d]\n", __FUNCTION__, checks[i].address, actual, checks[i].expected, checks[i].mask, __FILE__, __LINE__);
+        if(verify->bad_count < DCD_VERIFY_MAX_BAD) {
+            verify->bad[verify->bad_count].address = checks[i].address;
+            verify->bad[verify->bad_count].expected = checks[i].expected;
+            verify->bad[verify->bad_count].actual = actual;
+            verify->bad[verify->bad_count].mask = checks[i].mask;
+        }
+        verify->bad_count++;
+    }
+}
+
+/**
+    @brief Checks that registers hold what a DCD table wrote
+
+    Reading one register at a time costs a round trip each,
+    so the registers are sorted and read back in as few
+    spans as possible. Registers closer than max_gap bytes
+    share a span, which also reads the registers between
+    them, so keep max_gap small near registers that change
+    when read (FIFOs, clear on read status).
+
+    If a register is written more than once, the last
+    value is expected. Bits outside the register's mask,
+    like self-clearing or status bits, are not compared.
+    Call this after the table was sent, with imx50_dcd_write()
+    or the write queue.
+
+    @param device The device
+    @param buffer The DCD table that was written
+    @param count Number of entries
+    @param verify Masks to use and gets the results
+
+    @see imx50_kindle_verify
+    @return Zero if every register matches, ERROR_VERIFY if
+        some do not, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_dcd_verify(imx50_device_t *device, const dcd_t *buffer, unsigned int count, dcd_verify_t *verify) {
+    imx50_dcd_check_t *checks;
+    unsigned char *data;
+    unsigned int max_gap;
+    unsigned int total = 0;
+    unsigned int i, j, k, first;
+    device_addr_t start, end;
+    int ret = 0;
+
+    SPAN_BEGIN_ARG("count", count);
+    max_gap = verify->max_gap ? verify->max_gap : DCD_VERIFY_GAP;
+    verify->checked = 0;
+    verify->reads = 0;
+    verify->bad_count = 0;
+    if(count == 0) {
+        SPAN_END();
+        return 0;
+    }
+    if((checks = malloc(count * sizeof(imx50_dcd_check_t))) == NULL) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_OUT_OF_MEMORY;
+    }
+
+    // what each register should hold
+    for(i = 0; i < count; i++) {
+        if(buffer[i].data_format != 8 && buffer[i].data_format != 16 && buffer[i].data_format != 32) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Invalid data format %u at %0#8X [%s:%d]\n", __FUNCTION__, buffer[i].data_format, buffer[i].address, __FILE__, __LINE__);
+            free(checks);
+            SPAN_END();
+            return ERROR_PARAMETER;
+        }
+        checks[total].address = buffer[i].address;
+        checks[total].width = buffer[i].data_format / 8;
+        checks[total].expected = buffer[i].value;
+        checks[total].mask = (buffer[i].data_format == 32) ? 0xFFFFFFFF : (1u << buffer[i].data_format) - 1;
+        checks[total].order = i;
+        for(j = 0; j < verify->mask_count; j++) {
+            if(verify->masks[j].address == buffer[i].address) {
+                checks[total].mask &= verify->masks[j].mask;
+            }
+        }
+        total++;
+    }
+    qsort(checks, total, sizeof(imx50_dcd_check_t), imx50_dcd_check_compare);
+
+    // keep the last write to each address and drop what is not compared
+    for(i = 0, j = 0; i < total; i++) {
+        if(i + 1 < total && checks[i + 1].address == checks[i].address) {
+            continue;
+        }
+        if(checks[i].mask != 0) {
+            checks[j++] = checks[i];
+        }
+    }
+    total = j;
+
+    // read a span at a time
+    for(first = 0; first < total && ret == 0; first = k) {
+        start = checks[first].address & ~3; // words, like the ROM reads them
+        end = checks[first].address + checks[first].width;
+        for(k = first + 1; k < total; k++) {
+            if(checks[k].address > end + max_gap || checks[k].address + checks[k].width - start > MAX_DOWNLOAD_SIZE) {
+                break;
+            }
+            if(checks[k].address + checks[k].width > end) {
+                end = checks[k].address + checks[k].width;
+            }
+        }
+        end = (end + 3) & ~3;
+        if((data = malloc(end - start)) == NULL) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+            ret = ERROR_OUT_OF_MEMORY;
+            break;
+        }
+        if((ret = imx50_read_memory(device, start, data, end - start)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read %u bytes at %0#8X [%s:%d]\n", __FUNCTION__, end - start, start, __FILE__, __LINE__);
+        } else {
+            verify->reads++;
+            imx50_dcd_compare(&checks[first], k - first, start, data, verify);
+        }
+        free(data);
+    }
+    free(checks);
+
+    if(ret == 0 && verify->bad_count > 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%u of %u registers do not match [%s:%d]\n", __FUNCTION__, verify->bad_count, verify->checked, __FILE__, __LINE__);
+        ret = ERROR_VERIFY;
+    }
+    if(ret == 0 && IS_LOGGING(DEBUG_LOG)) TRACE("[%s] D:%u registers match, %u reads [%s:%d]\n", __FUNCTION__, verify->checked, verify->reads, __FILE__, __LINE__);
+
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Finds the first byte that differs
+
+    Compares a report's worth (64 bytes) at a time with 
+    SSE2 or NEON when built for them, a word at a time 
+    otherwise, so checking keeps up with USB.
+
+    @return Offset of the byte, size if all match
+ */
+unsigned int imx50_first_diff(const unsigned char *a, const unsigned char *b, unsigned int size) {
+    unsigned int i = 0;
+    uint64_t x, y;
+#if defined(VERIFY_SSE2)
+    __m128i diff;
+
+    for(; i + 64 <= size; i += 64) {
+        diff = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))),
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)))),
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32))),
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+            break; // find the byte below
+        }
+    }
+#elif defined(VERIFY_NEON)
+    uint64x2_t diff;
+
+    for(; i + 64 <= size; i += 64) {
+        diff = vreinterpretq_u64_u8(vorrq_u8(
+            vorrq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16))),
+            vorrq_u8(veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32)), veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48)))));
+        if((vgetq_lane_u64(diff, 0) | vgetq_lane_u64(diff, 1)) != 0) {
+            break;
+        }
+    }
+#endif
+
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        memcpy(&x, a + i, sizeof(uint64_t));
+        memcpy(&y, b + i, sizeof(uint64_t));
+        if(x != y) {
+            break;
+        }
+    }
+    for(; i < size && a[i] == b[i]; i++);
+
+    return i;
+}
+
+/**
+    @brief Finds the end of a run of bytes that differ
+
+    @return Offset of the first byte that matches, size if 
+        none do
+ */
+unsigned int imx50_first_same(const unsigned char *a, const unsigned char *b, unsigned int size) {
+    unsigned int i;
+
+    for(i = 0; i < size && a[i] != b[i]; i++);
+    return i;
+}
+
+/**
+    @brief Adds bytes that differ to the list of ranges
+
+    Ranges closer than merge_gap are joined, and once the 
+    list is full the last range grows to cover the rest, 
+    so rewriting the list always covers every bad byte.
+ */
+void imx50_add_range(read_verify_t *verify, device_addr_t address, unsigned int size, unsigned int merge_gap) {
+    verify_range_t *last = verify->range_count ? &verify->ranges[verify->range_count - 1] : NULL;
+
+    verify->bad_bytes += size;
+    if(last && (address - (last->address + last->size) <= merge_gap || verify->range_count == VERIFY_MAX_RANGES)) {
+        last->size = address + size - last->address;
+        return;
+    }
+    verify->ranges[verify->range_count].address = address;
+    verify->ranges[verify->range_count].size = size;
+    verify->range_count++;
+}
+
+/**
+    @brief Compares a report as soon as it is read
+
+    Called by imx50_read_memory_each(), so checking is done
+    while the next report is on its way.
+ */
+void imx50_read_check(void *context, unsigned int offset, unsigned int size) {
+    imx50_read_check_t *check = context;
+    unsigned int end = offset + size;
+    unsigned int length;
+
+    while(offset < end) {
+        offset += imx50_first_diff(check->expected + offset, check->actual + offset, end - offset);
+        if(offset == end) {
+            break;
+        }
+        length = imx50_first_same(check->expected + offset, check->actual + offset, end - offset);
+        imx50_add_range(check->verify, check->address + offset, length, check->merge_gap);
+        offset += length;
+    }
+}
+
+/**
+    @brief Reads device memory back and compares it
+
+    Each report is compared against data as it arrives, so 
+    the compare costs no time on top of the read. Bytes 
+    that differ are kept as a short list of ranges. With 
+    rewrite set, only those ranges are written again and 
+    read back once more.
+
+    @param device The device
+    @param address Where data was written
+    @param data What should be there
+    @param size Size of data
+    @param verify Settings, gets the ranges that differ
+
+    @see imx50_load_file_verify
+    @return Zero if everything matches (after rewriting, 
+        if set), ERROR_VERIFY if not, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_verify_memory(imx50_device_t *device, device_addr_t address, const unsigned char *data, unsigned int size, read_verify_t *verify) {
+    imx50_read_check_t check;
+    read_verify_t again;
+    unsigned char *buffer;
+    unsigned int offset;
+    unsigned int trans_size;
+    unsigned int i;
+    int started;
+    int ret = 0;
+
+    SPAN_BEGIN_ARG("address", address);
+    verify->bad_bytes = 0;
+    verify->range_count = 0;
+    verify->rewritten = 0;
+    if((buffer = malloc(size < MAX_DOWNLOAD_SIZE ? size : MAX_DOWNLOAD_SIZE)) == NULL && size > 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        SPAN_END();
+        return ERROR_OUT_OF_MEMORY;
+    }
+    check.merge_gap = verify->merge_gap ? verify->merge_gap : VERIFY_MERGE_GAP;
+    check.actual = buffer;
+    check.verify = verify;
+
+    started = imx50_progress_begin(device, size);
+    for(offset = 0; offset < size && ret == 0; offset += trans_size) {
+        trans_size = (size - offset > MAX_DOWNLOAD_SIZE) ? MAX_DOWNLOAD_SIZE : size - offset;
+        check.address = address + offset;
+        check.expected = data + offset;
+        if((ret = imx50_read_memory_each(device, address + offset, buffer, trans_size, imx50_read_check, &check)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read back %u bytes at %#X [%s:%d]\n", __FUNCTION__, trans_size, address + offset, __FILE__, __LINE__);
+            break;
+        }
+        if(device->progress.cancel && offset + trans_size < size) {
+            ret = ERROR_CANCELLED;
+        }
+    }
+    imx50_progress_end(device, started);
+    free(buffer);
+    if(ret != 0) {
+        SPAN_END();
+        return ret;
+    }
+    if(verify->range_count == 0) {
+        SPAN_END();
+        return 0;
+    }
+
+    for(i = 0; i < verify->range_count; i++) {
+        if(IS_LOGGING(WARNING_LOG)) TRACE("[%s] W:%u bytes at %#08X differ [%s:%d]\n", __FUNCTION__, verify->ranges[i].size, verify->ranges[i].address, __FILE__, __LINE__);
+    }
+    if(!verify->rewrite) {
+        SPAN_END();
+        return ERROR_VERIFY;
+    }
+
+    // only what differs goes out again
+    memset(&again, 0, sizeof(read_verify_t));
+    again.merge_gap = verify->merge_gap;
+    for(i = 0; i < verify->range_count && ret == 0; i++) {
+        offset = verify->ranges[i].address - address;
+        if((ret = imx50_write_memory(device, verify->ranges[i].address, (unsigned char*)data + offset, verify->ranges[i].size)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, verify->ranges[i].address, __FILE__, __LINE__);
+            break;
+        }
+        verify->rewritten += verify->ranges[i].size;
+        if((ret = imx50_verify_memory(device, verify->ranges[i].address, data + offset, verify->ranges[i].size, &again)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%u bytes at %#08X still differ [%s:%d]\n", __FUNCTION__, again.bad_bytes, verify->ranges[i].address, __FILE__, __LINE__);
+        }
+    }
+
+    SPAN_END();
+    return ret;
+}
+
+/**
+    @brief Loads a file and reads it back to check it
+
+    Slower than imx50_load_file_crc() as every byte comes 
+    back over USB, but needs no routine on the device and 
+    says exactly which bytes differ.
+
+    @param device The device
+    @param address Where to load the file
+    @param filename The name of the file to load
+    @param verify Settings, gets the ranges that differ
+
+    @see imx50_verify_memory
+    @return Zero if the file is on the device, ERROR_VERIFY 
+        if parts of it differ, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_load_file_verify(imx50_device_t *device, device_addr_t address, const char *filename, read_verify_t *verify) {
+    unsigned char *data;
+    unsigned int size;
+    unsigned int offset;
+    unsigned int trans_size;
+    int started;
+    int ret = 0;
+
+    SPAN_BEGIN_ARG("address", address);
+    if((data = imx50_read_file(filename, &size)) == NULL) {
+        SPAN_END();
+        return ERROR_IO;
+    }
+
+    started = imx50_progress_begin(device, 2 * size); // there and back
+    for(offset = 0; offset < size && ret == 0; offset += trans_size) {
+        trans_size = (size - offset > PLAN_CHUNK(device)) ? PLAN_CHUNK(device) : size - offset;
+        if((ret = imx50_write_memory(device, address + offset, data + offset, trans_size)) != 0) {
+            if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Error writing to device at %#X [%s:%d]\n", __FUNCTION__, address + offset, __FILE__, __LINE__);
+            break;
+        }
+        if(device->progress.cancel) {
+            ret = ERROR_CANCELLED;
+        }
+    }
+    if(ret == 0) {
+        ret = imx50_verify_memory(device, address, data, size, verify);
+    }
+    imx50_progress_end(device, started);
+    free(data);
+
+    SPAN_END();
+    return ret;
+}
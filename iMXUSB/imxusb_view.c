@@ -0,0 +1,495 @@
+//
+//  iMX50 USB Library
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// cached view of device memory, small reads and writes become big transfers
+
+#include "imxusb_private.h"
+
+// pages cached per view (direct mapped)
+#define VIEW_CACHE_PAGES        256
+#define VIEW_INDEX(x)           ( ((x) / VIEW_PAGE_SIZE) & (VIEW_CACHE_PAGES - 1) )
+#define VIEW_PAGE(x)            ( (x) & ~(VIEW_PAGE_SIZE - 1) )
+#define VIEW_IS_DIRTY(p,i)      ( (p)->dirty_mask[(i) / 8] & (1 << ((i) % 8)) )
+
+// a cached page
+typedef struct {
+    device_addr_t address;
+    int valid;              // data was read from the device
+    int dirty;              // some bytes were written and not sent
+    unsigned char dirty_mask[VIEW_PAGE_SIZE / 8];
+    unsigned char data[VIEW_PAGE_SIZE];
+} imx50_view_page_t;
+
+struct imx50_view {
+    imx50_device_t *device;
+    device_addr_t address;
+    unsigned int size;
+    unsigned int read_ahead;    // pages read on a miss
+    unsigned char *buffer;      // MAX_DOWNLOAD_SIZE, for reads and merged writes
+    imx50_view_page_t pages[VIEW_CACHE_PAGES];
+};
+
+/**
+    @brief Opens a cached view of device memory
+
+    Reads fetch whole pages, read_ahead at a time, and
+    writes stay on the host until imx50_view_flush(). Only
+    use it on memory, reading ahead of registers can have
+    side effects. Anything else that writes the same memory
+    should be followed by imx50_view_invalidate().
+
+    @param device the HID device
+    @param address Start of the memory
+    @param size Size of the memory
+    @param read_ahead Pages to read on a miss, zero for VIEW_READ_AHEAD
+
+    @see imx50_close_view
+    @return The view, NULL on error
+**/
+IMX50USB_EXPORT imx50_view_t *imx50_open_view(imx50_device_t *device, device_addr_t address, unsigned int size, unsigned int read_ahead) {
+    imx50_view_t *view;
+
+    if(size == 0 || address + size - 1 < address) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Bad range %#08X size %#X [%s:%d]\n", __FUNCTION__, address, size, __FILE__, __LINE__);
+        return NULL;
+    }
+    view = malloc(sizeof(imx50_view_t));
+    if(!view) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(view, 0, sizeof(imx50_view_t));
+    view->buffer = malloc(MAX_DOWNLOAD_SIZE);
+    if(!view->buffer) {
+        free(view);
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Out of memory [%s:%d]\n", __FUNCTION__, __FILE__, __LINE__);
+        return NULL;
+    }
+    view->device = device;
+    view->address = address;
+    view->size = size;
+    view->read_ahead = read_ahead ? read_ahead : VIEW_READ_AHEAD;
+    if(view->read_ahead > VIEW_CACHE_PAGES) {
+        view->read_ahead = VIEW_CACHE_PAGES;
+    }
+
+    return view;
+}
+
+/**
+    @brief Finds a page in the cache
+
+    @param view The view
+    @param page Address of the page
+
+    @return The page if it is cached, NULL otherwise
+ */
+imx50_view_page_t *imx50_view_lookup(imx50_view_t *view, device_addr_t page) {
+    imx50_view_page_t *slot = &view->pages[VIEW_INDEX(page)];
+
+    if(slot->address != page || !(slot->valid || slot->dirty)) {
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+    @brief Checks if two dirty runs can be sent as one
+
+    They can if the bytes between them are cached and the
+    gap is small enough that sending it is cheaper than
+    another command.
+
+    @param view The view
+    @param from End of the first run
+    @param to Start of the second run
+    @param total Size of the merged transfer
+
+    @return One if the gap can be filled, zero otherwise
+ */
+int imx50_view_can_merge(imx50_view_t *view, device_addr_t from, device_addr_t to, unsigned int total) {
+    device_addr_t page;
+    imx50_view_page_t *slot;
+
+    if(total > MAX_DOWNLOAD_SIZE || to - from > VIEW_MERGE_GAP) {
+        return 0;
+    }
+    for(page = VIEW_PAGE(from); from < to && page < to; page += VIEW_PAGE_SIZE) {
+        if((slot = imx50_view_lookup(view, page)) == NULL || !slot->valid) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+    @brief Sends the dirty bytes of pages
+
+    Runs next to each other, or close enough with cached
+    bytes between them, are sent in one CMD_WRITE_FILE.
+
+    @param view The view
+    @param list Dirty pages, sorted by address
+    @param count Number of pages
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_view_write_pages(imx50_view_t *view, imx50_view_page_t **list, unsigned int count) {
+    device_addr_t start = 0;
+    device_addr_t address;
+    device_addr_t gap;
+    unsigned int length = 0;
+    unsigned int n, i, j;
+    int ret;
+
+    for(n = 0; n < count; n++) {
+        for(i = 0; i < VIEW_PAGE_SIZE; i = j) {
+            if(!VIEW_IS_DIRTY(list[n], i)) {
+                j = i + 1;
+                continue;
+            }
+            for(j = i; j < VIEW_PAGE_SIZE && VIEW_IS_DIRTY(list[n], j); j++);
+            address = list[n]->address + i;
+
+            if(length > 0 && !imx50_view_can_merge(view, start + length, address, address + (j - i) - start)) {
+                if((ret = imx50_write_memory(view->device, start, view->buffer, length)) != 0) {
+                    return ret;
+                }
+                length = 0;
+            }
+            if(length == 0) {
+                start = address;
+            }
+            // fill the gap from the cache
+            for(gap = start + length; gap < address; gap++) {
+                view->buffer[gap - start] = imx50_view_lookup(view, VIEW_PAGE(gap))->data[gap % VIEW_PAGE_SIZE];
+            }
+            memcpy(view->buffer + (address - start), list[n]->data + i, j - i);
+            length = address + (j - i) - start;
+        }
+    }
+    if(length > 0 && (ret = imx50_write_memory(view->device, start, view->buffer, length)) != 0) {
+        return ret;
+    }
+
+    for(n = 0; n < count; n++) {
+        list[n]->dirty = 0;
+        memset(list[n]->dirty_mask, 0, sizeof(list[n]->dirty_mask));
+    }
+    return 0;
+}
+
+/**
+    @brief Makes a slot ready to hold a page
+
+    Writes back the page already there if it is dirty.
+
+    @param view The view
+    @param page Address of the page
+
+    @return The slot, NULL on error
+ */
+imx50_view_page_t *imx50_view_claim(imx50_view_t *view, device_addr_t page) {
+    imx50_view_page_t *slot = &view->pages[VIEW_INDEX(page)];
+
+    if(slot->address == page) {
+        return slot;
+    }
+    if(slot->dirty && imx50_view_write_pages(view, &slot, 1) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write back page %#08X [%s:%d]\n", __FUNCTION__, slot->address, __FILE__, __LINE__);
+        return NULL;
+    }
+    slot->address = page;
+    slot->valid = 0;
+    slot->dirty = 0;
+    memset(slot->dirty_mask, 0, sizeof(slot->dirty_mask));
+
+    return slot;
+}
+
+/**
+    @brief Reads a page and the ones after it
+
+    Read ahead stops at the end of the view, at a page that
+    is already read, or at a slot holding another dirty page.
+
+    @param view The view
+    @param page Address of the page that missed
+
+    @return Zero on success, error code otherwise
+ */
+int imx50_view_fill(imx50_view_t *view, device_addr_t page) {
+    imx50_view_page_t *slot;
+    device_addr_t first = (page < view->address) ? view->address : page;
+    device_addr_t last = view->address + view->size - 1;
+    device_addr_t end_page = page;
+    device_addr_t next;
+    unsigned int length;
+    unsigned int from, to;
+    unsigned int n;
+    int ret;
+
+    if(imx50_view_claim(view, page) == NULL) {
+        return ERROR_WRITE;
+    }
+    for(n = 1; n < view->read_ahead && end_page != VIEW_PAGE(last); n++) {
+        next = end_page + VIEW_PAGE_SIZE;
+        slot = &view->pages[VIEW_INDEX(next)];
+        if(slot->address == next ? slot->valid : slot->dirty) {
+            break;
+        }
+        end_page = next;
+    }
+    length = ((end_page == VIEW_PAGE(last)) ? last : end_page + VIEW_PAGE_SIZE - 1) - first + 1;
+
+    if((ret = imx50_read_memory(view->device, first, view->buffer, length)) != 0) {
+        return ret;
+    }
+    for(next = page; ; next += VIEW_PAGE_SIZE) {
+        slot = imx50_view_claim(view, next); // clean or already this page
+        from = (next < first) ? first - next : 0;
+        to = (next == end_page) ? first + length - 1 - next + 1 : VIEW_PAGE_SIZE;
+        for(; from < to; from++) { // keep what was written
+            if(!VIEW_IS_DIRTY(slot, from)) {
+                slot->data[from] = view->buffer[next + from - first];
+            }
+        }
+        slot->valid = 1;
+        if(next == end_page) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+    @brief Checks that a range is in the view
+
+    @return Zero if it is, ERROR_PARAMETER otherwise
+ */
+int imx50_view_check(imx50_view_t *view, device_addr_t address, unsigned int count) {
+    if(address < view->address || address - view->address > view->size || count > view->size - (address - view->address)) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:%#08X size %#X is outside the view [%s:%d]\n", __FUNCTION__, address, count, __FILE__, __LINE__);
+        return ERROR_PARAMETER;
+    }
+    return 0;
+}
+
+/**
+    @brief Reads through the view
+
+    Only misses go to the device.
+
+    @param view The view
+    @param address Where to read
+    @param buffer Gets the data
+    @param count Bytes to read
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_view_read(imx50_view_t *view, device_addr_t address, unsigned char *buffer, unsigned int count) {
+    imx50_view_page_t *slot;
+    unsigned int offset;
+    unsigned int length;
+    int ret;
+
+    if((ret = imx50_view_check(view, address, count)) != 0) {
+        return ret;
+    }
+    while(count > 0) {
+        offset = address % VIEW_PAGE_SIZE;
+        length = (count > VIEW_PAGE_SIZE - offset) ? VIEW_PAGE_SIZE - offset : count;
+        slot = imx50_view_lookup(view, VIEW_PAGE(address));
+        if(slot == NULL || !slot->valid) {
+            if((ret = imx50_view_fill(view, VIEW_PAGE(address))) != 0) {
+                if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot read page %#08X [%s:%d]\n", __FUNCTION__, VIEW_PAGE(address), __FILE__, __LINE__);
+                return ret;
+            }
+            slot = imx50_view_lookup(view, VIEW_PAGE(address));
+        }
+        memcpy(buffer, slot->data + offset, length);
+        buffer += length;
+        address += length;
+        count -= length;
+    }
+
+    return 0;
+}
+
+/**
+    @brief Writes through the view
+
+    Nothing is sent until imx50_view_flush(), or until a
+    dirty page has to make room for another.
+
+    @param view The view
+    @param address Where to write
+    @param buffer The data
+    @param count Bytes to write
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_view_write(imx50_view_t *view, device_addr_t address, const unsigned char *buffer, unsigned int count) {
+    imx50_view_page_t *slot;
+    unsigned int offset;
+    unsigned int length;
+    unsigned int i;
+    int ret;
+
+    if((ret = imx50_view_check(view, address, count)) != 0) {
+        return ret;
+    }
+    while(count > 0) {
+        offset = address % VIEW_PAGE_SIZE;
+        length = (count > VIEW_PAGE_SIZE - offset) ? VIEW_PAGE_SIZE - offset : count;
+        if((slot = imx50_view_claim(view, VIEW_PAGE(address))) == NULL) {
+            return ERROR_WRITE;
+        }
+        memcpy(slot->data + offset, buffer, length);
+        for(i = offset; i < offset + length; i++) {
+            slot->dirty_mask[i / 8] |= 1 << (i % 8);
+        }
+        slot->dirty = 1;
+        buffer += length;
+        address += length;
+        count -= length;
+    }
+
+    return 0;
+}
+
+/**
+    @brief Reads a word through the view
+
+    @param view The view
+    @param address Where to read
+    @param value_p Gets the word
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_view_peek(imx50_view_t *view, device_addr_t address, unsigned int *value_p) {
+    unsigned char data[4];
+    int ret;
+
+    if((ret = imx50_view_read(view, address, data, sizeof(data))) != 0) {
+        return ret;
+    }
+    *value_p = data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+
+    return 0;
+}
+
+/**
+    @brief Writes a word through the view
+
+    @param view The view
+    @param address Where to write
+    @param value The word
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_view_poke(imx50_view_t *view, device_addr_t address, unsigned int value) {
+    unsigned char data[4];
+
+    data[0] = (unsigned char)value;
+    data[1] = (unsigned char)(value >> 8);
+    data[2] = (unsigned char)(value >> 16);
+    data[3] = (unsigned char)(value >> 24);
+
+    return imx50_view_write(view, address, data, sizeof(data));
+}
+
+int imx50_view_compare(const void *a, const void *b) {
+    device_addr_t x = (*(imx50_view_page_t* const*)a)->address;
+    device_addr_t y = (*(imx50_view_page_t* const*)b)->address;
+
+    return (x > y) - (x < y);
+}
+
+/**
+    @brief Sends everything written through the view
+
+    Dirty pages are sorted so neighbouring writes go out
+    in as few commands as possible.
+
+    @param view The view
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_view_flush(imx50_view_t *view) {
+    imx50_view_page_t *list[VIEW_CACHE_PAGES];
+    unsigned int count = 0;
+    unsigned int i;
+    int ret;
+
+    SPAN_BEGIN();
+    for(i = 0; i < VIEW_CACHE_PAGES; i++) {
+        if(view->pages[i].dirty) {
+            list[count++] = &view->pages[i];
+        }
+    }
+    if(count == 0) {
+        SPAN_END();
+        return 0;
+    }
+    qsort(list, count, sizeof(list[0]), imx50_view_compare);
+    if((ret = imx50_view_write_pages(view, list, count)) != 0) {
+        if(IS_LOGGING(ERROR_LOG)) TRACE("[%s] E:Cannot write %u pages [%s:%d]\n", __FUNCTION__, count, __FILE__, __LINE__);
+        SPAN_END();
+        return ret;
+    }
+
+    SPAN_END();
+    return 0;
+}
+
+/**
+    @brief Forgets everything read through the view
+
+    Call it when the memory was changed some other way.
+    Writes not yet flushed are kept.
+
+    @param view The view
+**/
+IMX50USB_EXPORT void imx50_view_invalidate(imx50_view_t *view) {
+    unsigned int i;
+
+    for(i = 0; i < VIEW_CACHE_PAGES; i++) {
+        view->pages[i].valid = 0;
+    }
+}
+
+/**
+    @brief Flushes and frees a view
+
+    The view is freed even if the flush fails.
+
+    @param view The view
+
+    @return Zero on success, error code otherwise
+**/
+IMX50USB_EXPORT int imx50_close_view(imx50_view_t *view) {
+    int ret;
+
+    ret = imx50_view_flush(view);
+    free(view->buffer);
+    free(view);
+
+    return ret;
+}
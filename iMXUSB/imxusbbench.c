@@ -0,0 +1,484 @@
+//
+//  iMX50 USB Benchmark
+//
+//  Created by Yifan Lu
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#endif
+#include "imxusb.h"
+
+#define REMOVE_ARG      argc--; argv++
+#define MAX_RESULTS     64
+#define MAX_SAMPLES     1000
+
+const char *HELP =
+    "usage: imxusbbench [options] address\n"
+    "   options:\n"
+    "       -i count\n"
+    "           Number of times to run each test.\n"
+    "           Default is 20.\n"
+    "       -s size\n"
+    "           Largest transfer size to test.\n"
+    "           Default is 2MB, use less for IRAM.\n"
+    "       -o file\n"
+    "           Write results as JSON to file.\n"
+    "       -c file\n"
+    "           Compare results to a saved JSON file.\n"
+    "       -p percent\n"
+    "           For compare, slow down allowed before\n"
+    "           a test is a regression. Default is 10.\n"
+    "       -u depth\n"
+    "           Use libusb with depth data reports\n"
+    "           in flight instead of hidapi.\n"
+    "       -q depth\n"
+    "           Use hidraw with io_uring (Linux), up to\n"
+    "           depth reports per system call.\n"
+    "       -a file\n"
+    "           Record every report to file.\n"
+    "       -y file\n"
+    "           Play back a recording made with the\n"
+    "           same options instead of using a device.\n"
+    "       -t cpu\n"
+    "           Real-time priority and locked memory,\n"
+    "           on cpu, -1 for any.\n"
+    "       -r  Read reports on a background thread\n"
+    "       -k  Set up device as a Kindle (timed)\n"
+    "       -h  This help\n"
+    "       -d  Debug output\n"
+    "   address:\n"
+    "       Scratch memory to test with. Anything\n"
+    "       in address to address+size is destroyed.\n"
+    "   exit code is 2 if a regression was found.";
+
+typedef struct {
+    char name[32];
+    unsigned int size;
+    unsigned int chunk;
+    unsigned int iterations;
+    double p50_us;
+    double p99_us;
+    double mean_us;
+    double bytes_per_sec;
+} bench_result_t;
+
+typedef struct {
+    imx50_device_t *handle;
+    device_addr_t address;
+    unsigned char *buffer;
+    unsigned int size;
+    unsigned int chunk;
+} bench_args_t;
+
+typedef int (*bench_func_t)(bench_args_t *args);
+
+bench_result_t g_results[MAX_RESULTS];
+unsigned int g_num_results = 0;
+
+double bench_time_us() {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+#endif
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* tests */
+
+int bench_write_register(bench_args_t *args) {
+    return imx50_write_register(args->handle, args->address, 0x12345678, BITSOF(int));
+}
+
+int bench_read_memory(bench_args_t *args) {
+    return imx50_read_memory(args->handle, args->address, args->buffer, args->size);
+}
+
+int bench_write_memory(bench_args_t *args) {
+    unsigned int offset, trans_size;
+    for(offset = 0; offset < args->size; offset += trans_size) {
+        trans_size = (args->size - offset > args->chunk) ? args->chunk : args->size - offset;
+        if(imx50_write_memory(args->handle, args->address + offset, args->buffer + offset, trans_size) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bench_dcd_write(bench_args_t *args) {
+    // size is number of registers, all in scratch memory
+    dcd_t *regs = (dcd_t*)args->buffer;
+    unsigned int i;
+    for(i = 0; i < args->size; i++) {
+        regs[i].data_format = BITSOF(int);
+        regs[i].address = args->address + i * sizeof(int);
+        regs[i].value = i;
+    }
+    return imx50_dcd_write(args->handle, regs, args->size);
+}
+
+int bench_view(bench_args_t *args) {
+    // word at a time, as pointer code would
+    imx50_view_t *view;
+    unsigned int offset, value;
+    if((view = imx50_open_view(args->handle, args->address, args->size, 0)) == NULL) {
+        return -1;
+    }
+    for(offset = 0; offset + sizeof(int) <= args->size; offset += sizeof(int)) {
+        if(imx50_view_peek(view, args->address + offset, &value) != 0 ||
+           imx50_view_poke(view, args->address + offset, value + 1) != 0) {
+            imx50_close_view(view);
+            return -1;
+        }
+    }
+    return imx50_close_view(view);
+}
+
+int bench_kindle_init(bench_args_t *args) {
+    return imx50_kindle_init(args->handle);
+}
+
+/**
+    Runs a test iterations times and records the latency
+    percentiles. bytes is how much data one run moves.
+ */
+int run_bench(const char *name, bench_func_t func, bench_args_t *args, unsigned int bytes, unsigned int iterations) {
+    double samples[MAX_SAMPLES];
+    double start, total = 0;
+    bench_result_t *result;
+    unsigned int i;
+
+    if(g_num_results >= MAX_RESULTS) {
+        return -1;
+    }
+    if(iterations > MAX_SAMPLES) {
+        iterations = MAX_SAMPLES;
+    }
+    for(i = 0; i < iterations; i++) {
+        start = bench_time_us();
+        if(func(args) != 0) {
+            fprintf(stderr, "%s (size %u, chunk %u) failed.\n", name, args->size, args->chunk);
+            return -1;
+        }
+        samples[i] = bench_time_us() - start;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(double), compare_double);
+
+    result = &g_results[g_num_results++];
+    memset(result, 0, sizeof(bench_result_t));
+    strncpy(result->name, name, sizeof(result->name) - 1);
+    result->size = args->size;
+    result->chunk = args->chunk;
+    result->iterations = iterations;
+    result->p50_us = samples[iterations / 2];
+    result->p99_us = samples[(iterations * 99) / 100 < iterations ? (iterations * 99) / 100 : iterations - 1];
+    result->mean_us = total / iterations;
+    result->bytes_per_sec = (bytes > 0 && total > 0) ? bytes * (double)iterations * 1000000.0 / total : 0;
+
+    fprintf(stderr, "%-16s size %8u chunk %8u  p50 %10.0fus  p99 %10.0fus  %10.0f B/s\n",
+        result->name, result->size, result->chunk, result->p50_us, result->p99_us, result->bytes_per_sec);
+    return 0;
+}
+
+/* results */
+
+int write_results(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    unsigned int i;
+
+    if(!fp) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    // one result per line so compare can read it back without a JSON parser
+    fprintf(fp, "{\"version\": 1, \"results\": [\n");
+    for(i = 0; i < g_num_results; i++) {
+        fprintf(fp, "{\"name\": \"%s\", \"size\": %u, \"chunk\": %u, \"iterations\": %u, \"p50_us\": %.1f, \"p99_us\": %.1f, \"mean_us\": %.1f, \"bytes_per_sec\": %.1f}%s\n",
+            g_results[i].name, g_results[i].size, g_results[i].chunk, g_results[i].iterations,
+            g_results[i].p50_us, g_results[i].p99_us, g_results[i].mean_us, g_results[i].bytes_per_sec,
+            (i + 1 < g_num_results) ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+    return 0;
+}
+
+/**
+    Compares the results to a baseline written by
+    write_results(). Returns the number of regressions.
+ */
+int compare_results(const char *filename, double threshold) {
+    FILE *fp = fopen(filename, "r");
+    char line[512];
+    bench_result_t base;
+    unsigned int i;
+    int regressions = 0;
+
+    if(!fp) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        memset(&base, 0, sizeof(bench_result_t));
+        if(sscanf(line, "{\"name\": \"%31[^\"]\", \"size\": %u, \"chunk\": %u, \"iterations\": %u, \"p50_us\": %lf, \"p99_us\": %lf",
+            base.name, &base.size, &base.chunk, &base.iterations, &base.p50_us, &base.p99_us) != 6) {
+            continue;
+        }
+        for(i = 0; i < g_num_results; i++) {
+            if(strcmp(g_results[i].name, base.name) != 0 || g_results[i].size != base.size || g_results[i].chunk != base.chunk) {
+                continue;
+            }
+            if(g_results[i].p50_us > base.p50_us * (1.0 + threshold / 100.0) ||
+               g_results[i].p99_us > base.p99_us * (1.0 + threshold / 100.0)) {
+                fprintf(stderr, "REGRESSION %-16s size %8u chunk %8u  p50 %.0fus -> %.0fus  p99 %.0fus -> %.0fus\n",
+                    base.name, base.size, base.chunk, base.p50_us, g_results[i].p50_us, base.p99_us, g_results[i].p99_us);
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+int main(int argc, const char * argv[]) {
+    static const unsigned int dcd_counts[] = { 1, 16, MAX_DCD_WRITE_REG_CNT, 4 * MAX_DCD_WRITE_REG_CNT };
+    imx50_device_t *handle = NULL;
+    bench_args_t args;
+    device_addr_t address = 0;
+    unsigned int iterations = 20;
+    unsigned int max_size = MAX_DOWNLOAD_SIZE;
+    unsigned int size, chunk, i;
+    const char *out_file = NULL;
+    const char *base_file = NULL;
+    const char *capture_file = NULL;
+    const char *replay_file = NULL;
+    double threshold = 10;
+    int kindle = 0;
+    int reader = 0;
+    unsigned int stalled, dropped;
+    realtime_t realtime;
+    latency_t latency;
+    int cpu = -2; // not real-time
+    int transport = TRANSPORT_HIDAPI;
+    unsigned int queue_depth = 0;
+    int regressions = 0;
+
+    // default log level
+    imx50_log_level(WARNING_LOG);
+
+    /* parse arguments */
+    REMOVE_ARG; // first argument is useless
+    const char *arg;
+    while(argc > 0) {
+        arg = argv[0];
+        if(arg[0] == '-'){ // option
+            switch(arg[1]){
+                case 'k':
+                    kindle = 1;
+                    break;
+                case 'r':
+                    reader = 1;
+                    break;
+                case 'd':
+                    imx50_log_level(DEBUG_LOG);
+                    break;
+                case 'i':
+                case 's':
+                case 'o':
+                case 'c':
+                case 'p':
+                case 'u':
+                case 'q':
+                case 'a':
+                case 'y':
+                case 't':
+                    if(argc < 2){
+                        fprintf(stderr, "Not enough arguments\n");
+                        goto arg_error;
+                    }
+                    REMOVE_ARG;
+                    if(arg[1] == 'i'){
+                        iterations = (unsigned int)strtol(argv[0], NULL, 10);
+                    }else if(arg[1] == 's'){
+                        max_size = (unsigned int)strtol(argv[0], NULL, (argv[0][1] == 'x' || argv[0][1] == 'X') ? 16 : 10);
+                    }else if(arg[1] == 'o'){
+                        out_file = argv[0];
+                    }else if(arg[1] == 'c'){
+                        base_file = argv[0];
+                    }else if(arg[1] == 'a'){
+                        capture_file = argv[0];
+                    }else if(arg[1] == 'y'){
+                        replay_file = argv[0];
+                    }else if(arg[1] == 't'){
+                        cpu = (int)strtol(argv[0], NULL, 10);
+                    }else if(arg[1] == 'u' || arg[1] == 'q'){
+                        transport = (arg[1] == 'u') ? TRANSPORT_LIBUSB : TRANSPORT_HIDRAW;
+                        queue_depth = (unsigned int)strtol(argv[0], NULL, 10);
+                    }else{
+                        threshold = strtod(argv[0], NULL);
+                    }
+                    break;
+                case '?':
+                case 'h':
+                default:
+                    goto arg_error;
+                    break;
+            }
+            REMOVE_ARG;
+        } else { // no more options
+            break;
+        }
+    }
+    if(argc != 1) {
+        fprintf(stderr, "Expected an address\n");
+        goto arg_error;
+    }
+    arg = argv[0];
+    address = (unsigned int)strtol(arg, NULL, (arg[1] == 'x' || arg[1] == 'X') ? 16 : 10);
+    if(iterations == 0 || max_size < sizeof(int)) {
+        goto arg_error;
+    }
+
+    memset(&args, 0, sizeof(bench_args_t));
+    args.address = address;
+    args.buffer = malloc(max_size > 4 * MAX_DCD_WRITE_REG_CNT * sizeof(dcd_t) ? max_size : 4 * MAX_DCD_WRITE_REG_CNT * sizeof(dcd_t));
+    if(!args.buffer) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for(i = 0; i < max_size; i++) {
+        args.buffer[i] = (unsigned char)(i * 7);
+    }
+
+    /* wait for device */
+    fprintf(stderr, "Waiting for device...\n");
+    if(replay_file) {
+        handle = imx50_open_replay(replay_file, 1);
+    } else {
+        handle = imx50_open_device(transport, queue_depth);
+    }
+    if(handle == NULL){
+        fprintf(stderr, "Error connecting to device.\n");
+        return 1;
+    }
+    args.handle = handle;
+    if(capture_file && imx50_start_capture(handle, capture_file) != 0) {
+        fprintf(stderr, "Error recording to %s.\n", capture_file);
+        goto error;
+    }
+    if(cpu > -2) {
+        memset(&realtime, 0, sizeof(realtime_t));
+        realtime.cpu = cpu;
+        if(imx50_set_realtime(handle, &realtime) != 0) {
+            fprintf(stderr, "Error setting real-time mode.\n");
+            goto error;
+        }
+        fprintf(stderr, "Real-time mode:%s%s%s.\n", (realtime.applied & REALTIME_FIFO) ? " priority" : "",
+            (realtime.applied & REALTIME_AFFINITY) ? " affinity" : "", (realtime.applied & REALTIME_LOCKED) ? " locked" : "");
+    }
+    if(reader && imx50_start_reader(handle, 0) != 0) {
+        fprintf(stderr, "Error starting reader.\n");
+        goto error;
+    }
+
+    /* run tests */
+    if(kindle && run_bench("kindle_init", bench_kindle_init, &args, 0, 1) != 0) {
+        goto error;
+    }
+    args.size = sizeof(int);
+    if(run_bench("write_register", bench_write_register, &args, sizeof(int), iterations) != 0) {
+        goto error;
+    }
+    for(i = 0; i < sizeof(dcd_counts) / sizeof(dcd_counts[0]); i++) {
+        args.size = dcd_counts[i];
+        if(args.size * sizeof(int) > max_size) {
+            break;
+        }
+        if(run_bench("dcd_write", bench_dcd_write, &args, args.size * sizeof(int), iterations) != 0) {
+            goto error;
+        }
+    }
+    // transfer sizes, one command each
+    for(size = sizeof(int); size <= max_size; size *= 4) {
+        args.size = size;
+        args.chunk = size;
+        if(run_bench("read_memory", bench_read_memory, &args, size, iterations) != 0) {
+            goto error;
+        }
+        if(run_bench("write_memory", bench_write_memory, &args, size, iterations) != 0) {
+            goto error;
+        }
+    }
+    // chunk sizes for the largest transfer, too many tiny chunks takes forever
+    args.size = max_size;
+    for(chunk = (max_size / 64 > ROM_TRANSFER_SIZE) ? max_size / 64 : ROM_TRANSFER_SIZE; chunk < max_size; chunk *= 4) {
+        args.chunk = chunk;
+        if(run_bench("write_chunked", bench_write_memory, &args, max_size, iterations) != 0) {
+            goto error;
+        }
+    }
+    // small reads and writes through the cache
+    args.size = (max_size > 0x10000) ? 0x10000 : max_size;
+    if(run_bench("view_peek_poke", bench_view, &args, args.size * 2, iterations) != 0) {
+        goto error;
+    }
+
+    /* clean up */
+    imx50_get_latency(handle, &latency, 0);
+    fprintf(stderr, "%u round trips, p50 %uus  p99 %uus  p99.9 %uus  max %uus\n",
+        latency.count, latency.p50_us, latency.p99_us, latency.p999_us, latency.max_us);
+    if(reader && imx50_reader_stats(handle, &stalled, &dropped) == 0) {
+        fprintf(stderr, "Reader stalled %u times, dropped %u reports.\n", stalled, dropped);
+    }
+    imx50_close_device(handle);
+    free(args.buffer);
+
+    if(out_file && write_results(out_file) != 0) {
+        return 1;
+    }
+    if(base_file) {
+        regressions = compare_results(base_file, threshold);
+        if(regressions < 0) {
+            return 1;
+        }
+        fprintf(stderr, "%d regression(s) found.\n", regressions);
+    }
+    return regressions > 0 ? 2 : 0;
+arg_error:
+    fprintf(stderr, "%s\n", HELP);
+    return 1;
+error:
+    imx50_close_device(handle);
+    free(args.buffer);
+    return 1;
+}
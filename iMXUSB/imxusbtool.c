@@ -24,33 +24,95 @@
 #include <stdlib.h>
 #include <string.h>
 #endif
+#include <time.h>
 #include "imxusb.h"
 
 #define REMOVE_ARG      argc--; argv++
+#define PROGRESS_WIDTH  30
 
 extern void imx50_hex_dump(unsigned char *data, unsigned int size, unsigned int num);
 
 const char *HELP = 
     "usage: imxusbtool mode [options] address file|length|value\n"
+    "       imxusbtool -b [options] image\n"
+    "       imxusbtool -M [options] manifest\n"
     "   modes:\n"
     "       -r  Read from the device\n"
     "       -w  Write to the device\n"
     "       -j  Jump to an address\n"
     "       -g  R/W a register\n"
+    "       -t  Test the device's RAM\n"
+    "       -b  Boot an i.MX image (u-boot.imx)\n"
+    "       -M  Flash the files listed in a manifest\n"
     "   options:\n"
     "       -n  For jumps, do not add header\n"
     "           Device requires header for jumps.\n"
+    "       -o  For jumps, wait for the device to\n"
+    "           come back and show how long it took.\n"
     "       -x  For reading, output as hex dump\n"
     "           instead of binary data.\n"
-    "       -k  Set up device as a Kindle\n"
+    "       -p  For reading, read reports on a\n"
+    "           background thread (hidapi only).\n"
+    "       -e  For writes, run the file after\n"
+    "           loading. Header is sent with it.\n"
+    "       -v  For writes, check the file with a\n"
+    "           CRC routine run on the device.\n"
+    "       -i  For writes, read the file back and\n"
+    "           write again only what differs.\n"
+    "       -s  For writes, fill long runs of one\n"
+    "           value on the device, do not send them.\n"
+    "       -k  Set up device as a Kindle. With -v,\n"
+    "           read back the registers it wrote.\n"
+    "       -c percent\n"
+    "           For RAM tests, how much of the RAM\n"
+    "           to pattern test. Default is 100.\n"
+    "       -l ms\n"
+    "           For RAM tests, stop pattern tests\n"
+    "           after this many milliseconds.\n"
+    "       -m ms\n"
+    "           Give up if the device does not answer\n"
+    "           in ms. Default is 5000, -1 waits forever.\n"
+    "       -u depth\n"
+    "           Use libusb with depth data reports\n"
+    "           in flight instead of hidapi.\n"
+    "       -q depth\n"
+    "           Use hidraw with io_uring (Linux), up to\n"
+    "           depth reports per system call.\n"
+    "       -a file\n"
+    "           Record every report to file.\n"
+    "       -y file\n"
+    "           Play back a recording instead of\n"
+    "           using a device.\n"
+    "       -f  For play back, do not wait as long\n"
+    "           as the device did.\n"
+    "       --trace=file\n"
+    "           Write a timeline of every call and\n"
+    "           report to file (Chrome trace JSON).\n"
+    "       --plan=file\n"
+    "           Use the write plan saved in file for\n"
+    "           this device and port. If there is none,\n"
+    "           tune one in free IRAM and save it.\n"
+    "       --realtime[=cpu]\n"
+    "           Transfer at real-time priority, on cpu\n"
+    "           if given, with memory locked. Prints\n"
+    "           round trip times at the end.\n"
+    "       --cache=dir\n"
+    "           Keep files ready to send in dir, later\n"
+    "           loads of the same file skip reading it.\n"
     "       -h  This help\n"
     "       -d  Debug output\n"
     "   address:\n"
     "       All modes. Address to interact with.\n"
     "   file:\n"
     "       Write mode only. Name of file to download.\n"
+    "   image:\n"
+    "       Boot mode only. Image with IVT and DCD.\n"
+    "   manifest:\n"
+    "       Manifest mode only. Lines of:\n"
+    "       init kindle, write address value,\n"
+    "       load address file, jump address.\n"
     "   length:\n"
-    "       Read mode only. Number of bytes to read.\n"
+    "       Read and RAM test modes. Number of bytes.\n"
     "   value:\n"
     "       Register mode only. uint value to write.\n"
     "       Leave blank to read register.";
@@ -61,24 +123,79 @@ typedef enum {
     Write,
     Jump,
     RegisterRead,
-    RegisterWrite
+    RegisterWrite,
+    MemoryTest,
+    Boot,
+    Manifest
 } imx50_mode_t;
 
+// draws a progress bar on stderr
+int show_progress(void *context, const progress_t *status) {
+    unsigned int filled = status->total ? (unsigned int)((unsigned long long)status->done * PROGRESS_WIDTH / status->total) : PROGRESS_WIDTH;
+    unsigned int i;
+    
+    (void)context;
+    fprintf(stderr, "\r[");
+    for(i = 0; i < PROGRESS_WIDTH; i++) {
+        fputc(i < filled ? '=' : ' ', stderr);
+    }
+    fprintf(stderr, "] %3u%% %6u KB/s ETA %u:%02u ", 
+            status->total ? (unsigned int)((unsigned long long)status->done * 100 / status->total) : 100, 
+            status->rate / 1024, status->eta / 60000, status->eta / 1000 % 60);
+    if(status->done >= status->total) {
+        fprintf(stderr, "\n");
+    }
+    fflush(stderr);
+    
+    return 0;
+}
+
 typedef struct {
     int add_header;
     int hex_dump;
+    int pipelined;
     int kindle;
+    int execute;
+    int verify;
+    int readback;
+    int sparse;
+    unsigned int coverage;
+    unsigned int time_limit;
+    int transport;
+    unsigned int queue_depth;
+    int timeout;
+    const char *capture;
+    const char *replay;
+    int fast;
+    int follow;
+    const char *trace;
+    const char *plan;
+    int realtime;
+    int cpu;
+    const char *cache;
 } imx50_options_t;
 
 int main(int argc, const char * argv[]) {
     imx50_device_t *handle = NULL;
     imx50_mode_t mode = None;
-    imx50_options_t options = {1, 0, 0};
+    imx50_options_t options = {1, 0, 0, 0, 0, 0, 0, 0, 100, 0, TRANSPORT_HIDAPI, 0, DEFAULT_TIMEOUT, NULL, NULL, 0, 0, NULL, NULL, 0, -1, NULL};
     device_addr_t address = 0;
     char *filename = NULL;
     unsigned int length = 0;
     unsigned int value = 0;
     unsigned char *read_buffer;
+    memtest_t test;
+    crc_verify_t verify;
+    dcd_verify_t dcd_verify;
+    read_verify_t readback;
+    transfer_plan_t plan;
+    realtime_t realtime;
+    latency_t latency;
+    sparse_load_t sparse;
+    reenum_t reenum;
+    manifest_result_t manifest;
+    unsigned int i;
+    transfer_options_t transfer = {show_progress, NULL, 0};
     
     // default log level
     imx50_log_level(WARNING_LOG);
@@ -102,18 +219,91 @@ int main(int argc, const char * argv[]) {
                 case 'g':
                     mode = RegisterRead;
                     break;
+                case 't':
+                    mode = MemoryTest;
+                    break;
+                case 'b':
+                    mode = Boot;
+                    break;
+                case 'M':
+                    mode = Manifest;
+                    break;
                 case 'n':
                     options.add_header = 0;
                     break;
                 case 'x':
                     options.hex_dump = 1;
                     break;
+                case 'p':
+                    options.pipelined = 1;
+                    break;
                 case 'k':
                     options.kindle = 1;
                     break;
+                case 'e':
+                    options.execute = 1;
+                    break;
+                case 'v':
+                    options.verify = 1;
+                    break;
+                case 'i':
+                    options.readback = 1;
+                    break;
+                case 's':
+                    options.sparse = 1;
+                    break;
+                case 'f':
+                    options.fast = 1;
+                    break;
+                case 'o':
+                    options.follow = 1;
+                    break;
+                case 'c':
+                case 'l':
+                case 'm':
+                case 'u':
+                case 'q':
+                case 'a':
+                case 'y':
+                    if(argc < 2){
+                        fprintf(stderr, "Not enough arguments\n");
+                        goto arg_error;
+                    }
+                    REMOVE_ARG;
+                    if(arg[1] == 'c'){
+                        options.coverage = (unsigned int)strtol(argv[0], NULL, 10);
+                    }else if(arg[1] == 'a'){
+                        options.capture = argv[0];
+                    }else if(arg[1] == 'y'){
+                        options.replay = argv[0];
+                    }else if(arg[1] == 'm'){
+                        options.timeout = (int)strtol(argv[0], NULL, 10);
+                    }else if(arg[1] == 'u' || arg[1] == 'q'){
+                        options.transport = (arg[1] == 'u') ? TRANSPORT_LIBUSB : TRANSPORT_HIDRAW;
+                        options.queue_depth = (unsigned int)strtol(argv[0], NULL, 10);
+                    }else{
+                        options.time_limit = (unsigned int)strtol(argv[0], NULL, 10);
+                    }
+                    break;
                 case 'd':
                     imx50_log_level(DEBUG_LOG);
                     break;
+                case '-':
+                    if(strncmp(arg, "--trace=", 8) == 0 && arg[8] != '\0'){
+                        options.trace = arg + 8;
+                    }else if(strncmp(arg, "--plan=", 7) == 0 && arg[7] != '\0'){
+                        options.plan = arg + 7;
+                    }else if(strncmp(arg, "--cache=", 8) == 0 && arg[8] != '\0'){
+                        options.cache = arg + 8;
+                    }else if(strcmp(arg, "--realtime") == 0){
+                        options.realtime = 1;
+                    }else if(strncmp(arg, "--realtime=", 11) == 0 && arg[11] != '\0'){
+                        options.realtime = 1;
+                        options.cpu = (int)strtol(arg + 11, NULL, 10);
+                    }else{
+                        goto arg_error;
+                    }
+                    break;
                 case '?':
                 case 'h':
                 default:
@@ -133,11 +323,16 @@ int main(int argc, const char * argv[]) {
         goto arg_error;
     }
     arg = argv[0];
-    address = (unsigned int)strtol(arg, NULL, (arg[1] == 'x' || arg[1] == 'X') ? 16 : 10); // get address
+    if(mode == Boot || mode == Manifest) { // file has the addresses
+        filename = strdup(arg);
+    } else {
+        address = (unsigned int)strtol(arg, NULL, (arg[1] == 'x' || arg[1] == 'X') ? 16 : 10); // get address
+    }
     REMOVE_ARG;
     // final error check
     switch(mode){
         case Read:
+        case MemoryTest:
             if(argc < 1){
                 fprintf(stderr, "Not enough arguments\n");
                 goto arg_error;
@@ -157,6 +352,8 @@ int main(int argc, const char * argv[]) {
             }
             break;
         case Jump:
+        case Boot:
+        case Manifest:
             if(argc > 0){
                 fprintf(stderr, "Too many arguments\n");
                 goto arg_error;
@@ -176,20 +373,92 @@ int main(int argc, const char * argv[]) {
             goto arg_error;
     }
     
+    /* record a timeline, from the start */
+    if(options.trace && imx50_start_trace(options.trace) != 0) {
+        fprintf(stderr, "Error tracing to %s.\n", options.trace);
+        return 1;
+    }
+    
     /* wait for device */
     fprintf(stderr, "Waiting for device...\n");
-    handle = imx50_init_device();
+    if(options.replay){
+        handle = imx50_open_replay(options.replay, !options.fast);
+    }else{
+        handle = imx50_open_device(options.transport, options.queue_depth);
+    }
     if(handle == NULL){
         fprintf(stderr, "Error connecting to device.\n");
-        return 1;
+        goto error;
     }else{
-        fprintf(stderr, "Found a device.\n");
+        fprintf(stderr, "Found a device (%s).\n", imx50_get_profile(handle)->name);
+    }
+    
+    imx50_set_timeout(handle, 0, options.timeout);
+    
+    /* record reports */
+    if(options.capture && imx50_start_capture(handle, options.capture) != 0) {
+        fprintf(stderr, "Error recording to %s.\n", options.capture);
+        goto error;
     }
     
     /* init the device */
     if(options.kindle && imx50_kindle_init(handle) != 0) {
         fprintf(stderr, "Error initializing the Kindle.\n");
-        return 1;
+        goto error;
+    }
+    if(options.kindle && options.verify) {
+        memset(&dcd_verify, 0, sizeof(dcd_verify_t));
+        if(imx50_kindle_verify(handle, &dcd_verify) != 0) {
+            for(i = 0; i < dcd_verify.bad_count && i < DCD_VERIFY_MAX_BAD; i++) {
+                fprintf(stderr, "Register %0#8X is %0#8X, expected %0#8X (mask %0#8X).\n", dcd_verify.bad[i].address, dcd_verify.bad[i].actual, dcd_verify.bad[i].expected, dcd_verify.bad[i].mask);
+            }
+            fprintf(stderr, "Error verifying the Kindle's set up.\n");
+            goto error;
+        }
+        fprintf(stderr, "Verified %u registers in %u reads.\n", dcd_verify.checked, dcd_verify.reads);
+    }
+    
+    /* pick how writes are sent */
+    if(options.plan && imx50_load_plan(handle, options.plan) != 0) {
+        if(imx50_tune_transfers(handle, imx50_get_profile(handle)->routine, 0) != 0) {
+            fprintf(stderr, "Error tuning writes, using the defaults.\n");
+        } else if(imx50_save_plan(handle, options.plan) != 0) {
+            fprintf(stderr, "Error saving the plan to %s, it will be tuned again next time.\n", options.plan);
+        }
+    }
+    if(options.plan) {
+        imx50_get_plan(handle, &plan);
+        fprintf(stderr, "Writing %u bytes at a time with %u ms delay.\n", plan.chunk_size, plan.data_delay);
+    }
+    
+    /* send loads from prepared reports */
+    if(options.cache && imx50_set_cache(handle, options.cache) != 0) {
+        fprintf(stderr, "Error using cache %s.\n", options.cache);
+        goto error;
+    }
+    
+    /* keep the scheduler and page faults out of the way */
+    if(options.realtime) {
+        memset(&realtime, 0, sizeof(realtime_t));
+        realtime.cpu = options.cpu;
+        if(imx50_set_realtime(handle, &realtime) != 0) {
+            fprintf(stderr, "Error setting real-time mode.\n");
+            goto error;
+        }
+        fprintf(stderr, "Real-time mode:%s%s%s.\n", (realtime.applied & REALTIME_FIFO) ? " priority" : "", 
+                (realtime.applied & REALTIME_AFFINITY) ? " affinity" : "", (realtime.applied & REALTIME_LOCKED) ? " locked" : "");
+        imx50_get_latency(handle, &latency, 1); // only count the task
+    }
+    
+    /* read on another thread */
+    if(options.pipelined && imx50_start_reader(handle, 0) != 0) {
+        fprintf(stderr, "Error starting reader.\n");
+        goto error;
+    }
+    
+    /* show progress of long transfers */
+    if(mode == Read || mode == Write || mode == Boot || mode == Manifest) {
+        imx50_set_transfer_options(handle, &transfer);
     }
     
     /* do tasks */
@@ -214,6 +483,61 @@ int main(int argc, const char * argv[]) {
             break;
         case Write:
             fprintf(stderr, "Writing %s to %0#8X...\n", filename, address);
+            if(options.verify){
+                memset(&verify, 0, sizeof(crc_verify_t));
+                if(imx50_load_file_crc(handle, address, filename, &verify) != 0){
+                    for(i = 0; i < verify.bad_count; i++){
+                        fprintf(stderr, "Block at %0#8X (%u bytes) does not match.\n", address + verify.bad[i] * verify.block_size, verify.block_size);
+                    }
+                    fprintf(stderr, "Error verifying the device.\n");
+                    goto error;
+                }
+                fprintf(stderr, "Verified %u blocks of %u bytes.\n", verify.blocks, verify.block_size);
+                if(options.execute && imx50_jump(handle, imx50_add_header(handle, address)) != 0){
+                    fprintf(stderr, "Error running on the device.\n");
+                    goto error;
+                }
+                break;
+            }
+            if(options.readback){
+                memset(&readback, 0, sizeof(read_verify_t));
+                readback.rewrite = 1;
+                if(imx50_load_file_verify(handle, address, filename, &readback) != 0){
+                    for(i = 0; i < readback.range_count; i++){
+                        fprintf(stderr, "%u bytes at %0#8X do not match.\n", readback.ranges[i].size, readback.ranges[i].address);
+                    }
+                    fprintf(stderr, "Error verifying the device.\n");
+                    goto error;
+                }
+                if(readback.bad_bytes > 0){
+                    fprintf(stderr, "Wrote %u bytes again in %u ranges for %u bytes that differed.\n", readback.rewritten, readback.range_count, readback.bad_bytes);
+                }
+                if(options.execute && imx50_jump(handle, imx50_add_header(handle, address)) != 0){
+                    fprintf(stderr, "Error running on the device.\n");
+                    goto error;
+                }
+                break;
+            }
+            if(options.sparse){
+                memset(&sparse, 0, sizeof(sparse_load_t));
+                if(imx50_load_file_sparse(handle, address, filename, &sparse) != 0){
+                    fprintf(stderr, "Error writing to the device.\n");
+                    goto error;
+                }
+                fprintf(stderr, "Sent %u bytes, %u bytes in %u runs filled on the device.\n", sparse.sent, sparse.skipped, sparse.runs);
+                if(options.execute && imx50_jump(handle, imx50_add_header(handle, address)) != 0){
+                    fprintf(stderr, "Error running on the device.\n");
+                    goto error;
+                }
+                break;
+            }
+            if(options.execute){
+                if(imx50_load_and_jump(handle, address, filename, NULL) != 0){
+                    fprintf(stderr, "Error running on the device.\n");
+                    goto error;
+                }
+                break;
+            }
             if(imx50_load_file(handle, address, filename) != 0){
                 fprintf(stderr, "Error writing to the device.\n");
                 goto error;
@@ -224,11 +548,54 @@ int main(int argc, const char * argv[]) {
             if(options.add_header){
                 address = imx50_add_header(handle, address);
             }
+            if(options.follow){
+                if(imx50_jump_and_wait(handle, address, 0, &reenum, &handle) != 0){
+                    fprintf(stderr, "Device did not come back on %s.\n", reenum.port);
+                    goto error;
+                }
+                fprintf(stderr, "Left after %u ms, back on %s as %04X:%04X after %u ms.\n", reenum.gone_ms, reenum.port, reenum.vendor_id, reenum.product_id, reenum.back_ms);
+                if(handle){
+                    fprintf(stderr, "Ready for commands after %u ms.\n", reenum.ready_ms);
+                }
+                break;
+            }
             if(imx50_jump(handle, address) != 0){
                 fprintf(stderr, "Error jumping.\n");
                 goto error;
             }
             break;
+        case Boot:
+            fprintf(stderr, "Booting %s...\n", filename);
+            if(imx50_boot_image(handle, filename) != 0){
+                fprintf(stderr, "Error booting the image.\n");
+                goto error;
+            }
+            break;
+        case Manifest:
+            fprintf(stderr, "Flashing %s...\n", filename);
+            if(imx50_run_manifest(handle, filename, &manifest) != 0){
+                fprintf(stderr, "Error running the manifest.\n");
+                goto error;
+            }
+            fprintf(stderr, "Loaded %u files (%u bytes) as %u regions in %u writes.\n", manifest.payloads, manifest.bytes, manifest.regions, manifest.commands);
+            break;
+        case MemoryTest:
+            fprintf(stderr, "Testing %0#8X for %u bytes...\n", address, length);
+            memset(&test, 0, sizeof(memtest_t));
+            test.tests = MEMTEST_ALL;
+            test.coverage = options.coverage;
+            test.time_limit = options.time_limit;
+            test.seed = (unsigned int)time(NULL);
+            if(imx50_memory_test(handle, address, length, &test) != 0){
+                if(test.failed_test){
+                    fprintf(stderr, "RAM test failed at %0#8X, expected %0#8X, got %0#8X.\n", test.fail_address, test.expected, test.actual);
+                }else{
+                    fprintf(stderr, "Error testing the device.\n");
+                }
+                goto error;
+            }
+            fprintf(stderr, "RAM test passed, %u bytes pattern tested%s (seed %#X).\n", test.bytes_tested, test.complete ? "" : " before time limit", test.seed);
+            break;
         case RegisterWrite:
             fprintf(stderr, "Writing %0#8X to %0#8X...\n", value, address);
             if(imx50_write_register(handle, address, value, BITSOF(int)) != 0){
@@ -242,13 +609,23 @@ int main(int argc, const char * argv[]) {
     }
     
     /* clean up */
-    imx50_close_device(handle);
+    if(handle && options.realtime){
+        imx50_get_latency(handle, &latency, 0);
+        fprintf(stderr, "%u round trips, p50 %u us, p99 %u us, max %u us.\n", latency.count, latency.p50_us, latency.p99_us, latency.max_us);
+    }
+    if(handle){
+        imx50_close_device(handle);
+    }
+    if(imx50_stop_trace() != 0){
+        fprintf(stderr, "Error writing the trace.\n");
+    }
     
     free(filename);
     return 0;
 arg_error:
     fprintf(stderr, "%s\n", HELP);
 error:
+    imx50_stop_trace();
     return 1;
     
 }